@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.h"
+#include "memory.h"
+#include "native.h"
+#include "object.h"
+
+// Embedding API benchmark and check. Times a call through callFunction
+// on a prepared script against interpret() compiling a call each time,
+// then checks argument passing, errors, and a native calling back into
+// the script while collections move its objects.
+//
+// usage: bench_embed [--register] [--no-jit] [calls]
+
+static const char *script =
+	"fun add(a, b) { return a + b; }\n"
+	"fun greet(name) { return \"hello, \" + name; }\n"
+	"fun fails() { return [1][5]; }\n"
+	"fun churn(i) {\n"
+	"  var b = stringBuilder();\n"
+	"  append(b, \"item number \");\n"
+	"  append(b, i);\n"
+	"  return len(build(b));\n"
+	"}\n"
+	"fun viaHost(n) { return callEach(churn, n); }\n";
+
+// callEach(fn, n) calls fn(i) for i below n and sums the results.
+static bool callEachNative(VM *vm, int argCount, Value *args,
+						   Value *result) {
+  (void)argCount;
+  if (!IS_NUMBER(args[1])) return nativeError(vm, "n must be a number.");
+  int count = (int)AS_NUM(args[1]);
+  // Calls grow the stack, which moves args.
+  NativeHandle fn = nativeHandle(vm, args[0]);
+  double sum = 0;
+  for (int i = 0; i < count; i++) {
+	Value arg = INT_VAL(i);
+	Value value;
+	if (callFunction(vm, handleValue(vm, fn), 1, &arg, &value) !=
+		INTERPRET_OK) {
+	  return false;
+	}
+	if (!IS_NUMBER(value)) return nativeError(vm, "fn must return numbers.");
+	sum += AS_NUM(value);
+  }
+  *result = NUM_VAL(sum);
+  return true;
+}
+
+static const NativeDef hostNatives[] = {
+  {"callEach", callEachNative, 2, 2},
+  {NULL, NULL, 0, 0}
+};
+
+static const NativeModule hostModule = {NATIVE_API_VERSION, "host",
+										hostNatives};
+
+static Value global(VM *vm, const char *name) {
+  Value value;
+  if (!getGlobal(vm, name, &value)) {
+	fprintf(stderr, "%s is not defined\n", name);
+	exit(1);
+  }
+  return value;
+}
+
+static void check(bool ok, const char *what) {
+  printf("%-40s %s\n", what, ok ? "ok" : "FAILED");
+  if (!ok) exit(1);
+}
+
+int main(int argc, const char *argv[]) {
+  VM vm;
+  initVM(&vm);
+  int arg = 1;
+  for (; arg < argc && argv[arg][0] == '-'; arg++) {
+	if (strcmp(argv[arg], "--register") == 0) {
+	  vm.backend = BACKEND_REGISTER;
+	} else if (strcmp(argv[arg], "--no-jit") == 0) {
+	  vm.jitEnabled = false;
+	}
+  }
+  int calls = arg < argc ? atoi(argv[arg]) : 1000000;
+
+  int mark = handleMark(&vm);
+  defineNativeModule(&vm, &hostModule);
+  NativeHandle prepared = prepareScript(&vm, script);
+  Value result;
+  check(prepared >= 0 && callFunction(&vm, handleValue(&vm, prepared), 0,
+									  NULL, &result) == INTERPRET_OK,
+		"prepare and run the top level");
+  NativeHandle add = nativeHandle(&vm, global(&vm, "add"));
+
+  // Per-call overhead.
+  double start = gcNow();
+  double sum = 0;
+  for (int i = 0; i < calls; i++) {
+	Value args[2] = {INT_VAL(i), INT_VAL(1)};
+	callFunction(&vm, handleValue(&vm, add), 2, args, &result);
+	sum += AS_NUM(result);
+  }
+  double called = (gcNow() - start) / calls;
+  int interprets = calls / 100;
+  start = gcNow();
+  for (int i = 0; i < interprets; i++) interpret(&vm, "add(1, 2);");
+  double interpreted = (gcNow() - start) / interprets;
+  printf("callFunction %.3f us per call, interpret %.3f us per call\n",
+		 called * 1e6, interpreted * 1e6);
+  check(sum == (double)calls * (calls + 1) / 2, "callFunction results");
+
+  Value name = newStringLength(&vm, "embedder", 8);
+  check(callFunction(&vm, global(&vm, "greet"), 1, &name, &result) ==
+			INTERPRET_OK && stringLength(result) == 15,
+		"string argument and result");
+
+  Value one = INT_VAL(1);
+  check(callFunction(&vm, handleValue(&vm, add), 1, &one, &result) ==
+			INTERPRET_RUNTIME_ERROR,
+		"wrong arity is a runtime error");
+  check(callFunction(&vm, global(&vm, "fails"), 0, NULL, &result) ==
+			INTERPRET_RUNTIME_ERROR,
+		"runtime error in the callee");
+
+  // A native calling back 20000 times, with collections at the callbacks'
+  // safepoints moving the script's objects.
+  int minors = vm.gcStats.minorCount;
+  Value count = INT_VAL(20000);
+  check(callFunction(&vm, global(&vm, "viaHost"), 1, &count, &result) ==
+			INTERPRET_OK && AS_NUM(result) == 20000 * 12 + 88890,
+		"native calling back into the script");
+  printf("%d minor collections during the callbacks\n",
+		 vm.gcStats.minorCount - minors);
+
+  releaseHandles(&vm, mark);
+  freeVM(&vm);
+  return 0;
+}
@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "memory.h"
+#include "object.h"
+
+// String hash benchmark and collision check. hashBytes, folded to the 32
+// bits ObjString keeps, is compared with FNV-1a, the hash it replaced:
+// - speed on short identifiers and on long runtime strings;
+// - full 32-bit collisions over a key set;
+// - the groups a Swiss table insert probes with the key set at 7/8 load,
+//   simulated with the probe sequence of object.c.
+//
+// usage: bench_hash [count]
+
+typedef uint32_t (*HashFn)(const char *key, size_t length);
+
+static uint32_t fnv1a(const char *key, size_t length) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < length; i++) {
+	hash ^= (uint8_t)key[i];
+	hash *= 16777619;
+  }
+  return hash;
+}
+
+static uint32_t wyhash(const char *key, size_t length) {
+  uint64_t hash = hashBytes(key, length, 0);
+  return (uint32_t)(hash ^ (hash >> 32));
+}
+
+typedef struct {
+  const char *name;
+  HashFn hash;
+} Hasher;
+
+static const Hasher hashers[] = {
+  {"fnv1a", fnv1a},
+  {"wyhash", wyhash},
+};
+
+#define HASHER_COUNT (int)(sizeof(hashers) / sizeof(hashers[0]))
+
+typedef struct {
+  int count;
+  char **keys;
+  int *lengths;
+} KeySet;
+
+static void addKey(KeySet *set, const char *key, int length) {
+  set->keys[set->count] = malloc(length + 1);
+  memcpy(set->keys[set->count], key, length + 1);
+  set->lengths[set->count++] = length;
+}
+
+static KeySet newKeySet(int count) {
+  KeySet set = {0, malloc(sizeof(char *) * count),
+				malloc(sizeof(int) * count)};
+  return set;
+}
+
+static void freeKeySet(KeySet *set) {
+  for (int i = 0; i < set->count; i++) free(set->keys[i]);
+  free(set->keys);
+  free(set->lengths);
+}
+
+// Identifiers as a script would name them: ident_0, ident_1...
+static KeySet identifiers(int count) {
+  KeySet set = newKeySet(count);
+  for (int i = 0; i < count; i++) {
+	char key[32];
+	addKey(&set, key, snprintf(key, sizeof(key), "ident_%d", i));
+  }
+  return set;
+}
+
+// Strings over a 4-letter alphabet, which differ in few bits.
+static KeySet dna(int count) {
+  KeySet set = newKeySet(count);
+  for (int i = 0; i < count; i++) {
+	char key[17];
+	for (int j = 0; j < 16; j++) key[j] = "acgt"[(i >> (2 * j)) & 3];
+	key[16] = '\0';
+	addKey(&set, key, 16);
+  }
+  return set;
+}
+
+static volatile uint32_t sink;
+
+static void timeShort(const KeySet *set) {
+  for (int h = 0; h < HASHER_COUNT; h++) {
+	int rounds = 20;
+	double start = gcNow();
+	uint32_t sum = 0;
+	for (int round = 0; round < rounds; round++) {
+	  for (int i = 0; i < set->count; i++) {
+		sum += hashers[h].hash(set->keys[i], set->lengths[i]);
+	  }
+	}
+	double seconds = gcNow() - start;
+	sink = sum;
+	printf("  %-8s %6.2f ns per identifier\n", hashers[h].name,
+		   seconds * 1e9 / ((double)rounds * set->count));
+  }
+}
+
+static void timeLong(size_t length) {
+  char *text = malloc(length);
+  for (size_t i = 0; i < length; i++) text[i] = (char)(' ' + i % 95);
+  for (int h = 0; h < HASHER_COUNT; h++) {
+	int rounds = 20;
+	double start = gcNow();
+	uint32_t sum = 0;
+	for (int round = 0; round < rounds; round++) {
+	  text[0] = (char)round;
+	  sum += hashers[h].hash(text, length);
+	}
+	double seconds = gcNow() - start;
+	sink = sum;
+	printf("  %-8s %6.2f GB/s\n", hashers[h].name,
+		   (double)length * rounds / seconds / 1e9);
+  }
+  free(text);
+}
+
+static int compareHashes(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
+
+// A random function is expected to give n^2 / 2^33 full collisions.
+static int collisions(const uint32_t *hashes, int count) {
+  uint32_t *sorted = malloc(sizeof(uint32_t) * count);
+  memcpy(sorted, hashes, sizeof(uint32_t) * count);
+  qsort(sorted, count, sizeof(uint32_t), compareHashes);
+  int result = 0;
+  for (int i = 1; i < count; i++) result += sorted[i] == sorted[i - 1];
+  free(sorted);
+  return result;
+}
+
+// Inserts every hash into a table of the smallest capacity that holds
+// them at TABLE_MAX_LOAD and counts the groups each insert looks at.
+// Like findFree in object.c: the home group is hash >> 7, and probing
+// steps 1, 2, 3... groups on.
+static void probeLengths(const uint32_t *hashes, int count, double *mean,
+						 int *max) {
+  uint32_t capacity = TABLE_GROUP;
+  while (count > capacity * TABLE_MAX_LOAD) capacity *= 2;
+  uint32_t groups = capacity / TABLE_GROUP;
+  uint8_t *used = calloc(groups, 1);
+  long total = 0;
+  *max = 0;
+  for (int i = 0; i < count; i++) {
+	uint32_t group = (hashes[i] >> 7) & (groups - 1);
+	int probes = 1;
+	for (uint32_t step = 1; used[group] == TABLE_GROUP; step++) {
+	  group = (group + step) & (groups - 1);
+	  probes++;
+	}
+	used[group]++;
+	total += probes;
+	if (probes > *max) *max = probes;
+  }
+  *mean = (double)total / count;
+  free(used);
+}
+
+static void checkQuality(const char *name, const KeySet *set) {
+  printf("%s, %d keys: collisions, mean and worst groups probed\n", name,
+		 set->count);
+  uint32_t *hashes = malloc(sizeof(uint32_t) * set->count);
+  for (int h = 0; h < HASHER_COUNT; h++) {
+	for (int i = 0; i < set->count; i++) {
+	  hashes[i] = hashers[h].hash(set->keys[i], set->lengths[i]);
+	}
+	double mean;
+	int max;
+	probeLengths(hashes, set->count, &mean, &max);
+	printf("  %-8s %6d %8.3f %4d\n", hashers[h].name,
+		   collisions(hashes, set->count), mean, max);
+  }
+  free(hashes);
+}
+
+int main(int argc, const char *argv[]) {
+  // 7/8 of a power of two fills a table to its maximum load.
+  int count = argc > 1 ? atoi(argv[1]) : 229376;
+  printf("expected collisions for a random hash: %.1f\n",
+		 (double)count * count / 8589934592.0);
+  KeySet ids = identifiers(count);
+  KeySet bases = dna(count);
+
+  printf("short identifiers:\n");
+  timeShort(&ids);
+  printf("1 MiB strings:\n");
+  timeLong(1 << 20);
+  checkQuality("identifiers", &ids);
+  checkQuality("acgt strings", &bases);
+
+  freeKeySet(&ids);
+  freeKeySet(&bases);
+  return 0;
+}
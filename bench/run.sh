@@ -0,0 +1,47 @@
+#!/bin/bash
+# Runs bench/*.lox, or the scripts given, on the JIT, --no-jit and
+# --register backends. Each run's output must match the "// expect: "
+# lines of its script, and its wall time is reported. A script with an
+# "// expect runtime error: " line must fail with that message, and one
+# with an "// args: " line is run with those arguments. Images are removed
+# first, so every run compiles its script.
+#
+# usage: bench/run.sh path/to/clox [script.lox...]
+if [ $# -lt 1 ]; then
+  echo "usage: $0 path/to/clox [script.lox...]" >&2
+  exit 64
+fi
+clox=$1
+shift
+if [ $# -eq 0 ]; then set -- "$(dirname "$0")"/*.lox; fi
+
+failed=0
+for script in "$@"; do
+  expected=$(sed -n 's|^.*// expect: ||p' "$script")
+  error=$(sed -n 's|^.*// expect runtime error: ||p' "$script")
+  args=$(sed -n 's|^// args: ||p' "$script")
+  expectedStatus=0
+  if [ -n "$error" ]; then expectedStatus=70; fi
+  for backend in "" --no-jit --register; do
+    rm -f "${script}c"
+    start=$(date +%s.%N)
+    output=$("$clox" $backend $args "$script" 2>"${script}.err")
+    status=$?
+    end=$(date +%s.%N)
+    result=ok
+    if [ $status -ne $expectedStatus ] || [ "$output" != "$expected" ] ||
+        [ "$(cat "${script}.err")" != "$error" ]; then
+      result=FAILED
+      failed=1
+    fi
+    printf "%-24s %-10s %8.3f s  %s\n" "$(basename "$script")" \
+        "${backend:-jit}" "$(awk "BEGIN { print $end - $start }")" "$result"
+    if [ $result = FAILED ]; then
+      echo "exit status $status"
+      diff <(echo "$expected") <(echo "$output") | head -10
+      head -5 "${script}.err"
+    fi
+  done
+  rm -f "${script}c" "${script}.err"
+done
+exit $failed
@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.h"
+#include "memory.h"
+#include "object.h"
+
+// Table microbenchmarks: interning identifiers into vm->strings, resolving
+// global names to slots, and get, set and delete on a table of its own.
+// Nothing runs a safepoint, so no collection frees the strings in between.
+//
+// usage: bench_table [count]
+
+#define RUNS 3
+
+static int count;
+static char **names;
+static int *lengths;
+static ObjString **strings;
+
+typedef void (*Workload)(VM *vm);
+
+static void intern(VM *vm) {
+  for (int i = 0; i < count; i++) {
+	strings[i] = copyString(vm, names[i], lengths[i]);
+  }
+}
+
+static void reintern(VM *vm) {
+  for (int round = 0; round < 10; round++) intern(vm);
+}
+
+static void resolveGlobals(VM *vm) {
+  // Slots are capped at GLOBAL_MAX, later names resolve to -1.
+  for (int round = 0; round < 10; round++) {
+	for (int i = 0; i < count; i++) globalSlot(vm, OBJ_VAL(strings[i]));
+  }
+}
+
+static void setGet(VM *vm) {
+  Table table;
+  initTable(&table);
+  for (int round = 0; round < 10; round++) {
+	for (int i = 0; i < count; i++) {
+	  tableSet(vm, &table, OBJ_VAL(strings[i]), INT_VAL(i));
+	}
+	Value value;
+	for (int i = 0; i < count; i++) {
+	  if (!tableGet(&table, OBJ_VAL(strings[i]), &value) ||
+		  AS_INT(value) != i) {
+		fprintf(stderr, "tableGet lost %s\n", names[i]);
+		exit(1);
+	  }
+	}
+  }
+  freeTable(vm, &table);
+}
+
+// Deleting everything and filling the table again leaves a deleted slot
+// wherever a group had no empty one left.
+static void churn(VM *vm) {
+  Table table;
+  initTable(&table);
+  for (int i = 0; i < count; i++) {
+	tableSet(vm, &table, OBJ_VAL(strings[i]), NIL_VAL);
+  }
+  for (int round = 0; round < 20; round++) {
+	for (int i = 0; i < count; i++) tableDelete(&table, OBJ_VAL(strings[i]));
+	for (int i = 0; i < count; i++) {
+	  tableSet(vm, &table, OBJ_VAL(strings[i]), NIL_VAL);
+	}
+  }
+  if (table.count != count) {
+	fprintf(stderr, "churn left %d entries\n", table.count);
+	exit(1);
+  }
+  freeTable(vm, &table);
+}
+
+// Best wall time of RUNS, each in a fresh VM. Every workload but the
+// first starts from the identifiers already interned.
+static void run(const char *name, Workload workload) {
+  double best = 0;
+  for (int i = 0; i < RUNS; i++) {
+	VM vm;
+	initVM(&vm);
+	if (workload != intern) intern(&vm);
+	double start = gcNow();
+	workload(&vm);
+	double seconds = gcNow() - start;
+	if (i == 0 || seconds < best) best = seconds;
+	freeVM(&vm);
+  }
+  printf("%-16s %8.1f ms\n", name, best * 1000);
+}
+
+int main(int argc, const char *argv[]) {
+  count = argc > 1 ? atoi(argv[1]) : 200000;
+  names = malloc(sizeof(char *) * count);
+  lengths = malloc(sizeof(int) * count);
+  strings = malloc(sizeof(ObjString *) * count);
+  for (int i = 0; i < count; i++) {
+	char name[32];
+	lengths[i] = snprintf(name, sizeof(name), "ident_%d", i);
+	names[i] = malloc(lengths[i] + 1);
+	memcpy(names[i], name, lengths[i] + 1);
+  }
+
+  printf("%d identifiers, best of %d\n", count, RUNS);
+  run("intern", intern);
+  run("reintern x10", reintern);
+  run("globals x10", resolveGlobals);
+  run("set+get x10", setGet);
+  run("churn x20", churn);
+
+  for (int i = 0; i < count; i++) free(names[i]);
+  free(names);
+  free(lengths);
+  free(strings);
+  return 0;
+}
@@ -0,0 +1,592 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "vm.h"
+#include "memory.h"
+#include "compiler.h"
+#include "hash.h"
+
+typedef enum {
+  CONST_NUM,
+  CONST_STRING,
+  CONST_FN,
+  CONST_NIL,
+  CONST_TRUE,
+  CONST_FALSE,
+  CONST_INT,
+} ConstantTag;
+
+#define HEADER_SIZE (4 + sizeof(uint32_t) + sizeof(uint64_t))
+
+uint64_t hashSource(const char *source) {
+  return hashBytes(source, strlen(source), 0);
+}
+
+bool openImage(Image *image, const char *path, uint64_t sourceHash) {
+  image->base = NULL;
+  image->size = 0;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < HEADER_SIZE) {
+    close(fd);
+    return false;
+  }
+  void *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) return false;
+
+  uint32_t version;
+  memcpy(&version, (uint8_t *)base + 4, sizeof(version));
+  memcpy(&image->sourceHash, (uint8_t *)base + 4 + sizeof(version),
+         sizeof(image->sourceHash));
+  if (memcmp(base, IMAGE_MAGIC, 4) != 0 || version != IMAGE_VERSION ||
+      image->sourceHash != sourceHash) {
+    munmap(base, st.st_size);
+    return false;
+  }
+  image->base = base;
+  image->size = st.st_size;
+  return true;
+}
+
+void closeImage(Image *image) {
+  if (image->base != NULL) munmap((void *)image->base, image->size);
+  image->base = NULL;
+  image->size = 0;
+}
+
+typedef struct {
+  const uint8_t *p;
+  const uint8_t *end;
+  // Image global slot -> slot of the same name in the loading VM.
+  int *globalSlots;
+  uint32_t globalCount;
+} Reader;
+
+static bool readBytes(Reader *reader, void *dest, size_t length) {
+  if ((size_t)(reader->end - reader->p) < length) return false;
+  memcpy(dest, reader->p, length);
+  reader->p += length;
+  return true;
+}
+
+static bool readU32(Reader *reader, uint32_t *value) {
+  return readBytes(reader, value, sizeof(*value));
+}
+
+// Returns a pointer into the mapping, the caller copies what it keeps.
+static const uint8_t *readBlob(Reader *reader, uint32_t length) {
+  if ((size_t)(reader->end - reader->p) < length) return NULL;
+  const uint8_t *blob = reader->p;
+  reader->p += length;
+  return blob;
+}
+
+static bool jumpTarget(const uint8_t *starts, Chunk *chunk, int next,
+                       int offset) {
+  int target = next + offset;
+  return target >= 0 && target < chunk->count && starts[target];
+}
+
+// How many values instruction code pops and pushes, and how deep the
+// stack must be for it, counted from the frame's slot 0. terminal is set
+// for instructions execution doesn't fall through.
+typedef struct {
+  int pops;
+  int pushes;
+  bool terminal;
+} StackEffect;
+
+static StackEffect stackEffect(const uint8_t *code) {
+  StackEffect effect = {0, 0, false};
+  switch (code[0]) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_GLOBAL:
+    case OP_GET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_CLOSURE:
+    case OP_ADD_LOCALS:
+      effect.pushes = 1;
+      break;
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_LESS:
+    case OP_EQ:
+    case OP_GET_INDEX:
+      effect.pops = 2;
+      effect.pushes = 1;
+      break;
+    case OP_NEGATE:
+    case OP_ADD_CONST:
+    case OP_SET_GLOBAL:
+    case OP_SET_LOCAL:
+    case OP_SET_UPVALUE:
+      effect.pops = 1;
+      effect.pushes = 1;
+      break;
+    case OP_PRINT:
+    case OP_POP:
+    case OP_DEFINE_GLOBAL:
+    case OP_CLOSE_UPVALUE:
+    case OP_JUMP_IF:
+    case OP_STORE_LOCAL:
+      effect.pops = 1;
+      break;
+    case OP_SET_INDEX:
+      effect.pops = 3;
+      effect.pushes = 1;
+      break;
+    case OP_DELETE_INDEX:
+      effect.pops = 2;
+      break;
+    case OP_CALL:
+      effect.pops = code[1] + 1;
+      effect.pushes = 1;
+      break;
+    case OP_LIST:
+      effect.pops = code[1];
+      effect.pushes = 1;
+      break;
+    case OP_MAP:
+      effect.pops = 2 * code[1];
+      effect.pushes = 1;
+      break;
+    case OP_TAIL_CALL:
+      effect.pops = code[1] + 1;
+      effect.terminal = true;
+      break;
+    case OP_RETURN:
+      effect.pops = 1;
+      effect.terminal = true;
+      break;
+    case OP_JUMP:
+    case OP_LOOP:
+      effect.terminal = true;
+      break;
+    default:
+      break;
+  }
+  return effect;
+}
+
+// The first local slot operand of code that must be below the stack
+// height, -1 if none; second is set for instructions with two.
+static int localOperand(const uint8_t *code, int *second) {
+  *second = -1;
+  switch (code[0]) {
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_INC_LOCAL:
+    case OP_LESS_LOCAL_CONST_JUMP:
+      return code[1];
+    case OP_STORE_LOCAL:
+      // Stored after the value is popped.
+      return code[1] + 1;
+    case OP_ADD_LOCALS:
+    case OP_LESS_LOCALS_JUMP:
+      *second = code[2];
+      return code[1];
+    default:
+      return -1;
+  }
+}
+
+static int jumpOffset(const uint8_t *code, int next) {
+  switch (code[0]) {
+    case OP_JUMP_IF:
+    case OP_JUMP:
+      return next + ((code[1] << 8) | code[2]);
+    case OP_LOOP:
+      return next - ((code[1] << 8) | code[2]);
+    case OP_LESS_LOCAL_CONST_JUMP:
+    case OP_LESS_LOCALS_JUMP:
+      return next + ((code[3] << 8) | code[4]);
+    default:
+      return -1;
+  }
+}
+
+// Follows every path through fn's code and checks that the stack height
+// where paths meet agrees, that no instruction pops below the frame or
+// pushes past the FRAME_SLOTS a call reserves, and that locals and
+// captured slots are below the height.
+static bool verifyStack(ObjFn *fn) {
+  Chunk *chunk = &fn->chunk;
+  int *heights = malloc(sizeof(int) * chunk->count);
+  int *work = malloc(sizeof(int) * chunk->count);
+  for (int i = 0; i < chunk->count; i++) heights[i] = -1;
+  int workCount = 0;
+  heights[0] = fn->arity + 1;
+  work[workCount++] = 0;
+  bool valid = true;
+  while (valid && workCount > 0) {
+    int offset = work[--workCount];
+    const uint8_t *code = chunk->code + offset;
+    int height = heights[offset];
+    int next = offset + instructionLength(chunk, offset);
+    StackEffect effect = stackEffect(code);
+    int second;
+    int local = localOperand(code, &second);
+    if (local >= height || second >= height ||
+        (code[0] == OP_GET_LOCAL && local > INT8_MAX)) {
+      valid = false;
+      break;
+    }
+    if (code[0] == OP_CLOSURE) {
+      ObjFn *inner = AS_FN(chunk->constants.values[code[1]]);
+      for (int i = 0; i < inner->upvalueCount; i++) {
+        if (code[2 + 2 * i] == 1 && code[3 + 2 * i] >= height) {
+          valid = false;
+        }
+      }
+    }
+    if (effect.pops > height) valid = false;
+    height += effect.pushes - effect.pops;
+    if (height > FRAME_SLOTS) valid = false;
+    int successors[2] = {effect.terminal ? -1 : next, jumpOffset(code, next)};
+    for (int i = 0; valid && i < 2; i++) {
+      int target = successors[i];
+      if (target < 0) continue;
+      if (target >= chunk->count) {
+        valid = false;
+      } else if (heights[target] < 0) {
+        heights[target] = height;
+        work[workCount++] = target;
+      } else if (heights[target] != height) {
+        valid = false;
+      }
+    }
+  }
+  free(heights);
+  free(work);
+  return valid;
+}
+
+// Checks every operand of fn's code against its chunk before anything
+// runs it, and points global slots at the loading VM's. An image that
+// passed the hash check can still be truncated or corrupt, and the
+// interpreters, the lowering and the JIT all trust the code.
+static bool verifyCode(Reader *reader, ObjFn *fn) {
+  Chunk *chunk = &fn->chunk;
+  int constantCount = chunk->constants.count;
+  // Where instructions start, for checking jump targets.
+  uint8_t *starts = calloc(chunk->count + 1, 1);
+  bool valid = chunk->count > 0;
+  int last = 0;
+  int offset = 0;
+  while (valid && offset < chunk->count) {
+    uint8_t op = chunk->code[offset];
+    if (op > OP_DELETE_INDEX) {
+      valid = false;
+      break;
+    }
+    if (op == OP_CLOSURE) {
+      if (offset + 1 >= chunk->count ||
+          chunk->code[offset + 1] >= constantCount ||
+          !isObjType(chunk->constants.values[chunk->code[offset + 1]],
+                     OBJ_FN)) {
+        valid = false;
+        break;
+      }
+    }
+    int length = instructionLength(chunk, offset);
+    if (offset + length > chunk->count) {
+      valid = false;
+      break;
+    }
+    starts[offset] = 1;
+    last = offset;
+    offset += length;
+  }
+  // Execution must not run off the end.
+  if (valid) {
+    uint8_t op = chunk->code[last];
+    valid = op == OP_RETURN || op == OP_TAIL_CALL || op == OP_JUMP ||
+            op == OP_LOOP;
+  }
+
+  for (offset = 0; valid && offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    uint8_t *code = chunk->code + offset;
+    int next = offset + instructionLength(chunk, offset);
+    switch (code[0]) {
+      case OP_DEFINE_GLOBAL:
+      case OP_GET_GLOBAL:
+      case OP_SET_GLOBAL: {
+        uint16_t slot = (uint16_t)((code[1] << 8) | code[2]);
+        if (slot >= reader->globalCount) {
+          valid = false;
+          break;
+        }
+        int mapped = reader->globalSlots[slot];
+        code[1] = (mapped >> 8) & 0xff;
+        code[2] = mapped & 0xff;
+        break;
+      }
+      case OP_CONSTANT:
+      case OP_ADD_CONST:
+        valid = code[1] < constantCount;
+        break;
+      case OP_CONSTANT_LONG:
+        valid = (code[1] | code[2] << 8 | code[3] << 16) < constantCount;
+        break;
+      case OP_GET_UPVALUE:
+      case OP_SET_UPVALUE:
+        valid = code[1] < fn->upvalueCount;
+        break;
+      case OP_JUMP_IF:
+      case OP_JUMP:
+        valid = jumpTarget(starts, chunk, next, (code[1] << 8) | code[2]);
+        break;
+      case OP_LOOP:
+        valid = jumpTarget(starts, chunk, next, -((code[1] << 8) | code[2]));
+        break;
+      case OP_LESS_LOCAL_CONST_JUMP:
+        valid = code[2] < constantCount &&
+                jumpTarget(starts, chunk, next, (code[3] << 8) | code[4]);
+        break;
+      case OP_LESS_LOCALS_JUMP:
+        valid = jumpTarget(starts, chunk, next, (code[3] << 8) | code[4]);
+        break;
+      case OP_CLOSURE: {
+        ObjFn *inner = AS_FN(chunk->constants.values[code[1]]);
+        for (int i = 0; valid && i < inner->upvalueCount; i++) {
+          uint8_t isLocal = code[2 + 2 * i];
+          uint8_t index = code[3 + 2 * i];
+          valid = isLocal == 1 || (isLocal == 0 && index < fn->upvalueCount);
+        }
+        break;
+      }
+      default:
+        break;
+    }
+  }
+  free(starts);
+  return valid && verifyStack(fn);
+}
+
+// Everything allocated while a function is rebuilt stays on the VM stack
+// until it is reachable from the function, so a collection in the middle
+// of loading can't free it.
+static ObjFn *readFn(VM *vm, Reader *reader) {
+  uint32_t arity, upvalueCount, nameLength, codeCount, constantCount;
+  if (!readU32(reader, &arity) || !readU32(reader, &upvalueCount) ||
+      !readU32(reader, &nameLength)) {
+    return NULL;
+  }
+  ObjFn *fn = newFn(vm);
+  *vm->sp++ = OBJ_VAL(fn);
+  if (arity > UINT8_MAX || upvalueCount > UINT8_MAX) goto fail;
+  fn->arity = (int)arity;
+  fn->upvalueCount = (int)upvalueCount;
+  if (nameLength != IMAGE_NO_NAME) {
+    const uint8_t *name = readBlob(reader, nameLength);
+    if (name == NULL) goto fail;
+    fn->name = copyString(vm, (const char *)name, nameLength);
+  }
+
+  if (!readU32(reader, &codeCount)) goto fail;
+  const uint8_t *code = readBlob(reader, codeCount);
+  if (code == NULL) goto fail;
+  if (codeCount > 0) {
+    fn->chunk.code = ALLOCATE_ARRAY(vm, uint8_t, codeCount);
+    memcpy(fn->chunk.code, code, codeCount);
+    fn->chunk.count = (int)codeCount;
+    fn->chunk.capacity = (int)codeCount;
+  }
+
+  if (!readU32(reader, &constantCount)) goto fail;
+  for (uint32_t i = 0; i < constantCount; i++) {
+    uint8_t tag;
+    if (!readBytes(reader, &tag, 1)) goto fail;
+    Value value;
+    switch (tag) {
+      case CONST_NUM: {
+        double num;
+        if (!readBytes(reader, &num, sizeof(num))) goto fail;
+        value = NUM_VAL(num);
+        break;
+      }
+      case CONST_STRING: {
+        uint32_t length;
+        if (!readU32(reader, &length)) goto fail;
+        const uint8_t *chars = readBlob(reader, length);
+        if (chars == NULL) goto fail;
+        value = newStringLength(vm, (const char *)chars, length);
+        break;
+      }
+      case CONST_FN: {
+        ObjFn *inner = readFn(vm, reader);
+        if (inner == NULL) goto fail;
+        value = OBJ_VAL(inner);
+        break;
+      }
+      case CONST_INT: {
+        int32_t num;
+        if (!readBytes(reader, &num, sizeof(num))) goto fail;
+        value = INT_VAL(num);
+        break;
+      }
+      case CONST_NIL: value = NIL_VAL;
+        break;
+      case CONST_TRUE: value = TRUE_VAL;
+        break;
+      case CONST_FALSE: value = FALSE_VAL;
+        break;
+      default: goto fail;
+    }
+    *vm->sp++ = value;
+    addConstant(vm, &fn->chunk, value);
+    vm->sp--;
+  }
+  if (!verifyCode(reader, fn)) goto fail;
+  vm->sp--;
+  return fn;
+
+fail:
+  vm->sp--;
+  return NULL;
+}
+
+ObjFn *loadImage(VM *vm, const Image *image) {
+  if (image->base == NULL) return NULL;
+  Reader reader;
+  reader.p = image->base + HEADER_SIZE;
+  reader.end = image->base + image->size;
+  reader.globalSlots = NULL;
+  if (!readU32(&reader, &reader.globalCount) ||
+      reader.globalCount > GLOBAL_MAX) {
+    return NULL;
+  }
+  ObjFn *fn = NULL;
+  reader.globalSlots = malloc(sizeof(int) * reader.globalCount);
+  for (uint32_t i = 0; i < reader.globalCount; i++) {
+    uint32_t length;
+    if (!readU32(&reader, &length)) goto done;
+    const uint8_t *name = readBlob(&reader, length);
+    if (name == NULL) goto done;
+    Value string = newStringLength(vm, (const char *)name, length);
+    reader.globalSlots[i] = globalSlot(vm, string);
+    if (reader.globalSlots[i] < 0) goto done;
+  }
+  fn = readFn(vm, &reader);
+  if (reader.p != reader.end) fn = NULL;
+
+done:
+  free(reader.globalSlots);
+  return fn;
+}
+
+static void writeU32(FILE *file, uint32_t value) {
+  fwrite(&value, sizeof(value), 1, file);
+}
+
+// A small or interned string, as its length and characters.
+static void writeString(FILE *file, Value string) {
+  char buffer[SMALL_STRING_MAX + 1];
+  uint32_t length = stringLength(string);
+  writeU32(file, length);
+  fwrite(stringChars(string, buffer), 1, length, file);
+}
+
+static void writeFn(FILE *file, ObjFn *fn) {
+  writeU32(file, (uint32_t)fn->arity);
+  writeU32(file, (uint32_t)fn->upvalueCount);
+  if (fn->name == NULL) {
+    writeU32(file, IMAGE_NO_NAME);
+  } else {
+    writeU32(file, fn->name->length);
+    fwrite(fn->name->value, 1, fn->name->length, file);
+  }
+  writeU32(file, (uint32_t)fn->chunk.count);
+  fwrite(fn->chunk.code, 1, fn->chunk.count, file);
+
+  ValueArray *constants = &fn->chunk.constants;
+  writeU32(file, (uint32_t)constants->count);
+  for (int i = 0; i < constants->count; i++) {
+    Value value = constants->values[i];
+    uint8_t tag;
+    if (IS_INT(value)) {
+      int32_t num = AS_INT(value);
+      tag = CONST_INT;
+      fwrite(&tag, 1, 1, file);
+      fwrite(&num, sizeof(num), 1, file);
+    } else if (IS_NUMBER(value)) {
+      double num = AS_NUM(value);
+      tag = CONST_NUM;
+      fwrite(&tag, 1, 1, file);
+      fwrite(&num, sizeof(num), 1, file);
+    } else if (isString(value)) {
+      tag = CONST_STRING;
+      fwrite(&tag, 1, 1, file);
+      writeString(file, value);
+    } else if (isObjType(value, OBJ_FN)) {
+      tag = CONST_FN;
+      fwrite(&tag, 1, 1, file);
+      writeFn(file, AS_FN(value));
+    } else {
+      tag = IS_NIL(value) ? CONST_NIL : AS_BOOL(value) ? CONST_TRUE
+                                                       : CONST_FALSE;
+      fwrite(&tag, 1, 1, file);
+    }
+  }
+}
+
+static void writeGlobals(FILE *file, VM *vm) {
+  int count = vm->globalValues.count;
+  Value *names = calloc(count, sizeof(Value));
+  Table *table = &vm->globalNames;
+  for (int i = 0; i < table->capacity; i++) {
+    Entry *entry = &table->entries[i];
+    if (IS_NIL(entry->key)) continue;
+    names[(int)AS_NUM(entry->value)] = entry->key;
+  }
+  writeU32(file, (uint32_t)count);
+  for (int i = 0; i < count; i++) writeString(file, names[i]);
+  free(names);
+}
+
+bool writeImage(VM *vm, ObjFn *fn, const char *path, uint64_t sourceHash) {
+  // Write next to the target and rename, so a concurrent reader never maps
+  // a half-written image.
+  size_t pathLength = strlen(path);
+  char tmpPath[pathLength + 5];
+  memcpy(tmpPath, path, pathLength);
+  memcpy(tmpPath + pathLength, ".tmp", 5);
+
+  FILE *file = fopen(tmpPath, "wb");
+  if (file == NULL) return false;
+  uint32_t version = IMAGE_VERSION;
+  fwrite(IMAGE_MAGIC, 1, 4, file);
+  fwrite(&version, sizeof(version), 1, file);
+  fwrite(&sourceHash, sizeof(sourceHash), 1, file);
+  writeGlobals(file, vm);
+  writeFn(file, fn);
+  bool ok = !ferror(file);
+  if (fclose(file) != 0) ok = false;
+  if (!ok || rename(tmpPath, path) != 0) {
+    remove(tmpPath);
+    return false;
+  }
+  return true;
+}
+
+bool cacheSource(VM *vm, const char *source, const char *path,
+                 uint64_t hash) {
+  ObjFn *fn = compile(vm, source);
+  if (fn == NULL) return false;
+  return writeImage(vm, fn, path, hash);
+}
@@ -0,0 +1,49 @@
+#ifndef CLOX_CACHE_H
+#define CLOX_CACHE_H
+
+#include "common.h"
+#include "clox.h"
+#include "object.h"
+
+// On-disk bytecode image. The layout is native-endian:
+//
+//   header   magic "CLXC", u32 version, u64 source hash
+//   globals  u32 count, then u32 length + name for each global slot the
+//            image was compiled against
+//   function u32 arity, u32 upvalueCount, u32 nameLength (IMAGE_NO_NAME
+//            for the top-level script) + name bytes, u32 codeCount + code,
+//            u32 constantCount + constants
+//   constant u8 tag, then a double, an int32, a u32 length + bytes, or a
+//            nested function record
+//
+// Bump IMAGE_VERSION whenever the bytecode or the layout changes.
+
+#define IMAGE_MAGIC   "CLXC"
+#define IMAGE_VERSION 4
+#define IMAGE_NO_NAME UINT32_MAX
+
+typedef struct {
+  const uint8_t *base;   // mmap'ed file contents
+  size_t size;
+  uint64_t sourceHash;
+} Image;
+
+uint64_t hashSource(const char *source);
+
+// Maps the image at path. Fails if the file is missing, truncated, written
+// by another version or compiled from a different source.
+bool openImage(Image *image, const char *path, uint64_t sourceHash);
+void closeImage(Image *image);
+
+// Rebuilds the function tree without running the scanner or the parser.
+// Global slot operands are remapped to the slots the names have in vm.
+// Returns NULL if the image is corrupt.
+ObjFn *loadImage(VM *vm, const Image *image);
+
+bool writeImage(VM *vm, ObjFn *fn, const char *path, uint64_t sourceHash);
+
+// Compiles source and writes its image to path, tagged with hash.
+bool cacheSource(VM *vm, const char *source, const char *path,
+                 uint64_t hash);
+
+#endif
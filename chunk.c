@@ -31,3 +31,40 @@ int addConstant(VM *vm, Chunk *chunk, Value value) {
   return chunk->constants.count - 1;
 }
 
+
+int instructionLength(Chunk *chunk, int offset) {
+  switch (chunk->code[offset]) {
+	case OP_CONSTANT:
+	case OP_GET_LOCAL:
+	case OP_SET_LOCAL:
+	case OP_GET_UPVALUE:
+	case OP_SET_UPVALUE:
+	case OP_CALL:
+	case OP_TAIL_CALL:
+	case OP_ADD_CONST:
+	case OP_INC_LOCAL:
+	case OP_STORE_LOCAL:
+	case OP_LIST:
+	case OP_MAP:
+	  return 2;
+	case OP_DEFINE_GLOBAL:
+	case OP_GET_GLOBAL:
+	case OP_SET_GLOBAL:
+	case OP_JUMP_IF:
+	case OP_JUMP:
+	case OP_LOOP:
+	case OP_ADD_LOCALS:
+	  return 3;
+	case OP_CONSTANT_LONG:
+	  return 4;
+	case OP_LESS_LOCAL_CONST_JUMP:
+	case OP_LESS_LOCALS_JUMP:
+	  return 5;
+	case OP_CLOSURE: {
+	  ObjFn *fn = AS_FN(chunk->constants.values[chunk->code[offset + 1]]);
+	  return 2 + 2 * fn->upvalueCount;
+	}
+	default:
+	  return 1;
+  }
+}
@@ -26,6 +26,9 @@ void writeChunk(VM *vm, Chunk *chunk, uint8_t byte);
 
 int addConstant(VM *vm, Chunk *chunk, Value value);
 
+// Size in bytes of the instruction at offset, operands included.
+int instructionLength(Chunk *chunk, int offset);
+
 
 #define ARRAY_NEW(arr) \
   do { \
@@ -7,8 +7,14 @@
 
 #define DEBUG_TRACE 1
 
+#define DEBUG_PRINT_CODE 0
+
+// Counts dispatched instructions and reports them when the VM is freed.
+#define DEBUG_COUNT_DISPATCH 0
+
 #define DEBUG_STRESS_GC 0
 
-#define DEBUG_LOG_GC
+// Logs every allocation, mark and free of the collector to stdout.
+#define DEBUG_LOG_GC 0
 
 #endif
@@ -5,12 +5,16 @@
 #include "compiler.h"
 #include "vm.h"
 #include "memory.h"
+#include "optimizer.h"
+#include "ir.h"
+#include "debug.h"
 
 typedef enum {
   // Single-character tokens.
   TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN,
   TOKEN_LEFT_BRACE, TOKEN_RIGHT_BRACE,
-  TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS,
+  TOKEN_LEFT_BRACKET, TOKEN_RIGHT_BRACKET,
+  TOKEN_COLON, TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS,
   TOKEN_SEMICOLON, TOKEN_SLASH, TOKEN_STAR,
 
   // One or two character tokens.
@@ -23,7 +27,7 @@ typedef enum {
   TOKEN_IDENTIFIER, TOKEN_STRING, TOKEN_NUMBER,
 
   // Keywords.
-  TOKEN_AND, TOKEN_CLASS, TOKEN_ELSE, TOKEN_FALSE,
+  TOKEN_AND, TOKEN_CLASS, TOKEN_DELETE, TOKEN_ELSE, TOKEN_FALSE,
   TOKEN_FOR, TOKEN_FUN, TOKEN_IF, TOKEN_NIL, TOKEN_OR,
   TOKEN_PRINT, TOKEN_RETURN, TOKEN_SUPER, TOKEN_THIS,
   TOKEN_TRUE, TOKEN_VAR, TOKEN_WHILE,
@@ -52,12 +56,15 @@ typedef struct {
   const char *currentChar;
   Token current;
   Token previous;
+  bool hadError;
 } Parser;
 
 typedef struct {
   Token name;
   int depth;
   bool isCaptured;
+  bool isAssigned;
+  int initializer;  // offset of a lone constant push initializing it, or -1
 } Local;
 
 typedef struct {
@@ -79,6 +86,8 @@ struct sCompiler {
   ObjFn *fn;
   FnType type;
   struct sCompiler *parent;
+  ConstLocal *constLocals;
+  int lastGetIndex;  // offset of the last OP_GET_INDEX, for delete
 };
 
 typedef enum {
@@ -115,6 +124,7 @@ static Keyword keywords[] = {
 	{"nil", 3, TOKEN_NIL},
 	{"fun", 3, TOKEN_FUN},
 	{"class", 5, TOKEN_CLASS},
+	{"delete", 6, TOKEN_DELETE},
 	{"else", 4, TOKEN_ELSE},
 	{"false", 5, TOKEN_FALSE},
 	{"for", 3, TOKEN_FOR},
@@ -214,7 +224,7 @@ static void readNumber(Parser *parser) {
 	nextChar(parser);
 	while (isDigit(peekChar(parser))) nextChar(parser);
   }
-  parser->current.value = NUM_VAL(strtod(parser->tokenStart, NULL));
+  parser->current.value = numberValue(strtod(parser->tokenStart, NULL));
   makeToken(parser, TOKEN_NUMBER);
 }
 
@@ -252,8 +262,14 @@ static void nextToken(Parser *parser) {
 		return;
 	  case '}': makeToken(parser, TOKEN_RIGHT_BRACE);
 		return;
+	  case '[': makeToken(parser, TOKEN_LEFT_BRACKET);
+		return;
+	  case ']': makeToken(parser, TOKEN_RIGHT_BRACKET);
+		return;
 	  case ';': makeToken(parser, TOKEN_SEMICOLON);
 		return;
+	  case ':': makeToken(parser, TOKEN_COLON);
+		return;
 	  case ',': makeToken(parser, TOKEN_COMMA);
 		return;
 	  case '.': makeToken(parser, TOKEN_DOT);
@@ -295,16 +311,19 @@ static void initCompiler(Compiler *compiler, Parser *parser,
   compiler->scopeDepth = 0;
   compiler->fn = newFn(parser->vm);
   compiler->type = type;
+  compiler->lastGetIndex = -1;
   if (type != TYPE_SCRIPT) {
-	compiler->fn->name = AS_STRING(newStringLength(parser->vm,
-												   parser->previous.start,
-												   parser->previous.length));
+	compiler->fn->name = copyString(parser->vm, parser->previous.start,
+									parser->previous.length);
   }
   Local *local = &compiler->locals[compiler->localCount++];
   local->depth = 0;
   local->name.start = "";
   local->name.length = 0;
   local->isCaptured = false;
+  local->isAssigned = false;
+  local->initializer = -1;
+  ARRAY_NEW(compiler->constLocals);
 }
 
 static bool consume(Compiler *compiler, TokenType type) {
@@ -339,15 +358,66 @@ void emitConstant(Compiler *compiler, Value value) {
   }
 }
 
+// Records the first error of a compilation in vm->error, the compilation
+// then returns NULL.
+static void error(Compiler *compiler, const char *message) {
+  if (compiler->parser->hadError) return;
+  compiler->parser->hadError = true;
+  snprintf(compiler->parser->vm->error, sizeof(compiler->parser->vm->error),
+		   "%s", message);
+}
+
+// Globals live in VM slots, addressed by a 16-bit operand. globalSlot
+// gives -1 once all GLOBAL_MAX are taken.
+static void emitGlobal(Compiler *compiler, uint8_t instruction, int slot) {
+  if (slot < 0) {
+	error(compiler, "Too many globals.");
+	slot = 0;
+  }
+  emitByte(compiler, instruction);
+  emitBytes(compiler, (slot >> 8) & 0xff, slot & 0xff);
+}
+
 static void emitReturn(Compiler *compiler) {
   emitByte(compiler, OP_NIL);
   emitByte(compiler, OP_RETURN);
 }
 
+// Remembers a local going out of scope if its reads can be replaced with
+// its initializer.
+static void retireLocal(Compiler *compiler, int slot) {
+  Local *local = &compiler->locals[slot];
+  if (local->initializer < 0 || local->isAssigned || local->isCaptured) return;
+  Chunk *chunk = &compiler->fn->chunk;
+  ConstLocal constLocal;
+  constLocal.slot = slot;
+  constLocal.start = local->initializer +
+	  instructionLength(chunk, local->initializer);
+  constLocal.end = chunk->count;
+  constLocal.init = local->initializer;
+  ARRAY_PUSH(compiler->constLocals, constLocal);
+}
+
 static ObjFn *endCompiler(Compiler *compiler) {
   emitReturn(compiler);
   ObjFn *fn = compiler->fn;
-  compiler->parser->vm->compiler = compiler->parent;
+  VM *vm = compiler->parser->vm;
+  for (int i = compiler->localCount - 1; i > 0; i--) {
+	retireLocal(compiler, i);
+  }
+  if (vm->optLevel >= 2) {
+	optimizeIr(vm, &fn->chunk, compiler->constLocals,
+			   (int)ARRAY_SIZE(compiler->constLocals));
+  }
+  if (vm->optLevel >= 1) {
+	peephole(vm, &fn->chunk);
+  }
+  ARRAY_FREE(compiler->constLocals);
+#if DEBUG_PRINT_CODE
+  disassembleChunk(&fn->chunk,
+				   fn->name != NULL ? fn->name->value : "<script>");
+#endif
+  vm->compiler = compiler->parent;
   return fn;
 }
 
@@ -456,12 +526,18 @@ static void namedVariable(Compiler *compiler, Token name, bool canAssign) {
     getOp = OP_GET_UPVALUE;
     setOp = OP_SET_UPVALUE;
   } else {
-	arg = makeConstant(compiler, name.value);
-	getOp = OP_GET_GLOBAL;
-	setOp = OP_SET_GLOBAL;
+	arg = globalSlot(compiler->parser->vm, name.value);
+	if (canAssign && consume(compiler, TOKEN_EQUAL)) {
+	  expression(compiler);
+	  emitGlobal(compiler, OP_SET_GLOBAL, arg);
+	} else {
+	  emitGlobal(compiler, OP_GET_GLOBAL, arg);
+	}
+	return;
   }
   if (canAssign && consume(compiler, TOKEN_EQUAL)) {
 	expression(compiler);
+	if (setOp == OP_SET_LOCAL) compiler->locals[arg].isAssigned = true;
 	emitBytes(compiler, setOp, (uint8_t)arg);
   } else {
 	emitBytes(compiler, getOp, (uint8_t)arg);
@@ -493,11 +569,65 @@ static void call(Compiler *compiler, bool canAssign) {
   emitBytes(compiler, OP_CALL, argCount);
 }
 
+// [a, b, c] builds a list of at most 255 items.
+// [a, b, ...] builds a list of at most 255 items.
+static void list(Compiler *compiler, bool canAssign) {
+  (void)canAssign;
+  uint8_t count = 0;
+  if (!consume(compiler, TOKEN_RIGHT_BRACKET)) {
+	do {
+	  expression(compiler);
+	  if (count == UINT8_MAX) {
+		error(compiler, "Too many items in list literal.");
+	  } else {
+		count++;
+	  }
+	} while (consume(compiler, TOKEN_COMMA));
+  }
+  consume(compiler, TOKEN_RIGHT_BRACKET);
+  emitBytes(compiler, OP_LIST, count);
+}
+
+static void subscript(Compiler *compiler, bool canAssign) {
+  expression(compiler);
+  consume(compiler, TOKEN_RIGHT_BRACKET);
+  if (canAssign && consume(compiler, TOKEN_EQUAL)) {
+	expression(compiler);
+	emitByte(compiler, OP_SET_INDEX);
+  } else {
+	compiler->lastGetIndex = compiler->fn->chunk.count;
+	emitByte(compiler, OP_GET_INDEX);
+  }
+}
+
+// {k: v, ...} builds a map of at most 255 entries.
+static void map(Compiler *compiler, bool canAssign) {
+  (void)canAssign;
+  uint8_t count = 0;
+  if (!consume(compiler, TOKEN_RIGHT_BRACE)) {
+	do {
+	  expression(compiler);
+	  consume(compiler, TOKEN_COLON);
+	  expression(compiler);
+	  if (count == UINT8_MAX) {
+		error(compiler, "Too many entries in map literal.");
+	  } else {
+		count++;
+	  }
+	} while (consume(compiler, TOKEN_COMMA));
+  }
+  consume(compiler, TOKEN_RIGHT_BRACE);
+  emitBytes(compiler, OP_MAP, count);
+}
+
 GrammarRule rules[] = {
 	{grouping, call, PREC_CALL},   // TOKEN_LEFT_PAREN
 	{NULL, NULL, PREC_NONE},       // TOKEN_RIGHT_PAREN
-	{NULL, NULL, PREC_NONE},       // TOKEN_LEFT_BRACE
+	{map, NULL, PREC_NONE},        // TOKEN_LEFT_BRACE
 	{NULL, NULL, PREC_NONE},       // TOKEN_RIGHT_BRACE
+	{list, subscript, PREC_CALL},  // TOKEN_LEFT_BRACKET
+	{NULL, NULL, PREC_NONE},       // TOKEN_RIGHT_BRACKET
+	{NULL, NULL, PREC_NONE},       // TOKEN_COLON
 	{NULL, NULL, PREC_NONE},       // TOKEN_COMMA
 	{NULL, NULL, PREC_NONE},       // TOKEN_DOT
 	{unary, binary, PREC_TERM},    // TOKEN_MINUS
@@ -518,6 +648,7 @@ GrammarRule rules[] = {
 	{number, NULL, PREC_NONE},     // TOKEN_NUMBER
 	{NULL, NULL, PREC_NONE},       // TOKEN_AND
 	{NULL, NULL, PREC_NONE},       // TOKEN_CLASS
+	{NULL, NULL, PREC_NONE},       // TOKEN_DELETE
 	{NULL, NULL, PREC_NONE},       // TOKEN_ELSE
 	{literal, NULL, PREC_NONE},    // TOKEN_FALSE
 	{NULL, NULL, PREC_NONE},       // TOKEN_FOR
@@ -563,6 +694,19 @@ static void printStatement(Compiler *compiler) {
   emitByte(compiler, OP_PRINT);
 }
 
+// delete m[k]; compiles the subscript as a get and turns that last
+// instruction into a delete.
+static void deleteStatement(Compiler *compiler) {
+  expression(compiler);
+  consume(compiler, TOKEN_SEMICOLON);
+  Chunk *chunk = &compiler->fn->chunk;
+  if (compiler->lastGetIndex != chunk->count - 1) {
+	error(compiler, "Invalid delete target.");
+	return;
+  }
+  chunk->code[chunk->count - 1] = OP_DELETE_INDEX;
+}
+
 static void expressionStatement(Compiler *compiler) {
   expression(compiler);
   consume(compiler, TOKEN_SEMICOLON);
@@ -575,6 +719,8 @@ static void addLocal(Compiler *compiler, Token name) {
   local->name = name;
   local->depth = -1;
   local->isCaptured = false;
+  local->isAssigned = false;
+  local->initializer = -1;
 }
 
 // For local only.
@@ -590,29 +736,41 @@ static void declareVariable(Compiler *compiler) {
   addLocal(compiler, name);
 }
 
-static uint8_t parseVariable(Compiler *compiler) {
+static int parseVariable(Compiler *compiler) {
   consume(compiler, TOKEN_IDENTIFIER);
   declareVariable(compiler);
   if (compiler->scopeDepth > 0) return 0;
-  return makeConstant(compiler, compiler->parser->previous.value);
+  return globalSlot(compiler->parser->vm, compiler->parser->previous.value);
 }
 
-static void defineVariable(Compiler *compiler, uint8_t global) {
+static void defineVariable(Compiler *compiler, int global) {
   if (compiler->scopeDepth > 0) {
 	markInitialized(compiler);
 	return;
   }
-  emitBytes(compiler, OP_DEFINE_GLOBAL, global);
+  emitGlobal(compiler, OP_DEFINE_GLOBAL, global);
+}
+
+static bool isConstantPush(uint8_t op) {
+  return op == OP_CONSTANT || op == OP_CONSTANT_LONG || op == OP_NIL ||
+	  op == OP_TRUE || op == OP_FALSE;
 }
 
 static void varDeclaration(Compiler *compiler) {
-  uint8_t global = parseVariable(compiler);
+  int global = parseVariable(compiler);
+  Chunk *chunk = &compiler->fn->chunk;
+  int start = chunk->count;
   if (consume(compiler, TOKEN_EQUAL)) {
 	expression(compiler);
   } else {
 	emitByte(compiler, OP_NIL);
   }
   consume(compiler, TOKEN_SEMICOLON);
+  if (compiler->scopeDepth > 0 && chunk->count > start &&
+	  isConstantPush(chunk->code[start]) &&
+	  start + instructionLength(chunk, start) == chunk->count) {
+	compiler->locals[compiler->localCount - 1].initializer = start;
+  }
   defineVariable(compiler, global);
 }
 
@@ -633,6 +791,7 @@ static void endScope(Compiler *compiler) {
   while (compiler->localCount > 0 &&
 	  compiler->locals[compiler->localCount - 1].depth >
 		  compiler->scopeDepth) {
+	retireLocal(compiler, compiler->localCount - 1);
 	if (compiler->locals[compiler->localCount - 1].isCaptured) {
 	  emitByte(compiler, OP_CLOSE_UPVALUE);
 	} else {
@@ -698,7 +857,7 @@ static void function(Compiler *compiler, FnType type) {
   if (!consume(&fnCompiler, TOKEN_RIGHT_PAREN)) {
     do {
       fnCompiler.fn->arity++;
-      uint8_t paramConstant = parseVariable(&fnCompiler);
+      int paramConstant = parseVariable(&fnCompiler);
       defineVariable(&fnCompiler, paramConstant);
     } while (consume(&fnCompiler, TOKEN_COMMA));
   }
@@ -714,7 +873,7 @@ static void function(Compiler *compiler, FnType type) {
 }
 
 static void funDeclaration(Compiler *compiler) {
-  uint8_t global = parseVariable(compiler);
+  int global = parseVariable(compiler);
   markInitialized(compiler);
   function(compiler, TYPE_FUNCTION);
   defineVariable(compiler, global);
@@ -763,6 +922,8 @@ static void statement(Compiler *compiler) {
 	whileStatement(compiler);
   } else if (consume(compiler, TOKEN_RETURN)) {
     returnStatement(compiler);
+  } else if (consume(compiler, TOKEN_DELETE)) {
+	deleteStatement(compiler);
   } else {
 	expressionStatement(compiler);
   }
@@ -777,6 +938,7 @@ ObjFn *compile(VM *vm, const char *source) {
   parser.current.type = TOKEN_ERROR;
   parser.current.start = source;
   parser.current.length = 0;
+  parser.hadError = false;
   Compiler compiler;
   initCompiler(&compiler, &parser, NULL, TYPE_SCRIPT);
   /*for (;;) {
@@ -788,7 +950,8 @@ ObjFn *compile(VM *vm, const char *source) {
   while (!consume(&compiler, TOKEN_EOF)) {
 	declaration(&compiler);
   }
-  return endCompiler(&compiler);
+  ObjFn *fn = endCompiler(&compiler);
+  return parser.hadError ? NULL : fn;
 }
 
 void markCompilerRoots(VM *vm, Compiler *compiler) {
@@ -797,4 +960,4 @@ void markCompilerRoots(VM *vm, Compiler *compiler) {
 	markObject(vm, (Obj*)c->fn);
 	c = c->parent;
   }
-}
\ No newline at end of file
+}
\ No newline at end of file
@@ -7,6 +7,7 @@
 
 typedef struct sCompiler Compiler;
 
+// NULL after a compile error, described in vm->error.
 ObjFn *compile(VM *vm, const char *source);
 void markCompilerRoots(VM *vm, Compiler *compiler);
 
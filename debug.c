@@ -3,6 +3,7 @@
 #include "debug.h"
 #include "value.h"
 #include "object.h"
+#include "lower.h"
 
 void disassembleChunk(Chunk *chunk, const char *name) {
   printf("== %s ==\n", name);
@@ -42,6 +43,35 @@ static int byteInstruction(const char *name, Chunk *chunk, int offset) {
   return offset + 2;
 }
 
+static int globalInstruction(const char *name, Chunk *chunk, int offset) {
+  uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+  slot |= chunk->code[offset + 2];
+  printf("%-16s %4d\n", name, slot);
+  return offset + 3;
+}
+
+static int twoByteInstruction(const char *name, Chunk *chunk, int offset) {
+  printf("%-16s %4d %4d\n", name, chunk->code[offset + 1],
+		 chunk->code[offset + 2]);
+  return offset + 3;
+}
+
+static int compareJumpInstruction(const char *name, Chunk *chunk,
+								  int offset, bool constant) {
+  uint16_t jump = (uint16_t)(chunk->code[offset + 3] << 8);
+  jump |= chunk->code[offset + 4];
+  printf("%-16s %4d ", name, chunk->code[offset + 1]);
+  if (constant) {
+	printf("'");
+	printValue(chunk->constants.values[chunk->code[offset + 2]]);
+	printf("'");
+  } else {
+	printf("%4d", chunk->code[offset + 2]);
+  }
+  printf(" %4d -> %d\n", offset, offset + 5 + jump);
+  return offset + 5;
+}
+
 static int jumpInstruction(const char *name, int sign, Chunk *chunk,
 						   int offset) {
   uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
@@ -68,9 +98,9 @@ int disassembleInstruction(Chunk *chunk, int offset) {
 	case OP_FALSE: return simpleInstruction("OP_FALSE", offset);
 	case OP_PRINT: return simpleInstruction("OP_PRINT", offset);
 	case OP_POP: return simpleInstruction("OP_POP", offset);
-	case OP_DEFINE_GLOBAL: return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
-	case OP_GET_GLOBAL: return constantInstruction("OP_GET_GLOBAL", chunk, offset);
-	case OP_SET_GLOBAL: return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+	case OP_DEFINE_GLOBAL: return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+	case OP_GET_GLOBAL: return globalInstruction("OP_GET_GLOBAL", chunk, offset);
+	case OP_SET_GLOBAL: return globalInstruction("OP_SET_GLOBAL", chunk, offset);
 	case OP_GET_LOCAL: return byteInstruction("OP_GET_LOCAL", chunk, offset);
 	case OP_SET_LOCAL: return byteInstruction("OP_SET_LOCAL", chunk, offset);
 	case OP_GET_UPVALUE: return byteInstruction("OP_GET_UPVALUE", chunk, offset);
@@ -97,7 +127,46 @@ int disassembleInstruction(Chunk *chunk, int offset) {
 	}
 	case OP_RETURN: return simpleInstruction("OP_RETURN", offset);
 	case OP_TAIL_CALL: return byteInstruction("OP_TAIL_CALL", chunk, offset);
+	case OP_ADD_LOCALS: return twoByteInstruction("OP_ADD_LOCALS", chunk, offset);
+	case OP_ADD_CONST: return constantInstruction("OP_ADD_CONST", chunk, offset);
+	case OP_INC_LOCAL: return byteInstruction("OP_INC_LOCAL", chunk, offset);
+	case OP_STORE_LOCAL: return byteInstruction("OP_STORE_LOCAL", chunk, offset);
+	case OP_LESS_LOCAL_CONST_JUMP:
+	  return compareJumpInstruction("OP_LESS_LOCAL_CONST_JUMP", chunk, offset, true);
+	case OP_LESS_LOCALS_JUMP:
+	  return compareJumpInstruction("OP_LESS_LOCALS_JUMP", chunk, offset, false);
+	case OP_LIST: return byteInstruction("OP_LIST", chunk, offset);
+	case OP_GET_INDEX: return simpleInstruction("OP_GET_INDEX", offset);
+	case OP_SET_INDEX: return simpleInstruction("OP_SET_INDEX", offset);
+	case OP_MAP: return byteInstruction("OP_MAP", chunk, offset);
+	case OP_DELETE_INDEX: return simpleInstruction("OP_DELETE_INDEX", offset);
 	default:printf("Unknown opcode %d\n", op);
 	  return offset + 1;
   }
-}
\ No newline at end of file
+}
+// Register code has a fixed operand layout per opcode, so it is printed
+// generically: the name followed by the raw operand bytes.
+int disassembleRegInstruction(ObjFn *fn, int offset) {
+  static const char *names[] = {
+#define REGOP(name, _) "R_" #name,
+#include "regopcode.h"
+#undef REGOP
+  };
+  printf("%04d ", offset);
+  uint8_t op = fn->regCode[offset];
+  int length = regInstructionLength(fn, offset);
+  printf("%-16s", names[op]);
+  for (int i = 1; i < length; i++) {
+	printf(" %3d", fn->regCode[offset + i]);
+  }
+  printf("\n");
+  return offset + length;
+}
+
+void disassembleRegFn(ObjFn *fn) {
+  printf("== %s (registers: %d) ==\n",
+		 fn->name == NULL ? "<script>" : fn->name->value, fn->regSlots);
+  for (int offset = 0; offset < fn->regCount;) {
+	offset = disassembleRegInstruction(fn, offset);
+  }
+}
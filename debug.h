@@ -2,9 +2,14 @@
 #define CLOX_DEBUG_H
 
 #include "chunk.h"
+#include "object.h"
 
 void disassembleChunk(Chunk *chunk, const char *name);
 
 int disassembleInstruction(Chunk *chunk, int offset);
 
+int disassembleRegInstruction(ObjFn *fn, int offset);
+
+void disassembleRegFn(ObjFn *fn);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,94 @@
+#include <string.h>
+
+#include "hash.h"
+
+static const uint64_t secret[4] = {
+  0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull,
+  0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull
+};
+
+static inline uint64_t read8(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return v;
+}
+
+static inline uint64_t read4(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+// 1 to 3 bytes, all of them read.
+static inline uint64_t read3(const uint8_t *p, size_t length) {
+  return ((uint64_t)p[0] << 16) | ((uint64_t)p[length >> 1] << 8) |
+	  p[length - 1];
+}
+
+// Replaces a and b with the low and high halves of a * b.
+static inline void multiply(uint64_t *a, uint64_t *b) {
+#ifdef __SIZEOF_INT128__
+  __uint128_t r = (__uint128_t)*a * *b;
+  *a = (uint64_t)r;
+  *b = (uint64_t)(r >> 64);
+#else
+  uint64_t ha = *a >> 32, hb = *b >> 32;
+  uint64_t la = (uint32_t)*a, lb = (uint32_t)*b;
+  uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+  uint64_t t = rl + (rm0 << 32);
+  uint64_t carry = t < rl;
+  uint64_t lo = t + (rm1 << 32);
+  carry += lo < t;
+  *a = lo;
+  *b = rh + (rm0 >> 32) + (rm1 >> 32) + carry;
+#endif
+}
+
+static inline uint64_t mix(uint64_t a, uint64_t b) {
+  multiply(&a, &b);
+  return a ^ b;
+}
+
+uint64_t hashBytes(const void *data, size_t length, uint64_t seed) {
+  const uint8_t *p = data;
+  uint64_t a, b;
+  seed ^= mix(seed ^ secret[0], secret[1]);
+  if (length <= 16) {
+	if (length >= 4) {
+	  size_t middle = (length >> 3) << 2;
+	  a = (read4(p) << 32) | read4(p + middle);
+	  b = (read4(p + length - 4) << 32) | read4(p + length - 4 - middle);
+	} else if (length > 0) {
+	  a = read3(p, length);
+	  b = 0;
+	} else {
+	  a = b = 0;
+	}
+  } else {
+	size_t left = length;
+	if (left > 48) {
+	  // Three independent lanes keep the multipliers busy.
+	  uint64_t seed1 = seed, seed2 = seed;
+	  do {
+		seed = mix(read8(p) ^ secret[1], read8(p + 8) ^ seed);
+		seed1 = mix(read8(p + 16) ^ secret[2], read8(p + 24) ^ seed1);
+		seed2 = mix(read8(p + 32) ^ secret[3], read8(p + 40) ^ seed2);
+		p += 48;
+		left -= 48;
+	  } while (left > 48);
+	  seed ^= seed1 ^ seed2;
+	}
+	while (left > 16) {
+	  seed = mix(read8(p) ^ secret[1], read8(p + 8) ^ seed);
+	  p += 16;
+	  left -= 16;
+	}
+	// The last 16 bytes, overlapping what was mixed already.
+	a = read8(p + left - 16);
+	b = read8(p + left - 8);
+  }
+  a ^= secret[1];
+  b ^= seed;
+  multiply(&a, &b);
+  return mix(a ^ secret[0] ^ length, b ^ secret[1]);
+}
@@ -0,0 +1,11 @@
+#ifndef CLOX_HASH_H
+#define CLOX_HASH_H
+
+#include "common.h"
+
+// wyhash: reads the input 8 or 16 bytes at a time and mixes with 64x64 to
+// 128 bit multiplies. Strings of up to 16 bytes, most identifiers, take
+// a couple of loads and two multiplies.
+uint64_t hashBytes(const void *data, size_t length, uint64_t seed);
+
+#endif
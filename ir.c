@@ -0,0 +1,350 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "ir.h"
+#include "memory.h"
+
+typedef struct {
+  VM *vm;
+  Chunk *chunk;
+  IrInsn *insns;
+} IrFn;
+
+#define INSN_COUNT(ir) ((int)ARRAY_SIZE((ir)->insns))
+
+// Decodes the instruction at offset. Jump targets are left as byte offsets
+// and CONSTANT_LONG is folded into CONSTANT, which re-encodes as needed.
+static IrInsn decodeInsn(Chunk *chunk, int offset) {
+  uint8_t *code = chunk->code + offset;
+  IrInsn insn = {code[0], -1, -1, offset, false};
+  switch (insn.op) {
+	case OP_CONSTANT:
+	  insn.arg = code[1];
+	  break;
+	case OP_CONSTANT_LONG:
+	  insn.op = OP_CONSTANT;
+	  insn.arg = code[1] | (code[2] << 8) | (code[3] << 16);
+	  break;
+	case OP_JUMP:
+	case OP_JUMP_IF:
+	  insn.target = offset + 3 + ((code[1] << 8) | code[2]);
+	  break;
+	case OP_LOOP:
+	  insn.target = offset + 3 - ((code[1] << 8) | code[2]);
+	  break;
+	default: break;
+  }
+  return insn;
+}
+
+static void decode(IrFn *ir) {
+  Chunk *chunk = ir->chunk;
+  int *indexAt = malloc(sizeof(int) * (chunk->count + 1));
+  ARRAY_NEW(ir->insns);
+  for (int offset = 0; offset < chunk->count;
+	   offset += instructionLength(chunk, offset)) {
+	indexAt[offset] = INSN_COUNT(ir);
+	ARRAY_PUSH(ir->insns, decodeInsn(chunk, offset));
+  }
+  indexAt[chunk->count] = INSN_COUNT(ir);
+  for (int i = 0; i < INSN_COUNT(ir); i++) {
+	IrInsn *insn = &ir->insns[i];
+	if (insn->target >= 0) insn->target = indexAt[insn->target];
+  }
+  free(indexAt);
+}
+
+// Drops removed instructions. A jump to a removed instruction lands on the
+// next one that survives.
+static void compact(IrFn *ir) {
+  int count = INSN_COUNT(ir);
+  int *newIndex = malloc(sizeof(int) * (count + 1));
+  int live = 0;
+  for (int i = 0; i < count; i++) {
+	newIndex[i] = live;
+	if (!ir->insns[i].removed) ir->insns[live++] = ir->insns[i];
+  }
+  newIndex[count] = live;
+  for (int i = 0; i < live; i++) {
+	IrInsn *insn = &ir->insns[i];
+	if (insn->target >= 0) insn->target = newIndex[insn->target];
+  }
+  ARRAY_SIZE(ir->insns) = live;
+  free(newIndex);
+}
+
+static bool *findTargets(IrFn *ir) {
+  bool *targeted = calloc(INSN_COUNT(ir) + 1, sizeof(bool));
+  for (int i = 0; i < INSN_COUNT(ir); i++) {
+	if (ir->insns[i].target >= 0) targeted[ir->insns[i].target] = true;
+  }
+  return targeted;
+}
+
+static bool isConstant(IrInsn *insn) {
+  return insn->op == OP_CONSTANT || insn->op == OP_NIL ||
+	  insn->op == OP_TRUE || insn->op == OP_FALSE;
+}
+
+static Value constantValue(IrFn *ir, IrInsn *insn) {
+  switch (insn->op) {
+	case OP_NIL: return NIL_VAL;
+	case OP_TRUE: return TRUE_VAL;
+	case OP_FALSE: return FALSE_VAL;
+	default: return ir->chunk->constants.values[insn->arg];
+  }
+}
+
+static int numberConstant(IrFn *ir, Value value) {
+  ValueArray *constants = &ir->chunk->constants;
+  for (int i = 0; i < constants->count; i++) {
+	if (IS_NUMBER(constants->values[i]) && constants->values[i] == value) {
+	  return i;
+	}
+  }
+  return addConstant(ir->vm, ir->chunk, value);
+}
+
+// Turns insn into a push of value, which is a number, bool or nil.
+static void setConstant(IrFn *ir, IrInsn *insn, Value value) {
+  insn->from = -1;
+  insn->target = -1;
+  if (IS_NIL(value)) {
+	insn->op = OP_NIL;
+  } else if (IS_BOOL(value)) {
+	insn->op = IS_FALSE(value) ? OP_FALSE : OP_TRUE;
+  } else {
+	insn->op = OP_CONSTANT;
+	insn->arg = numberConstant(ir, value);
+  }
+}
+
+static bool foldBinary(uint8_t op, Value a, Value b, Value *result) {
+  if (op == OP_EQ) {
+	*result = BOOL_VAL(valueEqual(a, b));
+	return true;
+  }
+  if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+  switch (op) {
+	case OP_ADD: *result = addNumbers(a, b); return true;
+	case OP_SUBTRACT: *result = subtractNumbers(a, b); return true;
+	case OP_MULTIPLY: *result = multiplyNumbers(a, b); return true;
+	case OP_DIVIDE: *result = divideNumbers(a, b); return true;
+	case OP_LESS: *result = BOOL_VAL(numberLess(a, b)); return true;
+	default: return false;
+  }
+}
+
+// Folds a constant followed by NEGATE, POP or JUMP_IF, and two constants
+// followed by a binary operator. Nothing is folded across a jump target.
+static bool foldConstants(IrFn *ir) {
+  bool changed = false;
+  int count = INSN_COUNT(ir);
+  bool *targeted = findTargets(ir);
+  for (int i = 0; i + 1 < count; i++) {
+	IrInsn *a = &ir->insns[i];
+	IrInsn *b = &ir->insns[i + 1];
+	if (!isConstant(a) || targeted[i + 1]) continue;
+	Value x = constantValue(ir, a);
+	if (b->op == OP_NEGATE && IS_NUMBER(x)) {
+	  setConstant(ir, a, negateNumber(x));
+	  b->removed = true;
+	} else if (b->op == OP_POP) {
+	  a->removed = true;
+	  b->removed = true;
+	} else if (b->op == OP_JUMP_IF) {
+	  if (IS_FALSE(x) || IS_NIL(x)) {
+		a->op = OP_JUMP;
+		a->target = b->target;
+		a->from = -1;
+	  } else {
+		a->removed = true;
+	  }
+	  b->removed = true;
+	} else if (isConstant(b) && i + 2 < count && !targeted[i + 2]) {
+	  IrInsn *c = &ir->insns[i + 2];
+	  Value result;
+	  if (!foldBinary(c->op, x, constantValue(ir, b), &result)) continue;
+	  setConstant(ir, a, result);
+	  b->removed = true;
+	  c->removed = true;
+	  i++;
+	} else {
+	  continue;
+	}
+	changed = true;
+	i++;
+  }
+  free(targeted);
+  return changed;
+}
+
+// Replaces reads of never-assigned locals with their constant initializer.
+static void propagateLocals(IrFn *ir, ConstLocal *locals, int localCount) {
+  for (int i = 0; i < INSN_COUNT(ir); i++) {
+	IrInsn *insn = &ir->insns[i];
+	if (insn->op != OP_GET_LOCAL) continue;
+	int slot = ir->chunk->code[insn->from + 1];
+	for (int j = 0; j < localCount; j++) {
+	  ConstLocal *local = &locals[j];
+	  if (local->slot == slot && insn->from >= local->start &&
+		  insn->from < local->end) {
+		IrInsn init = decodeInsn(ir->chunk, local->init);
+		insn->op = init.op;
+		insn->arg = init.arg;
+		insn->from = -1;
+		break;
+	  }
+	}
+  }
+}
+
+static bool isTerminator(uint8_t op) {
+  return op == OP_JUMP || op == OP_LOOP || op == OP_RETURN ||
+	  op == OP_TAIL_CALL;
+}
+
+static bool removeUnreachable(IrFn *ir) {
+  int count = INSN_COUNT(ir);
+  bool *reached = calloc(count + 1, sizeof(bool));
+  int *work = malloc(sizeof(int) * (2 * count + 1));
+  int workCount = 0;
+  work[workCount++] = 0;
+  while (workCount > 0) {
+	int i = work[--workCount];
+	if (i >= count || reached[i]) continue;
+	reached[i] = true;
+	IrInsn *insn = &ir->insns[i];
+	if (insn->target >= 0) work[workCount++] = insn->target;
+	if (!isTerminator(insn->op)) work[workCount++] = i + 1;
+  }
+  bool changed = false;
+  for (int i = 0; i < count; i++) {
+	if (!reached[i]) {
+	  ir->insns[i].removed = true;
+	  changed = true;
+	}
+  }
+  free(reached);
+  free(work);
+  return changed;
+}
+
+static bool isUnconditional(IrFn *ir, int i) {
+  return i < INSN_COUNT(ir) &&
+	  (ir->insns[i].op == OP_JUMP || ir->insns[i].op == OP_LOOP);
+}
+
+// Points jumps that land on an unconditional jump at its destination, and
+// drops jumps to the next instruction. JUMP_IF only jumps forward, so it
+// stops at the last hop that keeps the target ahead of it.
+static bool threadJumps(IrFn *ir) {
+  bool changed = false;
+  int count = INSN_COUNT(ir);
+  for (int i = 0; i < count; i++) {
+	IrInsn *insn = &ir->insns[i];
+	if (insn->target < 0) continue;
+	int target = insn->target;
+	for (int hops = 0; hops < count && isUnconditional(ir, target) &&
+		target != i; hops++) {
+	  int next = ir->insns[target].target;
+	  if (insn->op == OP_JUMP_IF && next <= i) break;
+	  target = next;
+	}
+	if (target == i || isUnconditional(ir, target)) continue;
+	if (insn->op != OP_JUMP_IF && target == i + 1) {
+	  insn->removed = true;
+	  changed = true;
+	} else if (target != insn->target) {
+	  insn->target = target;
+	  if (insn->op != OP_JUMP_IF) insn->op = target > i ? OP_JUMP : OP_LOOP;
+	  changed = true;
+	}
+  }
+  return changed;
+}
+
+static int encodedLength(IrFn *ir, IrInsn *insn) {
+  switch (insn->op) {
+	case OP_CONSTANT: return insn->arg < 256 ? 2 : 4;
+	case OP_JUMP:
+	case OP_JUMP_IF:
+	case OP_LOOP: return 3;
+	default:
+	  return insn->from >= 0 ? instructionLength(ir->chunk, insn->from) : 1;
+  }
+}
+
+static void encode(IrFn *ir) {
+  Chunk *chunk = ir->chunk;
+  int count = INSN_COUNT(ir);
+  int *offsets = malloc(sizeof(int) * (count + 1));
+  int length = 0;
+  for (int i = 0; i < count; i++) {
+	offsets[i] = length;
+	length += encodedLength(ir, &ir->insns[i]);
+  }
+  offsets[count] = length;
+
+  uint8_t *code = ALLOCATE_ARRAY(ir->vm, uint8_t, length);
+  for (int i = 0; i < count; i++) {
+	IrInsn *insn = &ir->insns[i];
+	uint8_t *out = code + offsets[i];
+	int end = offsets[i + 1];
+	switch (insn->op) {
+	  case OP_CONSTANT:
+		if (insn->arg < 256) {
+		  out[0] = OP_CONSTANT;
+		  out[1] = (uint8_t)insn->arg;
+		} else {
+		  out[0] = OP_CONSTANT_LONG;
+		  out[1] = insn->arg & 0xff;
+		  out[2] = (insn->arg >> 8) & 0xff;
+		  out[3] = (insn->arg >> 16) & 0xff;
+		}
+		break;
+	  case OP_JUMP:
+	  case OP_JUMP_IF:
+	  case OP_LOOP: {
+		int jump = insn->op == OP_LOOP ? end - offsets[insn->target]
+									   : offsets[insn->target] - end;
+		out[0] = insn->op;
+		out[1] = (jump >> 8) & 0xff;
+		out[2] = jump & 0xff;
+		break;
+	  }
+	  default:
+		if (insn->from >= 0) {
+		  memcpy(out, chunk->code + insn->from, end - offsets[i]);
+		} else {
+		  out[0] = insn->op;
+		}
+		break;
+	}
+  }
+
+  DEALLOCATE(ir->vm, chunk->code);
+  chunk->code = code;
+  chunk->count = length;
+  chunk->capacity = length;
+  free(offsets);
+}
+
+void optimizeIr(VM *vm, Chunk *chunk, ConstLocal *locals, int localCount) {
+  IrFn ir;
+  ir.vm = vm;
+  ir.chunk = chunk;
+  decode(&ir);
+  propagateLocals(&ir, locals, localCount);
+  bool changed;
+  do {
+	changed = foldConstants(&ir);
+	compact(&ir);
+	changed |= removeUnreachable(&ir);
+	compact(&ir);
+	changed |= threadJumps(&ir);
+	compact(&ir);
+  } while (changed);
+  encode(&ir);
+  ARRAY_FREE(ir.insns);
+}
@@ -0,0 +1,34 @@
+#ifndef CLOX_IR_H
+#define CLOX_IR_H
+
+#include "common.h"
+#include "clox.h"
+#include "chunk.h"
+
+// A local the compiler saw initialized with a single constant push and
+// never assigned or captured. Inside [start, end) of the code, reads of
+// slot can be replaced with the instruction at init.
+typedef struct {
+  int slot;
+  int start;
+  int end;
+  int init;
+} ConstLocal;
+
+// One decoded instruction. Jumps refer to the instruction they land on by
+// index rather than by byte offset, so instructions can be removed and
+// rewritten freely before the chunk is encoded again.
+typedef struct {
+  uint8_t op;
+  int arg;      // constant index of CONSTANT and CONSTANT_LONG
+  int target;   // instruction index of JUMP, JUMP_IF and LOOP
+  int from;     // offset in the original code, -1 if synthesized
+  bool removed;
+} IrInsn;
+
+// Decodes chunk into IR, runs constant folding, constant propagation of
+// the given locals, unreachable code removal and jump threading, then
+// encodes the result back into chunk.
+void optimizeIr(VM *vm, Chunk *chunk, ConstLocal *locals, int localCount);
+
+#endif
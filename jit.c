@@ -0,0 +1,820 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jit.h"
+#include "vm.h"
+#include "memory.h"
+
+#if JIT_SUPPORTED
+
+#include <sys/mman.h>
+
+struct JitCode {
+  uint8_t *code;
+  size_t size;
+  int *entries;  // native offset of each bytecode instruction start
+};
+
+typedef int (*JitEntry)(VM *vm, CallFrame *frame, uint8_t *start);
+
+enum {
+  RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+  R8 = 8, R9 = 9, R10 = 10, R11 = 11, R12 = 12, R13 = 13, R14 = 14, R15 = 15
+};
+
+// Pinned registers. All callee-saved, so helpers leave them alone.
+#define REG_VM     RBX
+#define REG_SP     R12
+#define REG_SLOTS  R13
+#define REG_CONSTS R14
+#define REG_FRAME  R15
+
+typedef struct {
+  int at;       // native offset of the rel32 to patch
+  int target;   // bytecode offset, or -1 for the error exit
+} Fixup;
+
+typedef struct {
+  uint8_t *code;
+  int count;
+  int capacity;
+  Fixup *fixups;
+  int fixupCount;
+  int fixupCapacity;
+  bool failed;
+} Emitter;
+
+static void emit(Emitter *e, uint8_t byte) {
+  if (e->count == e->capacity) {
+	e->capacity = GROW_CAPACITY(e->capacity);
+	e->code = realloc(e->code, e->capacity);
+  }
+  e->code[e->count++] = byte;
+}
+
+static void emit32(Emitter *e, uint32_t value) {
+  for (int i = 0; i < 4; i++) emit(e, (value >> (8 * i)) & 0xff);
+}
+
+static void emit64(Emitter *e, uint64_t value) {
+  for (int i = 0; i < 8; i++) emit(e, (value >> (8 * i)) & 0xff);
+}
+
+static void emitRex(Emitter *e, bool wide, int reg, int base) {
+  uint8_t rex = 0x40 | (wide << 3) | ((reg >> 3) << 2) | (base >> 3);
+  if (rex != 0x40) emit(e, rex);
+}
+
+// ModRM for [base + disp]. RSP and R12 need a SIB byte, RBP and R13 can't
+// use the displacement-free form.
+static void emitMem(Emitter *e, int reg, int base, int32_t disp) {
+  int mod = disp == 0 && (base & 7) != RBP ? 0
+	  : (disp >= -128 && disp <= 127 ? 1 : 2);
+  emit(e, (mod << 6) | ((reg & 7) << 3) | (base & 7));
+  if ((base & 7) == RSP) emit(e, 0x24);
+  if (mod == 1) emit(e, (uint8_t)disp);
+  if (mod == 2) emit32(e, (uint32_t)disp);
+}
+
+// <prefix> REX 0F? op reg, [base + disp]. Opcodes above 0xff are two-byte
+// 0F xx opcodes.
+static void memOp(Emitter *e, uint8_t prefix, bool wide, int op, int reg,
+				  int base, int32_t disp) {
+  if (prefix != 0) emit(e, prefix);
+  emitRex(e, wide, reg, base);
+  if (op > 0xff) emit(e, op >> 8);
+  emit(e, op & 0xff);
+  emitMem(e, reg, base, disp);
+}
+
+static void regOp(Emitter *e, uint8_t op, int reg, int rm) {
+  emitRex(e, true, reg, rm);
+  emit(e, op);
+  emit(e, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+static void load(Emitter *e, int reg, int base, int32_t disp) {
+  memOp(e, 0, true, 0x8b, reg, base, disp);
+}
+
+static void store(Emitter *e, int base, int32_t disp, int reg) {
+  memOp(e, 0, true, 0x89, reg, base, disp);
+}
+
+static void move(Emitter *e, int dst, int src) {
+  regOp(e, 0x89, src, dst);
+}
+
+static void loadImm(Emitter *e, int reg, uint64_t value) {
+  emitRex(e, true, 0, reg);
+  emit(e, 0xb8 + (reg & 7));
+  emit64(e, value);
+}
+
+static void loadImm32(Emitter *e, int reg, uint32_t value) {
+  emitRex(e, false, 0, reg);
+  emit(e, 0xb8 + (reg & 7));
+  emit32(e, value);
+}
+
+// lea reg, [reg + disp]
+static void addImm(Emitter *e, int reg, int32_t disp) {
+  memOp(e, 0, true, 0x8d, reg, reg, disp);
+}
+
+// SSE2 scalar double ops on xmm registers: movsd load (0x10), store
+// (0x11), addsd (0x58), mulsd (0x59), subsd (0x5c), divsd (0x5e).
+static void sseMem(Emitter *e, int op, int xmm, int base, int32_t disp) {
+  memOp(e, 0xf2, false, 0x0f00 | op, xmm, base, disp);
+}
+
+static void callHelper(Emitter *e, void *fn) {
+  loadImm(e, RAX, (uint64_t)(uintptr_t)fn);
+  emit(e, 0xff);
+  emit(e, 0xd0);
+}
+
+static void addFixup(Emitter *e, int target) {
+  if (e->fixupCount == e->fixupCapacity) {
+	e->fixupCapacity = GROW_CAPACITY(e->fixupCapacity);
+	e->fixups = realloc(e->fixups, sizeof(Fixup) * e->fixupCapacity);
+  }
+  e->fixups[e->fixupCount].at = e->count;
+  e->fixups[e->fixupCount].target = target;
+  e->fixupCount++;
+  emit32(e, 0);
+}
+
+static void jump(Emitter *e, int target) {
+  emit(e, 0xe9);
+  addFixup(e, target);
+}
+
+// cc is the low nibble of the 0F 8x jcc opcode.
+static void jumpIf(Emitter *e, uint8_t cc, int target) {
+  emit(e, 0x0f);
+  emit(e, 0x80 | cc);
+  addFixup(e, target);
+}
+
+#define CC_O  0x0
+#define CC_AE 0x3
+#define CC_E  0x4
+#define CC_NE 0x5
+#define CC_ALWAYS 0x10
+#define ERROR_EXIT -1
+
+static void push(Emitter *e, int reg) {
+  store(e, REG_SP, 0, reg);
+  addImm(e, REG_SP, sizeof(Value));
+}
+
+static void pushImm(Emitter *e, Value value) {
+  loadImm(e, RAX, value);
+  push(e, RAX);
+}
+
+// rax holds 0 or 1, store the matching bool over the value at disp.
+static void storeBool(Emitter *e, int32_t disp) {
+  emit(e, 0x0f); emit(e, 0xb6); emit(e, 0xc0);  // movzx eax, al
+  loadImm(e, RCX, FALSE_VAL);
+  regOp(e, 0x01, RCX, RAX);                     // add rax, rcx
+  store(e, REG_SP, disp, RAX);
+}
+
+// A forward jump within the code of one instruction, landed by land once
+// its target is emitted. cc as for jumpIf, or CC_ALWAYS.
+static int jumpForward(Emitter *e, uint8_t cc) {
+  if (cc == CC_ALWAYS) {
+	emit(e, 0xe9);
+  } else {
+	emit(e, 0x0f);
+	emit(e, 0x80 | cc);
+  }
+  emit32(e, 0);
+  return e->count;
+}
+
+static void land(Emitter *e, int from) {
+  uint32_t rel = (uint32_t)(e->count - from);
+  for (int i = 0; i < 4; i++) e->code[from - 4 + i] = (rel >> (8 * i)) & 0xff;
+}
+
+// Jumps when reg doesn't hold an int. Clobbers rcx.
+static int jumpIfNotInt(Emitter *e, int reg) {
+  move(e, RCX, reg);
+  emit(e, 0x48); emit(e, 0xc1); emit(e, 0xe9); emit(e, 32);  // shr rcx, 32
+  emit(e, 0x81); emit(e, 0xf9);                 // cmp ecx, imm32
+  emit32(e, (uint32_t)((QNAN | TAG_INT) >> 32));
+  return jumpForward(e, CC_NE);
+}
+
+// Jumps when reg doesn't hold a double. Clobbers rcx and r8.
+static int jumpIfNotDouble(Emitter *e, int reg) {
+  loadImm(e, RCX, QNAN);
+  move(e, R8, reg);
+  regOp(e, 0x21, RCX, R8);                      // and r8, rcx
+  regOp(e, 0x39, RCX, R8);                      // cmp r8, rcx
+  return jumpForward(e, CC_E);
+}
+
+// Tags the int in eax, whose upper half is clear.
+static void tagInt(Emitter *e) {
+  loadImm(e, RCX, QNAN | TAG_INT);
+  regOp(e, 0x09, RCX, RAX);                     // or rax, rcx
+}
+
+// rax = jitArithmetic(vm, a, b, op), with a and b in rsi and rdx.
+static void arithmeticHelper(Emitter *e, int op) {
+  move(e, RDI, REG_VM);
+  loadImm32(e, RCX, op);
+  callHelper(e, (void *)jitArithmetic);
+}
+
+static int32_t slotDisp(int slot) {
+  return slot * (int32_t)sizeof(Value);
+}
+
+typedef struct {
+  int base;
+  int32_t disp;
+} Operand;
+
+#define STACK(disp) ((Operand){REG_SP, (disp)})
+#define SLOT(slot) ((Operand){REG_SLOTS, slotDisp(slot)})
+#define CONST(index) ((Operand){REG_CONSTS, slotDisp(index)})
+
+// xmm = the number in reg, rax or rdx, as a double. Returns the jump
+// taken when it isn't a number. Clobbers rcx and r8.
+static int toDouble(Emitter *e, int reg, int xmm) {
+  int notInt = jumpIfNotInt(e, reg);
+  emit(e, 0xf2); emit(e, 0x0f); emit(e, 0x2a);
+  emit(e, 0xc0 | (xmm << 3) | reg);             // cvtsi2sd xmm, reg32
+  int done = jumpForward(e, CC_ALWAYS);
+  land(e, notInt);
+  int notDouble = jumpIfNotDouble(e, reg);
+  emit(e, 0x66); emit(e, 0x48); emit(e, 0x0f); emit(e, 0x6e);
+  emit(e, 0xc0 | (xmm << 3) | reg);             // movq xmm, reg
+  land(e, done);
+  return notDouble;
+}
+
+// dst = a op b for ADD, SUBTRACT, MULTIPLY and DIVIDE. Two ints are done
+// on the integer unit unless the result isn't an int, other numbers as
+// doubles with SSE, anything else in jitArithmetic.
+static void arithmetic(Emitter *e, int op, Operand a, Operand b,
+					   Operand dst) {
+  int slow[4];
+  int slowCount = 0;
+  int intDone = -1;
+  load(e, RAX, a.base, a.disp);
+  load(e, RDX, b.base, b.disp);
+  if (op != OP_DIVIDE) {
+	int notIntA = jumpIfNotInt(e, RAX);
+	int notIntB = jumpIfNotInt(e, RDX);
+	switch (op) {
+	  case OP_ADD: emit(e, 0x01); emit(e, 0xd0); break;        // add eax, edx
+	  case OP_SUBTRACT: emit(e, 0x29); emit(e, 0xd0); break;   // sub eax, edx
+	  case OP_MULTIPLY:
+		emit(e, 0x0f); emit(e, 0xaf); emit(e, 0xc2);           // imul eax, edx
+		break;
+	}
+	slow[slowCount++] = jumpForward(e, CC_O);
+	if (op == OP_MULTIPLY) {
+	  // A zero product may be -0.
+	  regOp(e, 0x85, RAX, RAX);                 // test rax, rax
+	  slow[slowCount++] = jumpForward(e, CC_E);
+	}
+	tagInt(e);
+	store(e, dst.base, dst.disp, RAX);
+	intDone = jumpForward(e, CC_ALWAYS);
+	land(e, notIntA);
+	land(e, notIntB);
+  }
+  slow[slowCount++] = toDouble(e, RAX, 0);
+  slow[slowCount++] = toDouble(e, RDX, 1);
+  static const uint8_t sseOps[] = {
+	[OP_ADD] = 0x58, [OP_SUBTRACT] = 0x5c, [OP_MULTIPLY] = 0x59,
+	[OP_DIVIDE] = 0x5e
+  };
+  emit(e, 0xf2); emit(e, 0x0f); emit(e, sseOps[op]); emit(e, 0xc1);  // op xmm0, xmm1
+  sseMem(e, 0x11, 0, dst.base, dst.disp);
+  int doubleDone = jumpForward(e, CC_ALWAYS);
+  for (int i = 0; i < slowCount; i++) land(e, slow[i]);
+  load(e, RSI, a.base, a.disp);
+  load(e, RDX, b.base, b.disp);
+  arithmeticHelper(e, op);
+  store(e, dst.base, dst.disp, RAX);
+  if (intDone != -1) land(e, intDone);
+  land(e, doubleDone);
+}
+
+// al = a < b. Ints compare signed, other numbers as doubles with ucomisd,
+// anything else in jitArithmetic.
+static void less(Emitter *e, Operand a, Operand b) {
+  load(e, RAX, a.base, a.disp);
+  load(e, RDX, b.base, b.disp);
+  int notIntA = jumpIfNotInt(e, RAX);
+  int notIntB = jumpIfNotInt(e, RDX);
+  emit(e, 0x39); emit(e, 0xd0);                 // cmp eax, edx
+  emit(e, 0x0f); emit(e, 0x9c); emit(e, 0xc0);  // setl al
+  int intDone = jumpForward(e, CC_ALWAYS);
+  land(e, notIntA);
+  land(e, notIntB);
+  int slowA = toDouble(e, RAX, 0);
+  int slowB = toDouble(e, RDX, 1);
+  // b > a is "above", which is false when either is NaN.
+  emit(e, 0x66); emit(e, 0x0f); emit(e, 0x2e); emit(e, 0xc8);  // ucomisd xmm1, xmm0
+  emit(e, 0x0f); emit(e, 0x97); emit(e, 0xc0);  // seta al
+  int doubleDone = jumpForward(e, CC_ALWAYS);
+  land(e, slowA);
+  land(e, slowB);
+  move(e, RSI, RAX);
+  arithmeticHelper(e, OP_LESS);
+  loadImm(e, RCX, TRUE_VAL);
+  regOp(e, 0x39, RCX, RAX);                     // cmp rax, rcx
+  emit(e, 0x0f); emit(e, 0x94); emit(e, 0xc0);  // sete al
+  land(e, intDone);
+  land(e, doubleDone);
+}
+
+// Jumps to target unless a < b.
+static void lessJump(Emitter *e, Operand a, Operand b, int target) {
+  less(e, a, b);
+  emit(e, 0x84); emit(e, 0xc0);                 // test al, al
+  jumpIf(e, CC_E, target);
+}
+
+static void loadUpvalueLocation(Emitter *e, int index) {
+  load(e, RAX, REG_FRAME, offsetof(CallFrame, closure));
+  load(e, RAX, RAX, offsetof(ObjClosure, upvalues) +
+	  index * (int32_t)sizeof(ObjUpvalue *));
+  load(e, RAX, RAX, offsetof(ObjUpvalue, location));
+}
+
+static void loadGlobals(Emitter *e) {
+  load(e, RAX, REG_VM, offsetof(VM, globalValues) +
+	  offsetof(ValueArray, values));
+}
+
+// mov byte [globalCards + (slot >> GLOBAL_CARD_SHIFT)], 1
+static void markGlobalCard(Emitter *e, int slot) {
+  load(e, RAX, REG_VM, offsetof(VM, globalCards));
+  memOp(e, 0, false, 0xc6, 0, RAX, slot >> GLOBAL_CARD_SHIFT);
+  emit(e, 1);
+}
+
+static int readShort(uint8_t *code) {
+  return (code[0] << 8) | code[1];
+}
+
+// Bytecode offset a jump at offset lands on, or -1.
+static int jumpTarget(Chunk *chunk, int offset) {
+  uint8_t *code = chunk->code + offset;
+  int next = offset + instructionLength(chunk, offset);
+  switch (code[0]) {
+	case OP_JUMP:
+	case OP_JUMP_IF: return next + readShort(code + 1);
+	case OP_LOOP: return next - readShort(code + 1);
+	case OP_LESS_LOCAL_CONST_JUMP:
+	case OP_LESS_LOCALS_JUMP: return next + readShort(code + 3);
+	default: return -1;
+  }
+}
+
+static void emitInstruction(Emitter *e, Chunk *chunk, int offset) {
+  uint8_t *code = chunk->code + offset;
+  int next = offset + instructionLength(chunk, offset);
+  switch (code[0]) {
+	case OP_CONSTANT:
+	  load(e, RAX, REG_CONSTS, slotDisp(code[1]));
+	  push(e, RAX);
+	  break;
+	case OP_CONSTANT_LONG:
+	  load(e, RAX, REG_CONSTS,
+		   slotDisp(code[1] | (code[2] << 8) | (code[3] << 16)));
+	  push(e, RAX);
+	  break;
+	case OP_ADD:
+	case OP_SUBTRACT:
+	case OP_MULTIPLY:
+	case OP_DIVIDE:
+	  arithmetic(e, code[0], STACK(-16), STACK(-8), STACK(-16));
+	  addImm(e, REG_SP, -8);
+	  break;
+	case OP_NEGATE: {
+	  // 0 and INT32_MIN don't negate to ints.
+	  load(e, RAX, REG_SP, -8);
+	  int notInt = jumpIfNotInt(e, RAX);
+	  emit(e, 0xf7); emit(e, 0xd8);                 // neg eax
+	  int overflow = jumpForward(e, CC_O);
+	  int zero = jumpForward(e, CC_E);
+	  tagInt(e);
+	  store(e, REG_SP, -8, RAX);
+	  int intDone = jumpForward(e, CC_ALWAYS);
+	  land(e, notInt);
+	  int notDouble = jumpIfNotDouble(e, RAX);
+	  loadImm(e, RCX, SIGN_BIT);
+	  memOp(e, 0, true, 0x31, RCX, REG_SP, -8);     // xor [sp - 8], rcx
+	  int doubleDone = jumpForward(e, CC_ALWAYS);
+	  land(e, overflow);
+	  land(e, zero);
+	  land(e, notDouble);
+	  load(e, RSI, REG_SP, -8);
+	  arithmeticHelper(e, OP_NEGATE);
+	  store(e, REG_SP, -8, RAX);
+	  land(e, intDone);
+	  land(e, doubleDone);
+	  break;
+	}
+	case OP_LESS:
+	  less(e, STACK(-16), STACK(-8));
+	  storeBool(e, -16);
+	  addImm(e, REG_SP, -8);
+	  break;
+	case OP_EQ: {
+	  // Two ints are equal when their bits are.
+	  load(e, RSI, REG_SP, -16);
+	  load(e, RDX, REG_SP, -8);
+	  int notIntA = jumpIfNotInt(e, RSI);
+	  int notIntB = jumpIfNotInt(e, RDX);
+	  regOp(e, 0x39, RDX, RSI);                     // cmp rsi, rdx
+	  emit(e, 0x0f); emit(e, 0x94); emit(e, 0xc0);  // sete al
+	  int intDone = jumpForward(e, CC_ALWAYS);
+	  land(e, notIntA);
+	  land(e, notIntB);
+	  move(e, RDI, REG_VM);
+	  callHelper(e, (void *)jitEqual);
+	  land(e, intDone);
+	  storeBool(e, -16);
+	  addImm(e, REG_SP, -8);
+	  break;
+	}
+	case OP_NIL: pushImm(e, NIL_VAL); break;
+	case OP_TRUE: pushImm(e, TRUE_VAL); break;
+	case OP_FALSE: pushImm(e, FALSE_VAL); break;
+	case OP_PRINT:
+	  addImm(e, REG_SP, -8);
+	  move(e, RDI, REG_VM);
+	  load(e, RSI, REG_SP, 0);
+	  callHelper(e, (void *)jitPrint);
+	  break;
+	case OP_POP:
+	  addImm(e, REG_SP, -8);
+	  break;
+	case OP_DEFINE_GLOBAL:
+	  loadGlobals(e);
+	  load(e, RCX, REG_SP, -8);
+	  store(e, RAX, slotDisp(readShort(code + 1)), RCX);
+	  markGlobalCard(e, readShort(code + 1));
+	  addImm(e, REG_SP, -8);
+	  break;
+	case OP_GET_GLOBAL:
+	case OP_SET_GLOBAL:
+	  loadGlobals(e);
+	  load(e, RDX, RAX, slotDisp(readShort(code + 1)));
+	  loadImm(e, RCX, UNDEFINED_VAL);
+	  regOp(e, 0x39, RCX, RDX);                     // cmp rdx, rcx
+	  jumpIf(e, CC_E, ERROR_EXIT);
+	  if (code[0] == OP_GET_GLOBAL) {
+		push(e, RDX);
+	  } else {
+		load(e, RCX, REG_SP, -8);
+		store(e, RAX, slotDisp(readShort(code + 1)), RCX);
+		markGlobalCard(e, readShort(code + 1));
+	  }
+	  break;
+	case OP_GET_LOCAL:
+	  load(e, RAX, REG_SLOTS, slotDisp(code[1]));
+	  push(e, RAX);
+	  break;
+	case OP_SET_LOCAL:
+	  load(e, RAX, REG_SP, -8);
+	  store(e, REG_SLOTS, slotDisp(code[1]), RAX);
+	  break;
+	case OP_GET_UPVALUE:
+	  loadUpvalueLocation(e, code[1]);
+	  load(e, RAX, RAX, 0);
+	  push(e, RAX);
+	  break;
+	case OP_SET_UPVALUE:
+	  // Goes through the helper for the write barrier.
+	  load(e, RSI, REG_FRAME, offsetof(CallFrame, closure));
+	  load(e, RSI, RSI, offsetof(ObjClosure, upvalues) +
+		  code[1] * (int32_t)sizeof(ObjUpvalue *));
+	  move(e, RDI, REG_VM);
+	  load(e, RDX, REG_SP, -8);
+	  callHelper(e, (void *)jitSetUpvalue);
+	  break;
+	case OP_CLOSE_UPVALUE:
+	  move(e, RDI, REG_VM);
+	  move(e, RSI, REG_SP);
+	  callHelper(e, (void *)jitCloseUpvalue);
+	  move(e, REG_SP, RAX);
+	  break;
+	case OP_JUMP_IF:
+	  addImm(e, REG_SP, -8);
+	  load(e, RAX, REG_SP, 0);
+	  loadImm(e, RCX, NIL_VAL);
+	  regOp(e, 0x39, RCX, RAX);
+	  jumpIf(e, CC_E, next + readShort(code + 1));
+	  loadImm(e, RCX, FALSE_VAL);
+	  regOp(e, 0x39, RCX, RAX);
+	  jumpIf(e, CC_E, next + readShort(code + 1));
+	  break;
+	case OP_JUMP:
+	  jump(e, next + readShort(code + 1));
+	  break;
+	case OP_LOOP:
+	  // Safepoint: collect if an allocation asked for it.
+	  memOp(e, 0, false, 0x80, 7, REG_VM, offsetof(VM, gcRequested));
+	  emit(e, 0);                                   // cmp byte [vm.gcRequested], 0
+	  jumpIf(e, CC_E, next - readShort(code + 1));
+	  move(e, RDI, REG_VM);
+	  move(e, RSI, REG_SP);
+	  callHelper(e, (void *)jitSafepoint);
+	  regOp(e, 0x84, RAX, RAX);                     // test al, al
+	  jumpIf(e, CC_E, ERROR_EXIT);
+	  jump(e, next - readShort(code + 1));
+	  break;
+	case OP_CALL:
+	  move(e, RDI, REG_VM);
+	  move(e, RSI, REG_SP);
+	  loadImm32(e, RDX, code[1]);
+	  callHelper(e, (void *)jitCall);
+	  regOp(e, 0x85, RAX, RAX);                     // test rax, rax
+	  jumpIf(e, CC_E, ERROR_EXIT);
+	  move(e, REG_SP, RAX);
+	  // The callee may have grown, and so moved, the stack.
+	  load(e, REG_SLOTS, REG_FRAME, offsetof(CallFrame, slots));
+	  break;
+	case OP_TAIL_CALL:
+	  move(e, RDI, REG_VM);
+	  move(e, RSI, REG_SP);
+	  loadImm32(e, RDX, code[1]);
+	  move(e, RCX, REG_FRAME);
+	  callHelper(e, (void *)jitTailCall);
+	  jump(e, chunk->count);                        // epilogue, eax is set
+	  break;
+	case OP_CLOSURE:
+	  move(e, RDI, REG_VM);
+	  move(e, RSI, REG_SP);
+	  move(e, RDX, REG_FRAME);
+	  loadImm32(e, RCX, offset);
+	  callHelper(e, (void *)jitClosure);
+	  move(e, REG_SP, RAX);
+	  break;
+	case OP_RETURN:
+	  move(e, RDI, REG_VM);
+	  move(e, RSI, REG_SP);
+	  move(e, RDX, REG_FRAME);
+	  callHelper(e, (void *)jitReturn);
+	  loadImm32(e, RAX, JIT_OK);
+	  jump(e, chunk->count);
+	  break;
+	case OP_ADD_LOCALS:
+	  arithmetic(e, OP_ADD, SLOT(code[1]), SLOT(code[2]), STACK(0));
+	  addImm(e, REG_SP, 8);
+	  break;
+	case OP_ADD_CONST:
+	  arithmetic(e, OP_ADD, STACK(-8), CONST(code[1]), STACK(-8));
+	  break;
+	case OP_INC_LOCAL: {
+	  load(e, RAX, REG_SLOTS, slotDisp(code[1]));
+	  int notInt = jumpIfNotInt(e, RAX);
+	  emit(e, 0x83); emit(e, 0xc0); emit(e, 1);    // add eax, 1
+	  int overflow = jumpForward(e, CC_O);
+	  tagInt(e);
+	  store(e, REG_SLOTS, slotDisp(code[1]), RAX);
+	  int intDone = jumpForward(e, CC_ALWAYS);
+	  land(e, notInt);
+	  int notDouble = jumpIfNotDouble(e, RAX);
+	  loadImm(e, RAX, NUM_VAL(1));
+	  emit(e, 0x66); emitRex(e, true, 1, RAX);
+	  emit(e, 0x0f); emit(e, 0x6e); emit(e, 0xc8);  // movq xmm1, rax
+	  sseMem(e, 0x10, 0, REG_SLOTS, slotDisp(code[1]));
+	  emit(e, 0xf2); emit(e, 0x0f); emit(e, 0x58); emit(e, 0xc1);  // addsd
+	  sseMem(e, 0x11, 0, REG_SLOTS, slotDisp(code[1]));
+	  int doubleDone = jumpForward(e, CC_ALWAYS);
+	  land(e, overflow);
+	  land(e, notDouble);
+	  load(e, RSI, REG_SLOTS, slotDisp(code[1]));
+	  loadImm(e, RDX, INT_VAL(1));
+	  arithmeticHelper(e, OP_ADD);
+	  store(e, REG_SLOTS, slotDisp(code[1]), RAX);
+	  land(e, intDone);
+	  land(e, doubleDone);
+	  break;
+	}
+	case OP_STORE_LOCAL:
+	  addImm(e, REG_SP, -8);
+	  load(e, RAX, REG_SP, 0);
+	  store(e, REG_SLOTS, slotDisp(code[1]), RAX);
+	  break;
+	case OP_LESS_LOCAL_CONST_JUMP:
+	  lessJump(e, SLOT(code[1]), CONST(code[2]), next + readShort(code + 3));
+	  break;
+	case OP_LESS_LOCALS_JUMP:
+	  lessJump(e, SLOT(code[1]), SLOT(code[2]), next + readShort(code + 3));
+	  break;
+	case OP_LIST:
+	  move(e, RDI, REG_VM);
+	  move(e, RSI, REG_SP);
+	  loadImm32(e, RDX, code[1]);
+	  callHelper(e, (void *)jitList);
+	  move(e, REG_SP, RAX);
+	  break;
+	case OP_GET_INDEX: {
+	  // A list indexed by an int in range is read inline.
+	  load(e, RAX, REG_SP, -16);
+	  load(e, RDX, REG_SP, -8);
+	  loadImm(e, RCX, SIGN_BIT | QNAN);
+	  move(e, R8, RAX);
+	  regOp(e, 0x21, RCX, R8);                      // and r8, rcx
+	  regOp(e, 0x39, RCX, R8);                      // cmp r8, rcx
+	  int notObject = jumpForward(e, CC_NE);
+	  emit(e, 0x48); emit(e, 0xf7); emit(e, 0xd1);  // not rcx
+	  regOp(e, 0x21, RCX, RAX);                     // and rax, rcx
+	  memOp(e, 0, false, 0x81, 7, RAX, offsetof(Obj, type));
+	  emit32(e, OBJ_LIST);                          // cmp dword [rax], OBJ_LIST
+	  int notList = jumpForward(e, CC_NE);
+	  int notInt = jumpIfNotInt(e, RDX);
+	  memOp(e, 0, false, 0x3b, RDX, RAX,            // cmp edx, [items.count]
+			offsetof(ObjList, items) + offsetof(ValueArray, count));
+	  int outOfRange = jumpForward(e, CC_AE);
+	  load(e, RAX, RAX, offsetof(ObjList, items) +
+		  offsetof(ValueArray, values));
+	  emit(e, 0x89); emit(e, 0xd2);                 // mov edx, edx
+	  emit(e, 0x48); emit(e, 0xc1); emit(e, 0xe2); emit(e, 3);  // shl rdx, 3
+	  regOp(e, 0x01, RDX, RAX);                     // add rax, rdx
+	  load(e, RAX, RAX, 0);
+	  store(e, REG_SP, -16, RAX);
+	  addImm(e, REG_SP, -8);
+	  int done = jumpForward(e, CC_ALWAYS);
+	  land(e, notObject);
+	  land(e, notList);
+	  land(e, notInt);
+	  land(e, outOfRange);
+	  move(e, RDI, REG_VM);
+	  move(e, RSI, REG_SP);
+	  callHelper(e, (void *)jitGetIndex);
+	  regOp(e, 0x85, RAX, RAX);                     // test rax, rax
+	  jumpIf(e, CC_E, ERROR_EXIT);
+	  move(e, REG_SP, RAX);
+	  land(e, done);
+	  break;
+	}
+	case OP_SET_INDEX:
+	case OP_DELETE_INDEX:
+	  move(e, RDI, REG_VM);
+	  move(e, RSI, REG_SP);
+	  callHelper(e, code[0] == OP_SET_INDEX ? (void *)jitSetIndex
+										   : (void *)jitDeleteIndex);
+	  regOp(e, 0x85, RAX, RAX);                     // test rax, rax
+	  jumpIf(e, CC_E, ERROR_EXIT);
+	  move(e, REG_SP, RAX);
+	  break;
+	case OP_MAP:
+	  move(e, RDI, REG_VM);
+	  move(e, RSI, REG_SP);
+	  loadImm32(e, RDX, code[1]);
+	  callHelper(e, (void *)jitMap);
+	  regOp(e, 0x85, RAX, RAX);                     // test rax, rax
+	  jumpIf(e, CC_E, ERROR_EXIT);
+	  move(e, REG_SP, RAX);
+	  break;
+	default:
+	  e->failed = true;
+	  break;
+  }
+}
+
+bool jitCompile(VM *vm, ObjFn *fn) {
+  (void)vm;
+  if (fn->jit != NULL) return true;
+  if (fn->jitFailed) return false;
+  Chunk *chunk = &fn->chunk;
+  Emitter e = {NULL, 0, 0, NULL, 0, 0, false};
+  int *entries = malloc(sizeof(int) * (chunk->count + 1));
+
+  // Prologue: save the pinned registers, load them and jump to the entry.
+  // Five pushes on top of the return address leave rsp 16-byte aligned.
+  emit(&e, 0x53);                                   // push rbx
+  emit(&e, 0x41); emit(&e, 0x54);                   // push r12
+  emit(&e, 0x41); emit(&e, 0x55);                   // push r13
+  emit(&e, 0x41); emit(&e, 0x56);                   // push r14
+  emit(&e, 0x41); emit(&e, 0x57);                   // push r15
+  move(&e, REG_VM, RDI);
+  move(&e, REG_FRAME, RSI);
+  load(&e, REG_SP, REG_VM, offsetof(VM, sp));
+  load(&e, REG_SLOTS, REG_FRAME, offsetof(CallFrame, slots));
+  load(&e, RAX, REG_FRAME, offsetof(CallFrame, closure));
+  load(&e, RAX, RAX, offsetof(ObjClosure, fn));
+  load(&e, REG_CONSTS, RAX, offsetof(ObjFn, chunk) +
+	  offsetof(Chunk, constants) + offsetof(ValueArray, values));
+  emit(&e, 0xff); emit(&e, 0xe2);                   // jmp rdx
+
+  bool *isTarget = calloc(chunk->count + 1, sizeof(bool));
+  for (int offset = 0; offset < chunk->count;
+	   offset += instructionLength(chunk, offset)) {
+	int target = jumpTarget(chunk, offset);
+	if (target >= 0) isTarget[target] = true;
+  }
+  for (int offset = 0; offset < chunk->count && !e.failed;) {
+	entries[offset] = e.count;
+	int next = offset + instructionLength(chunk, offset);
+	// ADD_LOCALS into STORE_LOCAL keeps the sum in a register instead of
+	// bouncing it through the stack.
+	if (chunk->code[offset] == OP_ADD_LOCALS && next < chunk->count &&
+		chunk->code[next] == OP_STORE_LOCAL && !isTarget[next]) {
+	  arithmetic(&e, OP_ADD, SLOT(chunk->code[offset + 1]),
+				 SLOT(chunk->code[offset + 2]), SLOT(chunk->code[next + 1]));
+	  entries[next] = e.count;
+	  offset = next + instructionLength(chunk, next);
+	  continue;
+	}
+	emitInstruction(&e, chunk, offset);
+	offset = next;
+  }
+  free(isTarget);
+
+  // The error exit, then the epilogue every exit ends in.
+  int errorExit = e.count;
+  loadImm32(&e, RAX, JIT_ERROR);
+  entries[chunk->count] = e.count;
+  emit(&e, 0x41); emit(&e, 0x5f);                   // pop r15
+  emit(&e, 0x41); emit(&e, 0x5e);                   // pop r14
+  emit(&e, 0x41); emit(&e, 0x5d);                   // pop r13
+  emit(&e, 0x41); emit(&e, 0x5c);                   // pop r12
+  emit(&e, 0x5b);                                   // pop rbx
+  emit(&e, 0xc3);                                   // ret
+
+  uint8_t *code = MAP_FAILED;
+  if (!e.failed) {
+	for (int i = 0; i < e.fixupCount; i++) {
+	  Fixup *fixup = &e.fixups[i];
+	  int target = fixup->target < 0 ? errorExit : entries[fixup->target];
+	  int32_t rel = target - (fixup->at + 4);
+	  memcpy(e.code + fixup->at, &rel, sizeof(rel));
+	}
+	code = mmap(NULL, e.count, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  }
+  if (code != MAP_FAILED) {
+	memcpy(code, e.code, e.count);
+	if (mprotect(code, e.count, PROT_READ | PROT_EXEC) != 0) {
+	  munmap(code, e.count);
+	  code = MAP_FAILED;
+	}
+  }
+  free(e.code);
+  free(e.fixups);
+  if (code == MAP_FAILED) {
+	free(entries);
+	fn->jitFailed = true;
+	return false;
+  }
+
+  JitCode *jit = malloc(sizeof(JitCode));
+  jit->code = code;
+  jit->size = e.count;
+  jit->entries = entries;
+  fn->jit = jit;
+  return true;
+}
+
+JitStatus jitEnter(VM *vm, CallFrame *frame, int offset) {
+  JitCode *jit = frame->closure->fn->jit;
+  JitEntry entry = (JitEntry)(void *)jit->code;
+  return (JitStatus)entry(vm, frame, jit->code + jit->entries[offset]);
+}
+
+void jitFree(ObjFn *fn) {
+  if (fn->jit == NULL) return;
+  munmap(fn->jit->code, fn->jit->size);
+  free(fn->jit->entries);
+  free(fn->jit);
+  fn->jit = NULL;
+}
+
+#else
+
+bool jitCompile(VM *vm, ObjFn *fn) {
+  (void)vm;
+  fn->jitFailed = true;
+  return false;
+}
+
+JitStatus jitEnter(VM *vm, CallFrame *frame, int offset) {
+  (void)vm;
+  (void)frame;
+  (void)offset;
+  return JIT_ERROR;
+}
+
+void jitFree(ObjFn *fn) {
+  (void)fn;
+}
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef CLOX_JIT_H
+#define CLOX_JIT_H
+
+#include "common.h"
+#include "clox.h"
+#include "object.h"
+
+// Baseline template JIT: every stack instruction of a function becomes a
+// fixed sequence of x86-64 code working on the VM stack, with the stack
+// pointer, frame slots and constants kept in callee-saved registers.
+// Anything that can allocate or re-enter the interpreter goes through the
+// jit* helpers below, which vm.c implements.
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define JIT_SUPPORTED 1
+#else
+#define JIT_SUPPORTED 0
+#endif
+
+// A function is compiled once it has been called this many times, or once
+// its loops have jumped back this many times, whichever comes first.
+#define JIT_CALL_THRESHOLD 16
+#define JIT_LOOP_THRESHOLD 1000
+// Compiled code runs each call it makes in a nested C call. Calls deeper
+// than this many compiled frames are interpreted instead, which doesn't
+// nest, so deep recursion ends in "Stack overflow." rather than a crash.
+#define JIT_MAX_DEPTH 1000
+
+typedef enum {
+  JIT_OK,     // the frame returned
+  JIT_ERROR,  // runtime error
+  JIT_TAIL    // the frame was reused by a tail call, run it again
+} JitStatus;
+
+typedef struct CallFrame CallFrame;
+typedef struct JitCode JitCode;
+
+// Compiles fn unless it already is. Returns false for functions the JIT
+// can't handle, which then stay in the interpreter.
+bool jitCompile(VM *vm, ObjFn *fn);
+
+// Runs the compiled code of frame, the newest one, from the instruction at
+// the bytecode offset until the frame returns. Any instruction boundary is
+// a valid entry, which is how loops are replaced on the stack.
+JitStatus jitEnter(VM *vm, CallFrame *frame, int offset);
+
+void jitFree(ObjFn *fn);
+
+// Runtime helpers called from compiled code. The ones taking sp store it
+// to vm->sp first and return the new stack top.
+Value *jitCall(VM *vm, Value *sp, int argCount);
+JitStatus jitTailCall(VM *vm, Value *sp, int argCount, CallFrame *frame);
+void jitReturn(VM *vm, Value *sp, CallFrame *frame);
+Value *jitClosure(VM *vm, Value *sp, CallFrame *frame, int offset);
+void jitSetUpvalue(VM *vm, ObjUpvalue *upvalue, Value value);
+bool jitSafepoint(VM *vm, Value *sp);
+Value *jitCloseUpvalue(VM *vm, Value *sp);
+// The arithmetic instruction op on operands the compiled code doesn't
+// handle inline, LESS giving a bool. NEGATE ignores b.
+Value jitArithmetic(VM *vm, Value a, Value b, int op);
+bool jitEqual(VM *vm, Value a, Value b);
+void jitPrint(VM *vm, Value value);
+// The index helpers return NULL for a runtime error.
+Value *jitList(VM *vm, Value *sp, int count);
+Value *jitGetIndex(VM *vm, Value *sp);
+Value *jitSetIndex(VM *vm, Value *sp);
+Value *jitMap(VM *vm, Value *sp, int count);
+Value *jitDeleteIndex(VM *vm, Value *sp);
+
+#endif
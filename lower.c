@@ -0,0 +1,547 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "lower.h"
+#include "memory.h"
+
+// The stack bytecode is walked once while a model of the operand stack is
+// kept. Loads of locals and constants don't emit anything, they only record
+// where the value can be found. Consumers read it from there directly, so
+// 'a + b' becomes a single ADD of the two local registers. A value is only
+// copied into its own slot when something needs it there: a call window,
+// a captured variable, a branch or label, or a write to the local it
+// aliases.
+
+#define MAX_REGISTERS (UINT8_MAX + 1)
+
+typedef enum {
+  ENTRY_REG,     // in its own slot
+  ENTRY_LOCAL,   // same as the local slot in operand
+  ENTRY_CONST,   // constant operand
+  ENTRY_NIL,
+  ENTRY_TRUE,
+  ENTRY_FALSE,
+} EntryKind;
+
+typedef struct {
+  EntryKind kind;
+  int operand;
+} StackEntry;
+
+typedef struct {
+  int at;        // offset of the 16-bit operand in the register code
+  int end;       // end of the jump instruction
+  int target;    // stack bytecode offset of the target
+} Fixup;
+
+typedef struct {
+  ObjFn *fn;
+  Chunk *chunk;
+  uint8_t *code;
+  int count;
+  int capacity;
+  StackEntry stack[MAX_REGISTERS];
+  int depth;
+  int maxDepth;
+  // Offset of the destination operand of the last instruction if it wrote
+  // the top of the stack, so a following store can retarget it. -1 if not.
+  int lastDest;
+  Fixup *fixups;
+  int fixupCount;
+  bool failed;
+} Lowerer;
+
+int regInstructionLength(ObjFn *fn, int offset) {
+  static const int lengths[] = {
+#define REGOP(_, length) length,
+#include "regopcode.h"
+#undef REGOP
+  };
+  uint8_t op = fn->regCode[offset];
+  if (op == ROP_CLOSURE) {
+    ObjFn *inner = AS_FN(fn->chunk.constants.values[fn->regCode[offset + 2]]);
+    return lengths[op] + 2 * inner->upvalueCount;
+  }
+  return lengths[op];
+}
+
+static void emitByte(Lowerer *lowerer, uint8_t byte) {
+  if (lowerer->count == lowerer->capacity) {
+    lowerer->capacity = GROW_CAPACITY(lowerer->capacity);
+    lowerer->code = realloc(lowerer->code, lowerer->capacity);
+  }
+  lowerer->code[lowerer->count++] = byte;
+  lowerer->lastDest = -1;
+}
+
+static void emitOp(Lowerer *lowerer, RegOpCode op, int a) {
+  emitByte(lowerer, op);
+  emitByte(lowerer, (uint8_t)a);
+}
+
+static void emitShort(Lowerer *lowerer, uint16_t value) {
+  emitByte(lowerer, (value >> 8) & 0xff);
+  emitByte(lowerer, value & 0xff);
+}
+
+static void emitJump(Lowerer *lowerer, int target) {
+  Fixup *fixup = &lowerer->fixups[lowerer->fixupCount++];
+  fixup->at = lowerer->count;
+  fixup->target = target;
+  emitShort(lowerer, 0xffff);
+  fixup->end = lowerer->count;
+}
+
+static void push(Lowerer *lowerer, EntryKind kind, int operand) {
+  lowerer->lastDest = -1;
+  if (lowerer->depth == MAX_REGISTERS) {
+    lowerer->failed = true;
+    return;
+  }
+  StackEntry *entry = &lowerer->stack[lowerer->depth++];
+  entry->kind = kind;
+  entry->operand = operand;
+  if (lowerer->depth > lowerer->maxDepth) {
+    lowerer->maxDepth = lowerer->depth;
+  }
+}
+
+static void pop(Lowerer *lowerer, int count) {
+  lowerer->lastDest = -1;
+  lowerer->depth -= count;
+  if (lowerer->depth < 0) {
+    lowerer->failed = true;
+    lowerer->depth = 0;
+  }
+}
+
+static void materialize(Lowerer *lowerer, int slot);
+
+// Copies every pending alias of slot into its own register, so slot can be
+// overwritten.
+static void protect(Lowerer *lowerer, int slot) {
+  for (int i = 0; i < lowerer->depth; i++) {
+    StackEntry *entry = &lowerer->stack[i];
+    if (i != slot && entry->kind == ENTRY_LOCAL && entry->operand == slot) {
+      materialize(lowerer, i);
+    }
+  }
+}
+
+// Emits the load of a pending entry into register dest.
+static void loadInto(Lowerer *lowerer, StackEntry *entry, int dest) {
+  switch (entry->kind) {
+    case ENTRY_REG: break;
+    case ENTRY_LOCAL:
+      if (entry->operand == dest) break;
+      emitOp(lowerer, ROP_MOVE, dest);
+      emitByte(lowerer, (uint8_t)entry->operand);
+      break;
+    case ENTRY_CONST:
+      if (entry->operand < 256) {
+        emitOp(lowerer, ROP_LOADK, dest);
+        emitByte(lowerer, (uint8_t)entry->operand);
+      } else {
+        emitOp(lowerer, ROP_LOADK_LONG, dest);
+        emitByte(lowerer, entry->operand & 0xff);
+        emitByte(lowerer, (entry->operand >> 8) & 0xff);
+        emitByte(lowerer, (entry->operand >> 16) & 0xff);
+      }
+      break;
+    case ENTRY_NIL: emitOp(lowerer, ROP_LOADNIL, dest);
+      break;
+    case ENTRY_TRUE: emitOp(lowerer, ROP_LOADTRUE, dest);
+      break;
+    case ENTRY_FALSE: emitOp(lowerer, ROP_LOADFALSE, dest);
+      break;
+  }
+}
+
+static void materialize(Lowerer *lowerer, int slot) {
+  if (slot >= lowerer->depth) return;
+  StackEntry *entry = &lowerer->stack[slot];
+  if (entry->kind == ENTRY_REG) return;
+  protect(lowerer, slot);
+  loadInto(lowerer, entry, slot);
+  entry->kind = ENTRY_REG;
+}
+
+static void flush(Lowerer *lowerer) {
+  for (int i = 0; i < lowerer->depth; i++) materialize(lowerer, i);
+}
+
+// The register to read the stack value at slot from.
+static int operand(Lowerer *lowerer, int slot) {
+  StackEntry *entry = &lowerer->stack[slot];
+  if (entry->kind == ENTRY_LOCAL) return entry->operand;
+  materialize(lowerer, slot);
+  return slot;
+}
+
+// The register of a local variable that is about to be read.
+static int local(Lowerer *lowerer, int slot) {
+  materialize(lowerer, slot);
+  return slot;
+}
+
+// Pushes the result of the instruction just emitted into the slot at the
+// top. Its destination operand is at dest.
+static void pushResult(Lowerer *lowerer, int dest) {
+  push(lowerer, ENTRY_REG, 0);
+  lowerer->lastDest = dest;
+}
+
+static bool hasAlias(Lowerer *lowerer, int slot) {
+  for (int i = 0; i < lowerer->depth; i++) {
+    StackEntry *entry = &lowerer->stack[i];
+    if (entry->kind == ENTRY_LOCAL && entry->operand == slot) return true;
+  }
+  return false;
+}
+
+// Stores the top of the stack into a local.
+static void storeLocal(Lowerer *lowerer, int slot) {
+  int top = lowerer->depth - 1;
+  if (slot >= top) {
+    lowerer->failed = true;
+    return;
+  }
+  StackEntry *value = &lowerer->stack[top];
+  if (value->kind == ENTRY_REG && lowerer->lastDest != -1 &&
+      !hasAlias(lowerer, slot)) {
+    // Let the instruction that computed the value write the local.
+    lowerer->code[lowerer->lastDest] = (uint8_t)slot;
+    lowerer->lastDest = -1;
+    value->kind = ENTRY_LOCAL;
+    value->operand = slot;
+  } else if (value->kind == ENTRY_REG) {
+    protect(lowerer, slot);
+    emitOp(lowerer, ROP_MOVE, slot);
+    emitByte(lowerer, (uint8_t)top);
+  } else {
+    // Constants are loaded straight into the local.
+    protect(lowerer, slot);
+    loadInto(lowerer, value, slot);
+  }
+  lowerer->stack[slot].kind = ENTRY_REG;
+}
+
+static void binary(Lowerer *lowerer, RegOpCode op) {
+  int b = operand(lowerer, lowerer->depth - 1);
+  int a = operand(lowerer, lowerer->depth - 2);
+  pop(lowerer, 2);
+  int dest = lowerer->depth;
+  protect(lowerer, dest);
+  emitOp(lowerer, op, dest);
+  int destAt = lowerer->count - 1;
+  emitByte(lowerer, (uint8_t)a);
+  emitByte(lowerer, (uint8_t)b);
+  pushResult(lowerer, destAt);
+}
+
+static uint16_t readShort(Chunk *chunk, int offset) {
+  return (uint16_t)((chunk->code[offset] << 8) | chunk->code[offset + 1]);
+}
+
+static void lowerInstruction(Lowerer *lowerer, int offset,
+                             const int *newOffset) {
+  Chunk *chunk = lowerer->chunk;
+  uint8_t *code = chunk->code + offset;
+  int top = lowerer->depth - 1;
+  switch (code[0]) {
+    case OP_CONSTANT: push(lowerer, ENTRY_CONST, code[1]);
+      break;
+    case OP_CONSTANT_LONG:
+      push(lowerer, ENTRY_CONST, code[1] | (code[2] << 8) | (code[3] << 16));
+      break;
+    case OP_NIL: push(lowerer, ENTRY_NIL, 0);
+      break;
+    case OP_TRUE: push(lowerer, ENTRY_TRUE, 0);
+      break;
+    case OP_FALSE: push(lowerer, ENTRY_FALSE, 0);
+      break;
+    case OP_ADD: binary(lowerer, ROP_ADD);
+      break;
+    case OP_SUBTRACT: binary(lowerer, ROP_SUBTRACT);
+      break;
+    case OP_MULTIPLY: binary(lowerer, ROP_MULTIPLY);
+      break;
+    case OP_DIVIDE: binary(lowerer, ROP_DIVIDE);
+      break;
+    case OP_LESS: binary(lowerer, ROP_LESS);
+      break;
+    case OP_EQ: binary(lowerer, ROP_EQ);
+      break;
+    case OP_NEGATE: {
+      int a = operand(lowerer, top);
+      pop(lowerer, 1);
+      protect(lowerer, top);
+      emitOp(lowerer, ROP_NEGATE, top);
+      int destAt = lowerer->count - 1;
+      emitByte(lowerer, (uint8_t)a);
+      pushResult(lowerer, destAt);
+      break;
+    }
+    case OP_PRINT:
+      emitOp(lowerer, ROP_PRINT, operand(lowerer, top));
+      pop(lowerer, 1);
+      break;
+    case OP_POP: pop(lowerer, 1);
+      break;
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL: {
+      int a = operand(lowerer, top);
+      emitOp(lowerer, code[0] == OP_DEFINE_GLOBAL ? ROP_DEFINE_GLOBAL
+                                                  : ROP_SET_GLOBAL, a);
+      emitByte(lowerer, code[1]);
+      emitByte(lowerer, code[2]);
+      if (code[0] == OP_DEFINE_GLOBAL) pop(lowerer, 1);
+      break;
+    }
+    case OP_GET_GLOBAL: {
+      int dest = lowerer->depth;
+      protect(lowerer, dest);
+      emitOp(lowerer, ROP_GET_GLOBAL, dest);
+      int destAt = lowerer->count - 1;
+      emitByte(lowerer, code[1]);
+      emitByte(lowerer, code[2]);
+      pushResult(lowerer, destAt);
+      break;
+    }
+    case OP_GET_LOCAL:
+      if (code[1] < lowerer->depth) local(lowerer, code[1]);
+      push(lowerer, ENTRY_LOCAL, code[1]);
+      break;
+    case OP_SET_LOCAL: storeLocal(lowerer, code[1]);
+      break;
+    case OP_STORE_LOCAL:
+      storeLocal(lowerer, code[1]);
+      pop(lowerer, 1);
+      break;
+    case OP_GET_UPVALUE: {
+      int dest = lowerer->depth;
+      protect(lowerer, dest);
+      emitOp(lowerer, ROP_GET_UPVALUE, dest);
+      int destAt = lowerer->count - 1;
+      emitByte(lowerer, code[1]);
+      pushResult(lowerer, destAt);
+      break;
+    }
+    case OP_SET_UPVALUE:
+      emitOp(lowerer, ROP_SET_UPVALUE, operand(lowerer, top));
+      emitByte(lowerer, code[1]);
+      break;
+    case OP_CLOSE_UPVALUE:
+      materialize(lowerer, top);
+      emitOp(lowerer, ROP_CLOSE_UPVALUE, top);
+      pop(lowerer, 1);
+      break;
+    case OP_JUMP_IF: {
+      int a = operand(lowerer, top);
+      pop(lowerer, 1);
+      flush(lowerer);
+      emitOp(lowerer, ROP_JUMP_IF_FALSE, a);
+      emitJump(lowerer, offset + 3 + readShort(chunk, offset + 1));
+      break;
+    }
+    case OP_JUMP:
+      flush(lowerer);
+      emitByte(lowerer, ROP_JUMP);
+      emitJump(lowerer, offset + 3 + readShort(chunk, offset + 1));
+      break;
+    case OP_LOOP: {
+      flush(lowerer);
+      int target = newOffset[offset + 3 - readShort(chunk, offset + 1)];
+      emitByte(lowerer, ROP_LOOP);
+      emitShort(lowerer, (uint16_t)(lowerer->count + 2 - target));
+      break;
+    }
+    case OP_LESS_LOCAL_CONST_JUMP:
+    case OP_LESS_LOCALS_JUMP: {
+      int a = local(lowerer, code[1]);
+      int b = code[0] == OP_LESS_LOCALS_JUMP ? local(lowerer, code[2])
+                                             : code[2];
+      flush(lowerer);
+      emitOp(lowerer, code[0] == OP_LESS_LOCALS_JUMP ? ROP_LESS_JUMP
+                                                     : ROP_LESSK_JUMP, a);
+      emitByte(lowerer, (uint8_t)b);
+      emitJump(lowerer, offset + 5 + readShort(chunk, offset + 3));
+      break;
+    }
+    case OP_ADD_LOCALS: {
+      int a = local(lowerer, code[1]);
+      int b = local(lowerer, code[2]);
+      int dest = lowerer->depth;
+      protect(lowerer, dest);
+      emitOp(lowerer, ROP_ADD, dest);
+      int destAt = lowerer->count - 1;
+      emitByte(lowerer, (uint8_t)a);
+      emitByte(lowerer, (uint8_t)b);
+      pushResult(lowerer, destAt);
+      break;
+    }
+    case OP_ADD_CONST: {
+      int a = operand(lowerer, top);
+      pop(lowerer, 1);
+      protect(lowerer, top);
+      emitOp(lowerer, ROP_ADDK, top);
+      int destAt = lowerer->count - 1;
+      emitByte(lowerer, (uint8_t)a);
+      emitByte(lowerer, code[1]);
+      pushResult(lowerer, destAt);
+      break;
+    }
+    case OP_INC_LOCAL:
+      local(lowerer, code[1]);
+      protect(lowerer, code[1]);
+      emitOp(lowerer, ROP_INC, code[1]);
+      break;
+    case OP_CALL:
+    case OP_TAIL_CALL: {
+      flush(lowerer);
+      int base = lowerer->depth - code[1] - 1;
+      if (base < 0) {
+        lowerer->failed = true;
+        break;
+      }
+      emitOp(lowerer, code[0] == OP_CALL ? ROP_CALL : ROP_TAIL_CALL, base);
+      emitByte(lowerer, code[1]);
+      pop(lowerer, code[1] + 1);
+      if (code[0] == OP_CALL) push(lowerer, ENTRY_REG, 0);
+      break;
+    }
+    case OP_CLOSURE: {
+      flush(lowerer);
+      int length = instructionLength(chunk, offset);
+      emitOp(lowerer, ROP_CLOSURE, lowerer->depth);
+      for (int i = 1; i < length; i++) emitByte(lowerer, code[i]);
+      push(lowerer, ENTRY_REG, 0);
+      break;
+    }
+    case OP_LIST:
+    case OP_MAP: {
+      // The items, or keys and values, are read from consecutive registers.
+      int count = code[0] == OP_LIST ? code[1] : 2 * code[1];
+      int base = lowerer->depth - count;
+      if (base < 0) {
+        lowerer->failed = true;
+        break;
+      }
+      for (int i = base; i < lowerer->depth; i++) materialize(lowerer, i);
+      pop(lowerer, count);
+      protect(lowerer, base);
+      emitOp(lowerer, code[0] == OP_LIST ? ROP_LIST : ROP_MAP, base);
+      int destAt = lowerer->count - 1;
+      emitByte(lowerer, (uint8_t)base);
+      emitByte(lowerer, code[1]);
+      pushResult(lowerer, destAt);
+      break;
+    }
+    case OP_GET_INDEX: binary(lowerer, ROP_GET_INDEX);
+      break;
+    case OP_SET_INDEX: {
+      // The assigned value is the result, left where it can be found.
+      if (top < 2) {
+        lowerer->failed = true;
+        break;
+      }
+      StackEntry value = lowerer->stack[top];
+      int c = operand(lowerer, top);
+      int b = operand(lowerer, top - 1);
+      int a = operand(lowerer, top - 2);
+      emitOp(lowerer, ROP_SET_INDEX, a);
+      emitByte(lowerer, (uint8_t)b);
+      emitByte(lowerer, (uint8_t)c);
+      pop(lowerer, 3);
+      if (value.kind == ENTRY_REG) {
+        protect(lowerer, top - 2);
+        emitOp(lowerer, ROP_MOVE, top - 2);
+        emitByte(lowerer, (uint8_t)top);
+        push(lowerer, ENTRY_REG, 0);
+      } else {
+        push(lowerer, value.kind, value.operand);
+      }
+      break;
+    }
+    case OP_DELETE_INDEX: {
+      if (top < 1) {
+        lowerer->failed = true;
+        break;
+      }
+      int b = operand(lowerer, top);
+      emitOp(lowerer, ROP_DELETE_INDEX, operand(lowerer, top - 1));
+      emitByte(lowerer, (uint8_t)b);
+      pop(lowerer, 2);
+      break;
+    }
+    case OP_RETURN:
+      emitOp(lowerer, ROP_RETURN, operand(lowerer, top));
+      pop(lowerer, 1);
+      break;
+    default:
+      lowerer->failed = true;
+      break;
+  }
+}
+
+bool lowerFn(VM *vm, ObjFn *fn) {
+  Chunk *chunk = &fn->chunk;
+  Lowerer lowerer;
+  lowerer.fn = fn;
+  lowerer.chunk = chunk;
+  lowerer.code = NULL;
+  lowerer.count = 0;
+  lowerer.capacity = 0;
+  // Slot 0 holds the callee, then come the parameters.
+  lowerer.depth = 0;
+  lowerer.maxDepth = 0;
+  lowerer.lastDest = -1;
+  lowerer.fixupCount = 0;
+  lowerer.failed = false;
+  for (int i = 0; i <= fn->arity; i++) push(&lowerer, ENTRY_REG, 0);
+
+  bool *isTarget = calloc(chunk->count + 1, sizeof(bool));
+  int *newOffset = malloc(sizeof(int) * (chunk->count + 1));
+  int jumps = 0;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    uint8_t op = chunk->code[offset];
+    if (op == OP_JUMP || op == OP_JUMP_IF || op == OP_LOOP) {
+      uint16_t jump = readShort(chunk, offset + 1);
+      isTarget[op == OP_LOOP ? offset + 3 - jump : offset + 3 + jump] = true;
+      jumps++;
+    } else if (op == OP_LESS_LOCAL_CONST_JUMP || op == OP_LESS_LOCALS_JUMP) {
+      isTarget[offset + 5 + readShort(chunk, offset + 3)] = true;
+      jumps++;
+    }
+  }
+  lowerer.fixups = malloc(sizeof(Fixup) * (jumps + 1));
+
+  for (int offset = 0; offset < chunk->count && !lowerer.failed;
+       offset += instructionLength(chunk, offset)) {
+    // Every path into a label leaves all values in their own slots.
+    if (isTarget[offset]) flush(&lowerer);
+    newOffset[offset] = lowerer.count;
+    lowerInstruction(&lowerer, offset, newOffset);
+  }
+  newOffset[chunk->count] = lowerer.count;
+
+  for (int i = 0; i < lowerer.fixupCount && !lowerer.failed; i++) {
+    Fixup *fixup = &lowerer.fixups[i];
+    int jump = newOffset[fixup->target] - fixup->end;
+    lowerer.code[fixup->at] = (jump >> 8) & 0xff;
+    lowerer.code[fixup->at + 1] = jump & 0xff;
+  }
+
+  if (!lowerer.failed) {
+    fn->regCode = ALLOCATE_ARRAY(vm, uint8_t, lowerer.count);
+    memcpy(fn->regCode, lowerer.code, lowerer.count);
+    fn->regCount = lowerer.count;
+    fn->regSlots = lowerer.maxDepth;
+  }
+  free(lowerer.code);
+  free(lowerer.fixups);
+  free(isTarget);
+  free(newOffset);
+  return !lowerer.failed;
+}
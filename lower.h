@@ -0,0 +1,54 @@
+#ifndef CLOX_LOWER_H
+#define CLOX_LOWER_H
+
+#include "common.h"
+#include "clox.h"
+#include "object.h"
+
+// Register instruction set. Registers are frame slots: the slot a value
+// occupies in the stack backend is the register it lives in here, so
+// locals, arguments and call windows keep their layout.
+//
+//   MOVE A B             R[A] = R[B]
+//   LOADK A K            R[A] = K[K]            (LOADK_LONG: 24-bit K)
+//   LOADNIL/TRUE/FALSE A R[A] = nil/true/false
+//   ADD A B C            R[A] = R[B] + R[C]     (SUBTRACT .. EQ alike)
+//   ADDK A B K           R[A] = R[B] + K[K]
+//   INC A                R[A] = R[A] + 1
+//   NEGATE A B           R[A] = -R[B]
+//   PRINT A
+//   DEFINE_GLOBAL A S    globals[S] = R[A]      (S is 16-bit)
+//   GET_GLOBAL A S       R[A] = globals[S]
+//   SET_GLOBAL A S       globals[S] = R[A]
+//   GET_UPVALUE A U      R[A] = upvalues[U]
+//   SET_UPVALUE A U      upvalues[U] = R[A]
+//   CLOSE_UPVALUE A      close upvalues at or above R[A]
+//   JUMP off             forward, 16-bit
+//   JUMP_IF_FALSE A off  forward if R[A] is falsey
+//   LESS_JUMP A B off    forward unless R[A] < R[B]
+//   LESSK_JUMP A K off   forward unless R[A] < K[K]
+//   LOOP off             backward, 16-bit
+//   CALL A N             R[A] = R[A](R[A+1] .. R[A+N])
+//   TAIL_CALL A N
+//   CLOSURE A K          R[A] = closure of K[K], followed by the same
+//                        isLocal/index pairs as the stack instruction
+//   RETURN A
+//   LIST A B N           R[A] = [R[B] .. R[B+N-1]]
+//   GET_INDEX A B C      R[A] = R[B][R[C]]
+//   SET_INDEX A B C      R[A][R[B]] = R[C]
+//   MAP A B N            R[A] = {R[B]: R[B+1], ..} with N entries
+//   DELETE_INDEX A B     delete R[A][R[B]]
+
+typedef enum {
+#define REGOP(name, _) ROP_##name,
+#include "regopcode.h"
+#undef REGOP
+} RegOpCode;
+
+int regInstructionLength(ObjFn *fn, int offset);
+
+// Translates the stack bytecode of fn into register code stored on fn.
+// Fails if the function needs more registers than an operand can address.
+bool lowerFn(VM *vm, ObjFn *fn);
+
+#endif
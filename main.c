@@ -1,8 +1,23 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "vm.h"
+#include "pool.h"
+
+// A byte count with an optional k, m or g suffix.
+static size_t parseSize(const char *text) {
+  char *end;
+  double size = strtod(text, &end);
+  switch (*end) {
+	case 'k': case 'K': size *= 1024; break;
+	case 'm': case 'M': size *= 1024 * 1024; break;
+	case 'g': case 'G': size *= 1024 * 1024 * 1024; break;
+  }
+  return (size_t)size;
+}
 
 static void repl(VM *vm) {
   char line[1024];
@@ -12,7 +27,9 @@ static void repl(VM *vm) {
 	  printf("\n");
 	  break;
 	}
-	interpret(vm, line);
+	if (interpret(vm, line) != INTERPRET_OK && vm->error[0] != '\0') {
+	  fprintf(stderr, "%s\n", vm->error);
+	}
   }
 }
 
@@ -41,18 +58,223 @@ static char* readFile(const char* path) {
   return buffer;
 }
 
+// Runs path from its bytecode image "<path>c" when one exists for the
+// current source, otherwise compiles it and writes the image first.
 static void runFile(VM *vm, const char* path) {
   char* source = readFile(path);
-  InterpretResult result = interpret(vm, source);
+  // Images are specific to the optimization level they were compiled at.
+  uint64_t hash = hashSource(source) + (uint64_t)vm->optLevel;
+  size_t pathLength = strlen(path);
+  char* imagePath = (char*)malloc(pathLength + 2);
+  memcpy(imagePath, path, pathLength);
+  imagePath[pathLength] = 'c';
+  imagePath[pathLength + 1] = '\0';
+
+  InterpretResult result = INTERPRET_COMPILE_ERROR;
+  Image image;
+  if (openImage(&image, imagePath, hash)) {
+	result = interpretImage(vm, &image);
+	closeImage(&image);
+  }
+  // A missing, stale or corrupt image is rebuilt from source.
+  if (result == INTERPRET_COMPILE_ERROR) {
+	if (cacheSource(vm, source, imagePath, hash) &&
+		openImage(&image, imagePath, hash)) {
+	  result = interpretImage(vm, &image);
+	  closeImage(&image);
+	}
+	if (result == INTERPRET_COMPILE_ERROR) result = interpret(vm, source);
+  }
+  free(imagePath);
   free(source);
+  if (result != INTERPRET_OK && vm->error[0] != '\0') {
+	fprintf(stderr, "%s\n", vm->error);
+  }
   if (result == INTERPRET_COMPILE_ERROR) exit(65);
   if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
-int main() {
+// Prints how much memory this process has resident and how much of it it
+// dirtied itself, which is what a forked worker costs on top of the heap
+// it shares with the server.
+static void reportMemory(int worker) {
+#ifdef __linux__
+  FILE *file = fopen("/proc/self/smaps_rollup", "r");
+  if (file == NULL) return;
+  char line[256];
+  long rss = 0;
+  long dirty = 0;
+  while (fgets(line, sizeof(line), file)) {
+	sscanf(line, "Rss: %ld kB", &rss);
+	sscanf(line, "Private_Dirty: %ld kB", &dirty);
+  }
+  fclose(file);
+  fprintf(stderr, "worker %d: rss %ld kB, private dirty %ld kB\n", worker,
+		  rss, dirty);
+#endif
+}
+
+// Runs path in count workers forked from vm, one after the other.
+static void forkWorkers(VM *vm, const char *path, int count) {
+  fflush(stdout);
+  bool failed = false;
+  for (int i = 0; i < count; i++) {
+	pid_t pid = fork();
+	if (pid < 0) {
+	  perror("fork");
+	  exit(71);
+	}
+	if (pid == 0) {
+	  // The marker threads stayed behind in the server.
+	  vm->marker = NULL;
+	  runFile(vm, path);
+	  fflush(stdout);
+	  reportMemory(i);
+	  _exit(0);
+	}
+	int status;
+	waitpid(pid, &status, 0);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) failed = true;
+  }
+  if (failed) exit(70);
+}
+
+// Gives every pool VM the backend and GC settings of the command line.
+static void setupPoolVM(VM *vm, void *userData) {
+  VM *settings = (VM *)userData;
+  vm->backend = settings->backend;
+  vm->jitEnabled = settings->jitEnabled;
+  vm->optLevel = settings->optLevel;
+  vm->maxFrames = settings->maxFrames;
+  vm->gcBudget = settings->gcBudget;
+  configureGc(vm, &settings->gcConfig);
+}
+
+// Throughput benchmark: calls job(i) of path for i below jobs on a pool
+// of workers threads, then reports the sum of the results and the rate.
+static void runPool(VM *vm, const char *path, int workers, int jobs) {
+  char *source = readFile(path);
+  PoolConfig config;
+  initPoolConfig(&config);
+  config.workers = workers;
+  config.setupVM = setupPoolVM;
+  config.userData = vm;
+  Pool *pool = newPool(&config);
+  PoolScript *script = poolPrepare(pool, source);
+  free(source);
+
+  Job **futures = malloc(sizeof(Job *) * jobs);
+  double start = gcNow();
+  for (int i = 0; i < jobs; i++) {
+	PoolValue arg = poolNumber(i);
+	JobSpec spec = {.script = script, .function = "job", .argCount = 1,
+					.args = &arg};
+	futures[i] = submitJob(pool, &spec, true);
+  }
+  double sum = 0;
+  int failed = 0;
+  for (int i = 0; i < jobs; i++) {
+	if (awaitJob(futures[i]) != JOB_OK) {
+	  if (failed++ == 0) fprintf(stderr, "%s\n", jobError(futures[i]));
+	} else if (jobResult(futures[i])->type == POOL_NUMBER) {
+	  sum += jobResult(futures[i])->as.number;
+	}
+	releaseJob(futures[i]);
+  }
+  double seconds = gcNow() - start;
+  fprintf(stderr, "pool: %d workers, %d jobs in %.3f s, %.0f jobs/s, "
+		  "sum %.17g\n", poolWorkers(pool), jobs, seconds, jobs / seconds,
+		  sum);
+  free(futures);
+  freePool(pool, false);
+  if (failed > 0) {
+	fprintf(stderr, "%d jobs failed\n", failed);
+	exit(70);
+  }
+}
+
+int main(int argc, const char* argv[]) {
   VM vm;
   initVM(&vm);
-  repl(&vm);
+  bool gcStats = false;
+  const char *prewarm = NULL;
+  int workers = 0;
+  int poolThreads = -1;
+  int jobs = 1000;
+  bool freeze = true;
+  GcConfig gcConfig;
+  initGcConfig(&gcConfig);
+  int arg = 1;
+  for (; arg < argc && argv[arg][0] == '-'; arg++) {
+	if (strcmp(argv[arg], "--register") == 0) {
+	  vm.backend = BACKEND_REGISTER;
+	} else if (strcmp(argv[arg], "--no-jit") == 0) {
+	  vm.jitEnabled = false;
+	} else if (strcmp(argv[arg], "--gc-stats") == 0) {
+	  gcStats = true;
+	} else if (strcmp(argv[arg], "--gc-telemetry") == 0) {
+	  enableGcTelemetry(&vm);
+	} else if (strcmp(argv[arg], "--gc-budget") == 0 && arg + 1 < argc) {
+	  vm.gcBudget = atoi(argv[++arg]);
+	} else if (strcmp(argv[arg], "--gc-inline-sweep") == 0) {
+	  vm.sweepInBackground = false;
+	} else if (strcmp(argv[arg], "--heap-limit") == 0 && arg + 1 < argc) {
+	  gcConfig.heapLimit = parseSize(argv[++arg]);
+	} else if (strcmp(argv[arg], "--gc-initial-heap") == 0 && arg + 1 < argc) {
+	  gcConfig.initialHeap = parseSize(argv[++arg]);
+	} else if (strcmp(argv[arg], "--gc-fraction") == 0 && arg + 1 < argc) {
+	  gcConfig.gcFraction = atof(argv[++arg]);
+	} else if (strcmp(argv[arg], "--gc-threads") == 0 && arg + 1 < argc) {
+	  vm.markThreads = atoi(argv[++arg]);
+	} else if (strcmp(argv[arg], "--prewarm") == 0 && arg + 1 < argc) {
+	  prewarm = argv[++arg];
+	} else if (strcmp(argv[arg], "--fork") == 0 && arg + 1 < argc) {
+	  workers = atoi(argv[++arg]);
+	} else if (strcmp(argv[arg], "--pool") == 0 && arg + 1 < argc) {
+	  poolThreads = atoi(argv[++arg]);
+	} else if (strcmp(argv[arg], "--jobs") == 0 && arg + 1 < argc) {
+	  jobs = atoi(argv[++arg]);
+	} else if (strcmp(argv[arg], "--max-depth") == 0 && arg + 1 < argc) {
+	  vm.maxFrames = atoi(argv[++arg]);
+	} else if (strcmp(argv[arg], "--no-freeze") == 0) {
+	  freeze = false;
+	} else if (argv[arg][1] == 'O' && argv[arg][2] >= '0' &&
+			   argv[arg][2] <= '2' && argv[arg][3] == '\0') {
+	  vm.optLevel = argv[arg][2] - '0';
+	} else {
+	  break;
+	}
+  }
+  configureGc(&vm, &gcConfig);
+  // Fork server: the prewarm script defines globals for the workers, then
+  // the heap is frozen so the workers share it copy-on-write.
+  if (prewarm != NULL) runFile(&vm, prewarm);
+  if (workers > 0 && freeze) {
+	freezeHeap(&vm);
+  } else if (workers > 0) {
+	gc(&vm);
+  }
+
+  if (arg == argc && workers == 0) {
+	repl(&vm);
+  } else if (arg + 1 == argc && poolThreads >= 0) {
+	runPool(&vm, argv[arg], poolThreads, jobs);
+  } else if (arg + 1 == argc && workers > 0) {
+	forkWorkers(&vm, argv[arg], workers);
+  } else if (arg + 1 == argc) {
+	runFile(&vm, argv[arg]);
+  } else {
+	fprintf(stderr, "Usage: clox [--register] [--no-jit] [--gc-stats] "
+					"[--gc-telemetry] [--gc-budget n] [--gc-threads n]\n"
+					"            [--gc-inline-sweep] [--gc-fraction f] "
+					"[--gc-initial-heap size] [--heap-limit size]\n"
+					"            [-O0|-O1|-O2] [--prewarm path] "
+					"[--fork n [--no-freeze]] [--max-depth n]\n"
+					"            [--pool n [--jobs n]] [path]\n");
+	exit(64);
+  }
+  if (gcStats) printGcStats(&vm);
+  printGcTelemetry(&vm);
   freeVM(&vm);
   return 0;
 }
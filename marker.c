@@ -0,0 +1,299 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "marker.h"
+#include "vm.h"
+#include "memory.h"
+
+typedef struct {
+  pthread_mutex_t lock;
+  Obj **items;     // gray objects in [bottom, top), the owner pops from the
+  int bottom;      // top and thieves take from the bottom
+  int top;
+  int capacity;
+} GrayDeque;
+
+struct Marker {
+  VM *vm;
+  int threadCount;
+  GrayDeque *deques;
+  pthread_t *threads;
+
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t finished;
+  int round;       // bumped to start a round
+  int running;     // threads that haven't finished the round
+  bool quit;
+
+  int budget;      // per thread, -1 for no limit
+  int idle;        // threads out of work or budget, updated atomically
+};
+
+static void pushGray(GrayDeque *deque, Obj *obj) {
+  pthread_mutex_lock(&deque->lock);
+  if (deque->top == deque->capacity) {
+	if (deque->bottom > 0) {
+	  int count = deque->top - deque->bottom;
+	  memmove(deque->items, deque->items + deque->bottom,
+			  sizeof(Obj *) * count);
+	  deque->bottom = 0;
+	  deque->top = count;
+	} else {
+	  deque->capacity = GROW_CAPACITY(deque->capacity);
+	  deque->items = realloc(deque->items, sizeof(Obj *) * deque->capacity);
+	  if (deque->items == NULL) {
+		fprintf(stderr, "Out of memory while marking.\n");
+		exit(1);
+	  }
+	}
+  }
+  deque->items[deque->top++] = obj;
+  pthread_mutex_unlock(&deque->lock);
+}
+
+static Obj *popGray(GrayDeque *deque) {
+  Obj *obj = NULL;
+  pthread_mutex_lock(&deque->lock);
+  if (deque->top > deque->bottom) {
+	obj = deque->items[--deque->top];
+	// Warm the cache for the object blackened after this one.
+	if (deque->top > deque->bottom) {
+	  __builtin_prefetch(deque->items[deque->top - 1]);
+	}
+  }
+  if (deque->top == deque->bottom) deque->top = deque->bottom = 0;
+  pthread_mutex_unlock(&deque->lock);
+  return obj;
+}
+
+static bool hasGray(GrayDeque *deque) {
+  pthread_mutex_lock(&deque->lock);
+  bool any = deque->top > deque->bottom;
+  pthread_mutex_unlock(&deque->lock);
+  return any;
+}
+
+// Moves half of some other thread's gray objects to thread id.
+static bool steal(Marker *marker, int id) {
+  for (int i = 1; i < marker->threadCount; i++) {
+	GrayDeque *victim = &marker->deques[(id + i) % marker->threadCount];
+	if (!hasGray(victim)) continue;
+	Obj *loot[64];
+	pthread_mutex_lock(&victim->lock);
+	int count = (victim->top - victim->bottom + 1) / 2;
+	if (count > 64) count = 64;
+	for (int j = 0; j < count; j++) {
+	  loot[j] = victim->items[victim->bottom++];
+	}
+	pthread_mutex_unlock(&victim->lock);
+	if (count == 0) continue;
+	for (int j = 0; j < count; j++) pushGray(&marker->deques[id], loot[j]);
+	return true;
+  }
+  return false;
+}
+
+// The parallel markObject: only the thread that flips the mark bit pushes
+// the object.
+static void claim(GrayDeque *deque, Obj *obj) {
+  if (obj == NULL || obj->isFrozen) return;
+  if (claimObject(obj)) return;
+  pushGray(deque, obj);
+}
+
+static void claimValue(GrayDeque *deque, Value value) {
+  if (IS_OBJ(value)) claim(deque, AS_OBJ(value));
+}
+
+// Same as blackenObject in memory.c.
+static void blacken(GrayDeque *deque, Obj *obj) {
+  switch (obj->type) {
+	case OBJ_CLOSURE: {
+	  ObjClosure *closure = (ObjClosure *)obj;
+	  claim(deque, (Obj *)closure->fn);
+	  for (int i = 0; i < closure->upvalueCount; i++) {
+		claim(deque, (Obj *)closure->upvalues[i]);
+	  }
+	  break;
+	}
+	case OBJ_FN: {
+	  ObjFn *fn = (ObjFn *)obj;
+	  claim(deque, (Obj *)fn->name);
+	  for (int i = 0; i < fn->chunk.constants.count; i++) {
+		claimValue(deque, fn->chunk.constants.values[i]);
+	  }
+	  break;
+	}
+	case OBJ_UPVALUE:
+	  claimValue(deque, ((ObjUpvalue *)obj)->closed);
+	  break;
+	case OBJ_ROPE: {
+	  ObjRope *rope = (ObjRope *)obj;
+	  claimValue(deque, rope->left);
+	  claimValue(deque, rope->right);
+	  claim(deque, (Obj *)rope->flat);
+	  break;
+	}
+	case OBJ_LIST: {
+	  ValueArray *items = &((ObjList *)obj)->items;
+	  for (int i = 0; i < items->count; i++) {
+		claimValue(deque, items->values[i]);
+	  }
+	  break;
+	}
+	case OBJ_MAP: {
+	  ObjMap *map = (ObjMap *)obj;
+	  for (int i = 0; i < map->keys.count; i++) {
+		claimValue(deque, map->keys.values[i]);
+		claimValue(deque, map->values.values[i]);
+	  }
+	  break;
+	}
+	case OBJ_NATIVE:
+	case OBJ_STRING:
+	case OBJ_BUILDER:
+	  break;
+  }
+}
+
+static void markRound(Marker *marker, int id) {
+  GrayDeque *deque = &marker->deques[id];
+  int budget = marker->budget;
+  for (;;) {
+	Obj *obj = budget != 0 ? popGray(deque) : NULL;
+	if (obj == NULL && budget != 0 && steal(marker, id)) continue;
+	if (obj != NULL) {
+	  blacken(deque, obj);
+	  if (budget > 0) budget--;
+	  continue;
+	}
+
+	// Out of work or budget. The round ends once every thread is.
+	__atomic_add_fetch(&marker->idle, 1, __ATOMIC_ACQ_REL);
+	for (;;) {
+	  if (__atomic_load_n(&marker->idle, __ATOMIC_ACQUIRE) ==
+		  marker->threadCount) {
+		return;
+	  }
+	  bool work = false;
+	  for (int i = 0; budget != 0 && i < marker->threadCount; i++) {
+		if (hasGray(&marker->deques[i])) work = true;
+	  }
+	  if (work) {
+		__atomic_sub_fetch(&marker->idle, 1, __ATOMIC_ACQ_REL);
+		break;
+	  }
+	  sched_yield();
+	}
+  }
+}
+
+typedef struct {
+  Marker *marker;
+  int id;
+} WorkerArgs;
+
+static void *markerThread(void *arg) {
+  WorkerArgs args = *(WorkerArgs *)arg;
+  free(arg);
+  Marker *marker = args.marker;
+  int round = 0;
+  for (;;) {
+	pthread_mutex_lock(&marker->lock);
+	while (marker->round == round && !marker->quit) {
+	  pthread_cond_wait(&marker->start, &marker->lock);
+	}
+	pthread_mutex_unlock(&marker->lock);
+	if (marker->quit) return NULL;
+	round++;
+
+	markRound(marker, args.id);
+
+	pthread_mutex_lock(&marker->lock);
+	if (--marker->running == 0) pthread_cond_signal(&marker->finished);
+	pthread_mutex_unlock(&marker->lock);
+  }
+}
+
+Marker *newMarker(VM *vm, int threadCount) {
+  Marker *marker = malloc(sizeof(Marker));
+  marker->vm = vm;
+  marker->threadCount = threadCount;
+  marker->deques = calloc(threadCount, sizeof(GrayDeque));
+  marker->threads = malloc(sizeof(pthread_t) * threadCount);
+  for (int i = 0; i < threadCount; i++) {
+	pthread_mutex_init(&marker->deques[i].lock, NULL);
+  }
+  pthread_mutex_init(&marker->lock, NULL);
+  pthread_cond_init(&marker->start, NULL);
+  pthread_cond_init(&marker->finished, NULL);
+  marker->round = 0;
+  marker->running = 0;
+  marker->quit = false;
+  for (int i = 1; i < threadCount; i++) {
+	WorkerArgs *args = malloc(sizeof(WorkerArgs));
+	args->marker = marker;
+	args->id = i;
+	pthread_create(&marker->threads[i], NULL, markerThread, args);
+  }
+  return marker;
+}
+
+void freeMarker(Marker *marker) {
+  if (marker == NULL) return;
+  pthread_mutex_lock(&marker->lock);
+  marker->quit = true;
+  pthread_cond_broadcast(&marker->start);
+  pthread_mutex_unlock(&marker->lock);
+  for (int i = 1; i < marker->threadCount; i++) {
+	pthread_join(marker->threads[i], NULL);
+  }
+  for (int i = 0; i < marker->threadCount; i++) {
+	pthread_mutex_destroy(&marker->deques[i].lock);
+	free(marker->deques[i].items);
+  }
+  pthread_mutex_destroy(&marker->lock);
+  pthread_cond_destroy(&marker->start);
+  pthread_cond_destroy(&marker->finished);
+  free(marker->deques);
+  free(marker->threads);
+  free(marker);
+}
+
+bool traceParallel(Marker *marker, int budget) {
+  VM *vm = marker->vm;
+  int threads = marker->threadCount;
+  for (int i = 0; i < vm->grayCount; i++) {
+	pushGray(&marker->deques[i % threads], vm->grayStack[i]);
+  }
+  vm->grayCount = 0;
+  marker->budget = budget < 0 ? -1 : (budget + threads - 1) / threads;
+  marker->idle = 0;
+
+  pthread_mutex_lock(&marker->lock);
+  marker->running = threads - 1;
+  marker->round++;
+  pthread_cond_broadcast(&marker->start);
+  pthread_mutex_unlock(&marker->lock);
+
+  markRound(marker, 0);
+
+  pthread_mutex_lock(&marker->lock);
+  while (marker->running > 0) {
+	pthread_cond_wait(&marker->finished, &marker->lock);
+  }
+  pthread_mutex_unlock(&marker->lock);
+
+  // Objects left gray by a spent budget wait for the next slice.
+  for (int i = 0; i < threads; i++) {
+	Obj *obj;
+	while ((obj = popGray(&marker->deques[i])) != NULL) {
+	  grayObject(vm, obj);
+	}
+  }
+  return vm->grayCount == 0;
+}
@@ -0,0 +1,22 @@
+#ifndef CLOX_MARKER_H
+#define CLOX_MARKER_H
+
+#include "common.h"
+#include "clox.h"
+#include "object.h"
+
+// Parallel tracing for the major collector. Each marker thread owns a gray
+// stack, claims objects by atomically setting their mark bit and steals
+// half of another thread's stack when its own runs dry. The calling thread
+// is marker 0, the others are kept parked between slices.
+typedef struct Marker Marker;
+
+Marker *newMarker(VM *vm, int threadCount);
+void freeMarker(Marker *marker);
+
+// Parallel version of draining vm->grayStack: blackens up to budget
+// objects (-1 for no limit) and returns true once no gray object is left.
+// Whatever is still gray goes back on vm->grayStack.
+bool traceParallel(Marker *marker, int budget);
+
+#endif
@@ -1,22 +1,34 @@
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
 
 #include "memory.h"
 #include "value.h"
 #include "vm.h"
+#include "jit.h"
+#include "marker.h"
+#include "sweeper.h"
 
-#ifdef DEBUG_LOG_GC
-#include <stdio.h>
+#if DEBUG_LOG_GC
 #include "debug.h"
 #endif
 
-#define GC_HEAP_GROW_FACTOR 2
+// Wall-clock seconds. Pauses are measured on the wall clock since CPU time
+// would also count the marker and sweeper threads.
+double gcNow(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
 void *reallocate(VM *vm, void *array, size_t old, size_t new) {
   vm->bytesAllocated += new - old;
+  if (new > old) vm->gcStats.oldBytes += new - old;
 #if DEBUG_STRESS_GC
-  if (new > 0) { gc(vm); }
+  if (new > 0) vm->gcRequested = true;
 #else
-  if (new > 0 && vm->bytesAllocated > vm->nextGC) gc(vm);
+  if (new > 0 && vm->bytesAllocated > vm->nextGC) vm->gcRequested = true;
 #endif
   if (new == 0) {
 	free(array);
@@ -28,53 +40,173 @@ void *reallocate(VM *vm, void *array, size_t old, size_t new) {
   return realloc(array, new);
 }
 
-static void freeObject(VM *vm, Obj *obj) {
-  #ifdef DEBUG_LOG_GC
-  printf("%p free type %d\n", (void*)obj, obj->type);
-  #endif
+size_t objectSize(Obj *obj) {
   switch (obj->type) {
+	case OBJ_STRING:
+	  return sizeof(ObjString) + ((ObjString *)obj)->length + 1;
+	case OBJ_NATIVE: return sizeof(ObjNative);
+	case OBJ_FN: return sizeof(ObjFn);
 	case OBJ_CLOSURE:
-	case OBJ_NATIVE:
-	case OBJ_UPVALUE:
-	case OBJ_STRING: {
-	  DEALLOCATE(vm, obj);
-	  break;
-	}
-	case OBJ_FN: {
-	  freeChunk(vm, &((ObjFn *)obj)->chunk);
-	  DEALLOCATE(vm, obj);
-	  break;
+	  return sizeof(ObjClosure) +
+		  sizeof(ObjUpvalue *) * ((ObjClosure *)obj)->upvalueCount;
+	case OBJ_UPVALUE: return sizeof(ObjUpvalue);
+	case OBJ_ROPE: return sizeof(ObjRope);
+	case OBJ_BUILDER: return sizeof(ObjBuilder);
+	case OBJ_LIST: return sizeof(ObjList);
+	case OBJ_MAP: return sizeof(ObjMap);
+  }
+  return 0;
+}
+
+// Old objects come from the slab heap but count towards bytesAllocated
+// like everything allocated through reallocate.
+static Obj *allocateOld(VM *vm, size_t size) {
+  vm->bytesAllocated += size;
+  vm->gcStats.oldBytes += size;
+#if DEBUG_STRESS_GC
+  vm->gcRequested = true;
+#else
+  if (vm->bytesAllocated > vm->nextGC) vm->gcRequested = true;
+#endif
+  Obj *obj = slabAllocate(&vm->slabs, size);
+  obj->inSlab = size <= SLAB_MAX_BLOCK;
+  obj->next = vm->first;
+  vm->first = obj;
+  return obj;
+}
+
+void rememberFrozen(VM *vm, Obj *obj) {
+  if (vm->frozenRootCapacity < vm->frozenRootCount + 1) {
+	vm->frozenRootCapacity = GROW_CAPACITY(vm->frozenRootCapacity);
+	vm->frozenRoots = realloc(vm->frozenRoots,
+							  sizeof(Obj *) * vm->frozenRootCapacity);
+  }
+  obj->isMarked = true;
+  vm->frozenRoots[vm->frozenRootCount++] = obj;
+}
+
+void rememberObject(VM *vm, Obj *obj) {
+  if (vm->rememberedCapacity < vm->rememberedCount + 1) {
+	vm->rememberedCapacity = GROW_CAPACITY(vm->rememberedCapacity);
+	vm->remembered = realloc(vm->remembered,
+							 sizeof(Obj *) * vm->rememberedCapacity);
+  }
+  obj->isRemembered = true;
+  vm->remembered[vm->rememberedCount++] = obj;
+}
+
+Obj *allocateObject(VM *vm, size_t size, ObjType type) {
+  Nursery *nursery = &vm->nursery;
+  size_t aligned = (size + 7) & ~(size_t)7;
+  Obj *obj;
+  if (!ownsMemory(type) && nursery->top + aligned <= nursery->end) {
+	obj = (Obj *)nursery->top;
+	nursery->top += aligned;
+	obj->isRemembered = false;
+	obj->inSlab = false;
+	vm->gcStats.youngBytes += aligned;
+#if DEBUG_STRESS_GC
+	vm->gcRequested = true;
+#endif
+  } else {
+	// Stores initializing an old object aren't barriered, so it is
+	// remembered until the next minor collection.
+	if (!ownsMemory(type)) {
+	  vm->gcRequested = true;
+	  vm->gcStats.overflowBytes += size;
 	}
+	obj = allocateOld(vm, size);
+	rememberObject(vm, obj);
+  }
+  obj->type = type;
+  obj->isMarked = false;
+  obj->isFrozen = false;
+  if (vm->telemetry != NULL) {
+	vm->telemetry->allocatedBytes[type] += size;
+	if (isYoung(nursery, obj)) vm->telemetry->nurseryBytes[type] += size;
+  }
+  #if DEBUG_LOG_GC
+  printf("%p allocate %ld for %d\n", (void*)obj, size, type);
+  #endif
+  return obj;
+}
+
+static void freeObject(VM *vm, Obj *obj) {
+  #if DEBUG_LOG_GC
+  printf("%p free type %d\n", (void*)obj, obj->type);
+  #endif
+  if (obj->type == OBJ_FN) {
+	freeChunk(vm, &((ObjFn *)obj)->chunk);
+	DEALLOCATE(vm, ((ObjFn *)obj)->regCode);
+	jitFree((ObjFn *)obj);
+  } else if (obj->type == OBJ_BUILDER) {
+	ObjBuilder *builder = (ObjBuilder *)obj;
+	reallocate(vm, builder->chars, builder->capacity, 0);
+  } else if (obj->type == OBJ_LIST) {
+	freeValueArray(vm, &((ObjList *)obj)->items);
+  } else if (obj->type == OBJ_MAP) {
+	ObjMap *map = (ObjMap *)obj;
+	freeTable(vm, &map->index);
+	freeValueArray(vm, &map->keys);
+	freeValueArray(vm, &map->values);
   }
+  size_t size = objectSize(obj);
+  vm->bytesAllocated -= size;
+  if (vm->telemetry != NULL) vm->telemetry->freedBytes[obj->type] += size;
+  slabFree(&vm->slabs, obj, size);
 }
 
+static void finishBackgroundSweep(VM *vm);
+
 void freeObjects(VM *vm) {
+  if (vm->gcPhase == GC_SWEEP && vm->sweepInBackground) {
+	finishBackgroundSweep(vm);
+  }
   Obj *obj = vm->first;
   while (obj != NULL) {
 	Obj *next = obj->next;
 	freeObject(vm, obj);
 	obj = next;
   }
+  obj = vm->frozen;
+  while (obj != NULL) {
+	Obj *next = obj->next;
+	freeObject(vm, obj);
+	obj = next;
+  }
+  free(vm->frozenRoots);
+  free(vm->telemetry);
+  vm->telemetry = NULL;
   free(vm->grayStack);
+  free(vm->remembered);
+  free(vm->nursery.start);
+  freeSlabHeap(&vm->slabs);
+  freeMarker(vm->marker);
 }
 
 void markObject(VM *vm, Obj* object) {
   if (object == NULL) return;
-  if (object->isMarked) return;
-  #ifdef DEBUG_LOG_GC
+  if (isMarkedObject(object)) return;
+  #if DEBUG_LOG_GC
   printf("%p mark ", (void*)object);
   printValue(OBJ_VAL(object));
   printf("\n");
   #endif
-  object->isMarked = true;
+  setMarkedObject(object);
+  grayObject(vm, object);
+}
 
+void grayObject(VM *vm, Obj *object) {
   if (vm->grayCapacity < vm->grayCount + 1) {
     vm->grayCapacity = GROW_CAPACITY(vm->grayCapacity);
     vm->grayStack = realloc(vm->grayStack, sizeof(Obj*) * vm->grayCapacity);
+    if (vm->grayStack == NULL) {
+      fprintf(stderr, "Out of memory while marking.\n");
+      exit(1);
+    }
   }
 
   vm->grayStack[vm->grayCount++] = object;
-
 }
 
 void markValue(VM *vm, Value value) {
@@ -82,30 +214,37 @@ void markValue(VM *vm, Value value) {
   markObject(vm, AS_OBJ(value));
 }
 
+static void markArray(VM *vm, ValueArray* array) {
+  for (int i = 0; i < array->count; i++) {
+    markValue(vm, array->values[i]);
+  }
+}
+
+static void blackenObject(VM *vm, Obj* obj);
+
 static void markRoots(VM *vm) {
   for (Value* slot = vm->stack; slot < vm->sp; slot++) {
 	markValue(vm, *slot);
   }
   for (int i = 0; i < vm->frameCount; i++) {
-	markObject(vm, (Obj*)vm->frames[i].closure);
+	markObject(vm, (Obj*)frameAt(vm, i)->closure);
   }
   for (ObjUpvalue* upvalue = vm->openUpvalues;
 	   upvalue != NULL;
 	   upvalue = upvalue->next) {
 	markObject(vm, (Obj*)upvalue);
   }
-  markTable(vm, &vm->globals);
+  markTable(vm, &vm->globalNames);
+  markArray(vm, &vm->globalValues);
+  markArray(vm, &vm->handles);
   markCompilerRoots(vm, vm->compiler);
-}
-
-static void markArray(VM *vm, ValueArray* array) {
-  for (int i = 0; i < array->count; i++) {
-    markValue(vm, array->values[i]);
+  for (int i = 0; i < vm->frozenRootCount; i++) {
+	blackenObject(vm, vm->frozenRoots[i]);
   }
 }
 
 static void blackenObject(VM *vm, Obj* obj) {
-  #ifdef DEBUG_LOG_GC
+  #if DEBUG_LOG_GC
   printf("%p blacken ", (void*)obj);
   printValue(OBJ_VAL(obj));
   printf("\n");
@@ -123,35 +262,70 @@ static void blackenObject(VM *vm, Obj* obj) {
       ObjFn* fn = (ObjFn*)obj;
       markObject(vm, (Obj*)fn->name);
       markArray(vm, &fn->chunk.constants);
+      break;
 	}
     case OBJ_UPVALUE: {
 	  markValue(vm, ((ObjUpvalue *)obj)->closed);
 	  break;
 	}
+    case OBJ_ROPE: {
+      ObjRope *rope = (ObjRope *)obj;
+      markValue(vm, rope->left);
+      markValue(vm, rope->right);
+      markObject(vm, (Obj *)rope->flat);
+      break;
+    }
+    case OBJ_LIST:
+      markArray(vm, &((ObjList *)obj)->items);
+      break;
+    case OBJ_MAP:
+      // The index holds the same keys.
+      markArray(vm, &((ObjMap *)obj)->keys);
+      markArray(vm, &((ObjMap *)obj)->values);
+      break;
     case OBJ_NATIVE:
     case OBJ_STRING:
+    case OBJ_BUILDER:
       break;
   }
 }
 
-static void traceReferences(VM *vm) {
+// Blackens up to budget gray objects, returns true once none are left.
+static bool traceReferences(VM *vm, int budget) {
+  if (vm->markThreads > 1) {
+    if (vm->marker == NULL) vm->marker = newMarker(vm, vm->markThreads);
+    return traceParallel(vm->marker, budget);
+  }
   while (vm->grayCount > 0) {
+    if (budget-- == 0) return false;
     Obj* obj = vm->grayStack[--vm->grayCount];
+    if (vm->grayCount > 0) __builtin_prefetch(vm->grayStack[vm->grayCount - 1]);
     blackenObject(vm, obj);
   }
+  return true;
 }
 
-static void sweep(VM *vm) {
-  Obj* previous = NULL;
-  Obj* obj = vm->first;
-  while (obj != NULL) {
-    if (obj->isMarked) {
-      obj->isMarked = false;
+// Sweeps up to budget objects, returns true at the end of the list.
+// Objects allocated since the sweep started are linked in front of the
+// cursor and survive the cycle unvisited.
+static bool sweep(VM *vm, int budget) {
+  Obj* previous = vm->sweepPrevious;
+  Obj* obj = vm->sweepCursor;
+  while (obj != NULL && budget-- != 0) {
+    if (isMarkedObject(obj)) {
+      // Slab mark bits are cleared all at once when the next cycle starts.
+      if (!obj->inSlab) obj->isMarked = false;
       previous = obj;
       obj = obj->next;
     } else {
       Obj* unreached = obj;
       obj = obj->next;
+      if (previous == NULL && vm->first != unreached) {
+        // Something was allocated in front of the cursor, find the link
+        // that points at it now.
+        previous = vm->first;
+        while (previous->next != unreached) previous = previous->next;
+      }
       if (previous != NULL) {
         previous->next = obj;
       } else {
@@ -160,25 +334,499 @@ static void sweep(VM *vm) {
       freeObject(vm, unreached);
     }
   }
+  vm->sweepPrevious = previous;
+  vm->sweepCursor = obj;
+  return obj == NULL;
 }
 
-void gc(VM *vm) {
-  #ifdef DEBUG_LOG_GC
-  printf("-- gc begin\n");
-  size_t before = vm->bytesAllocated;
+// Takes the results of the background sweeper back: survivors rejoin
+// vm->first and dead objects that own memory are freed here.
+static void finishBackgroundSweep(VM *vm) {
+  Sweeper *sweeper = &vm->sweeper;
+  joinSweeper(sweeper);
+  if (sweeper->survivors != NULL) {
+	sweeper->survivorsTail->next = vm->first;
+	vm->first = sweeper->survivors;
+  }
+  Obj *owner = sweeper->deadOwners;
+  while (owner != NULL) {
+	Obj *next = owner->next;
+	freeObject(vm, owner);
+	owner = next;
+  }
+  vm->bytesAllocated -= sweeper->freedBytes;
+  if (vm->telemetry != NULL) {
+	for (int type = 0; type < OBJ_TYPE_COUNT; type++) {
+	  vm->telemetry->freedBytes[type] += sweeper->freedByType[type];
+	}
+  }
+  vm->gcStats.backgroundSweeps++;
+  vm->gcStats.backgroundSeconds += sweeper->seconds;
+  #if DEBUG_LOG_GC
+  printf("   swept %zu bytes in the background, %.3f ms off the pause\n",
+		 sweeper->freedBytes, sweeper->seconds * 1000);
   #endif
+}
 
-  markRoots(vm);
-  traceReferences(vm);
-  tableRemoveWhite(&vm->strings);
-  sweep(vm);
+// Returns where a young object lives after the minor collection, copying
+// it to the old space the first time it is reached.
+static Obj *forward(VM *vm, Obj *obj) {
+  if (obj == NULL || !isYoung(&vm->nursery, obj)) return obj;
+  if (obj->isMarked) return obj->next;
+  size_t size = objectSize(obj);
+  Obj *copy = allocateOld(vm, size);
+  Obj *next = copy->next;
+  bool inSlab = copy->inSlab;
+  memcpy(copy, obj, size);
+  copy->next = next;
+  copy->inSlab = inSlab;
+  copy->isRemembered = false;
+  if (obj->type == OBJ_UPVALUE) {
+	// A closed upvalue points into itself.
+	ObjUpvalue *upvalue = (ObjUpvalue *)copy;
+	if (upvalue->location == &((ObjUpvalue *)obj)->closed) {
+	  upvalue->location = &upvalue->closed;
+	}
+  }
+  obj->isMarked = true;
+  obj->next = copy;
+  vm->gcStats.promotedBytes += size;
+  vm->gcStats.promotedCount++;
+  if (vm->telemetry != NULL) vm->telemetry->nurseryBytes[obj->type] -= size;
+  // Old objects marked so far may point at the copy without having gone
+  // through a barrier, so it starts gray.
+  copy->isMarked = false;
+  if (vm->gcPhase == GC_MARK) markObject(vm, copy);
+  return copy;
+}
 
-  vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
+static Value forwardValue(VM *vm, Value value) {
+  if (!IS_OBJ(value)) return value;
+  return OBJ_VAL(forward(vm, AS_OBJ(value)));
+}
+
+static void forwardArray(VM *vm, ValueArray *array) {
+  for (int i = 0; i < array->count; i++) {
+	array->values[i] = forwardValue(vm, array->values[i]);
+  }
+}
 
-  #ifdef DEBUG_LOG_GC
-  printf("-- gc end\n");
-  printf("   collected %ld bytes (from %ld to %ld) next at %ld\n",
-		 before - vm->bytesAllocated, before, vm->bytesAllocated,
-		 vm->nextGC);
+// Forwards the references held by an old object.
+static void scanObject(VM *vm, Obj *obj) {
+  switch (obj->type) {
+	case OBJ_CLOSURE: {
+	  ObjClosure *closure = (ObjClosure *)obj;
+	  closure->fn = (ObjFn *)forward(vm, (Obj *)closure->fn);
+	  for (int i = 0; i < closure->upvalueCount; i++) {
+		closure->upvalues[i] =
+			(ObjUpvalue *)forward(vm, (Obj *)closure->upvalues[i]);
+	  }
+	  break;
+	}
+	case OBJ_FN: {
+	  ObjFn *fn = (ObjFn *)obj;
+	  fn->name = (ObjString *)forward(vm, (Obj *)fn->name);
+	  forwardArray(vm, &fn->chunk.constants);
+	  break;
+	}
+	case OBJ_UPVALUE: {
+	  ObjUpvalue *upvalue = (ObjUpvalue *)obj;
+	  upvalue->closed = forwardValue(vm, upvalue->closed);
+	  break;
+	}
+	case OBJ_ROPE: {
+	  ObjRope *rope = (ObjRope *)obj;
+	  rope->left = forwardValue(vm, rope->left);
+	  rope->right = forwardValue(vm, rope->right);
+	  rope->flat = (ObjString *)forward(vm, (Obj *)rope->flat);
+	  break;
+	}
+	case OBJ_LIST:
+	  forwardArray(vm, &((ObjList *)obj)->items);
+	  break;
+	case OBJ_MAP: {
+	  ObjMap *map = (ObjMap *)obj;
+	  forwardArray(vm, &map->keys);
+	  forwardArray(vm, &map->values);
+	  for (int i = 0; i < map->index.capacity; i++) {
+		Entry *entry = &map->index.entries[i];
+		if (IS_OBJ(entry->key)) entry->key = forwardValue(vm, entry->key);
+	  }
+	  break;
+	}
+	case OBJ_NATIVE:
+	case OBJ_STRING:
+	case OBJ_BUILDER:
+	  break;
+  }
+}
+
+static void forwardRoots(VM *vm) {
+  for (Value *slot = vm->stack; slot < vm->sp; slot++) {
+	*slot = forwardValue(vm, *slot);
+  }
+  for (int i = 0; i < vm->frameCount; i++) {
+	frameAt(vm, i)->closure =
+		(ObjClosure *)forward(vm, (Obj *)frameAt(vm, i)->closure);
+  }
+  // Each link is forwarded before the next one is read from the copy.
+  for (ObjUpvalue **link = &vm->openUpvalues; *link != NULL;
+	   link = &(*link)->next) {
+	*link = (ObjUpvalue *)forward(vm, (Obj *)*link);
+  }
+  forwardArray(vm, &vm->handles);
+  // Only young entries are written, the table may be shared with a
+  // forked parent.
+  for (int i = 0; i < vm->globalNames.capacity; i++) {
+	Entry *entry = &vm->globalNames.entries[i];
+	if (IS_OBJ(entry->key) && isYoung(&vm->nursery, AS_OBJ(entry->key))) {
+	  entry->key = forwardValue(vm, entry->key);
+	}
+  }
+  for (int card = 0; card < vm->globalCardCount; card++) {
+	if (!vm->globalCards[card]) continue;
+	vm->globalCards[card] = 0;
+	int end = (card + 1) << GLOBAL_CARD_SHIFT;
+	if (end > vm->globalValues.count) end = vm->globalValues.count;
+	for (int i = card << GLOBAL_CARD_SHIFT; i < end; i++) {
+	  vm->globalValues.values[i] = forwardValue(vm, vm->globalValues.values[i]);
+	}
+  }
+  for (int i = 0; i < vm->rememberedCount; i++) {
+	vm->remembered[i]->isRemembered = false;
+	scanObject(vm, vm->remembered[i]);
+  }
+  vm->rememberedCount = 0;
+}
+
+// Interned strings are weak: young ones that weren't promoted are dropped.
+static void forwardStrings(VM *vm) {
+  for (int i = 0; i < vm->strings.capacity; i++) {
+	Entry *entry = &vm->strings.entries[i];
+	if (IS_NIL(entry->key) || !isYoung(&vm->nursery, AS_OBJ(entry->key))) {
+	  continue;
+	}
+	if (AS_OBJ(entry->key)->isMarked) {
+	  entry->key = OBJ_VAL(AS_OBJ(entry->key)->next);
+	} else {
+	  tableRemoveEntry(&vm->strings, entry);
+	}
+  }
+}
+
+static void minorGc(VM *vm) {
+  #if DEBUG_LOG_GC
+  printf("-- minor gc begin\n");
+  size_t before = vm->gcStats.promotedBytes;
   #endif
+  double start = gcNow();
+
+  // Copies are linked in front of vm->first, scan them until scanning
+  // stops promoting.
+  Obj *scanned = vm->first;
+  forwardRoots(vm);
+  while (vm->first != scanned) {
+	Obj *top = vm->first;
+	for (Obj *obj = top; obj != scanned; obj = obj->next) {
+	  scanObject(vm, obj);
+	}
+	scanned = top;
+  }
+  forwardStrings(vm);
+  vm->nursery.top = vm->nursery.start;
+  if (vm->telemetry != NULL) {
+	for (int type = 0; type < OBJ_TYPE_COUNT; type++) {
+	  vm->telemetry->freedBytes[type] += vm->telemetry->nurseryBytes[type];
+	  vm->telemetry->nurseryBytes[type] = 0;
+	}
+  }
+
+  double seconds = gcNow() - start;
+  vm->gcStats.minorCount++;
+  vm->gcStats.minorSeconds += seconds;
+  if (seconds > vm->gcStats.maxMinorSeconds) {
+	vm->gcStats.maxMinorSeconds = seconds;
+  }
+  #if DEBUG_LOG_GC
+  printf("-- minor gc end\n");
+  printf("   promoted %ld bytes\n", vm->gcStats.promotedBytes - before);
+  #endif
+}
+
+void initGcConfig(GcConfig *config) {
+  config->initialHeap = 1024 * 1024;
+  config->heapLimit = 0;
+  config->gcFraction = 0.05;
+  config->maxGrowth = 4;
+}
+
+static size_t clampTrigger(GcConfig *config, size_t trigger) {
+  if (trigger < config->initialHeap) trigger = config->initialHeap;
+  if (config->heapLimit > 0 && trigger > config->heapLimit) {
+	trigger = config->heapLimit;
+  }
+  return trigger;
+}
+
+void configureGc(VM *vm, const GcConfig *config) {
+  vm->gcConfig = *config;
+  if (vm->gcStats.majorCount == 0) vm->nextGC = config->initialHeap;
+  vm->nextGC = clampTrigger(&vm->gcConfig, vm->nextGC);
+  if (vm->bytesAllocated > vm->nextGC) vm->gcRequested = true;
+}
+
+// Called as a major cycle ends, with the live bytes in bytesAllocated.
+// Measures over the time since the previous cycle ended.
+static size_t paceNextGc(VM *vm) {
+  GcConfig *config = &vm->gcConfig;
+  GcPacer *pacer = &vm->pacer;
+  double now = gcNow();
+  double live = (double)vm->bytesAllocated;
+  double cost = vm->gcStats.majorSeconds - pacer->majorSeconds;
+  double mutator = now - pacer->time - cost;
+  double allocated = (double)(vm->gcStats.oldBytes - pacer->oldBytes);
+  pacer->time = now;
+  pacer->majorSeconds = vm->gcStats.majorSeconds;
+  pacer->oldBytes = vm->gcStats.oldBytes;
+
+  double headroom = live * (config->maxGrowth - 1);
+  if (mutator > 0 && config->gcFraction > 0 && config->gcFraction < 1) {
+	double rate = allocated / mutator;
+	double budget = cost * (1 - config->gcFraction) / config->gcFraction;
+	if (rate * budget < headroom) headroom = rate * budget;
+  }
+  if (headroom < live * (GC_MIN_GROWTH - 1)) {
+	headroom = live * (GC_MIN_GROWTH - 1);
+  }
+  return clampTrigger(config, (size_t)(live + headroom));
+}
+
+// Runs up to budget units of work of the major collection, starting a
+// new cycle when none is in progress. A budget of 0 finishes marking, and
+// sweeping too unless it runs in the background. wait also waits for the
+// background sweeper. The nursery must be empty.
+static void majorSlice(VM *vm, int budget, bool wait) {
+  double start = gcNow();
+  if (budget == 0) budget = -1;
+
+  if (vm->gcPhase == GC_IDLE) {
+	#if DEBUG_LOG_GC
+	printf("-- gc begin\n");
+	#endif
+	vm->gcBytesBefore = vm->bytesAllocated;
+	slabClearMarks(&vm->slabs);
+	markRoots(vm);
+	vm->gcPhase = GC_MARK;
+  }
+  if (vm->gcPhase == GC_MARK && traceReferences(vm, budget)) {
+	// Stores to the stack and globals have no barrier, so the roots are
+	// marked again before the white objects are given up.
+	markRoots(vm);
+	traceReferences(vm, -1);
+	tableRemoveWhite(&vm->strings);
+	vm->gcPhase = GC_SWEEP;
+	if (vm->sweepInBackground) {
+	  startSweeper(&vm->sweeper, &vm->slabs, vm->first);
+	  vm->first = NULL;
+	} else {
+	  vm->sweepPrevious = NULL;
+	  vm->sweepCursor = vm->first;
+	}
+  }
+  bool swept = false;
+  if (vm->gcPhase == GC_SWEEP && vm->sweepInBackground) {
+	swept = wait || sweeperDone(&vm->sweeper);
+	if (swept) finishBackgroundSweep(vm);
+  } else if (vm->gcPhase == GC_SWEEP) {
+	swept = sweep(vm, budget);
+  }
+
+  double seconds = gcNow() - start;
+  vm->gcStats.sliceCount++;
+  vm->gcStats.majorSeconds += seconds;
+  if (seconds > vm->gcStats.maxMajorSeconds) {
+	vm->gcStats.maxMajorSeconds = seconds;
+  }
+  if (swept) {
+	vm->nextGC = paceNextGc(vm);
+	vm->gcPhase = GC_IDLE;
+	vm->gcStats.majorCount++;
+	#if DEBUG_LOG_GC
+	printf("-- gc end\n");
+	printf("   collected %ld bytes (from %ld to %ld) next at %ld\n",
+		   vm->gcBytesBefore - vm->bytesAllocated, vm->gcBytesBefore,
+		   vm->bytesAllocated, vm->nextGC);
+	#endif
+  }
+}
+
+static void recordCollection(VM *vm, double start, int majorCount) {
+  GcTelemetry *telemetry = vm->telemetry;
+  double end = gcNow();
+  double micros = (end - start) * 1e6;
+  int bucket = 0;
+  while (bucket < GC_PAUSE_BUCKETS - 1 && micros >= (double)(1 << bucket)) {
+	bucket++;
+  }
+  telemetry->pauses[bucket]++;
+  telemetry->collections++;
+  GcSample *sample = &telemetry->samples[telemetry->sampleCount++ % GC_SAMPLES];
+  sample->time = end;
+  sample->liveBytes = vm->bytesAllocated;
+  sample->nextGC = vm->nextGC;
+  sample->major = vm->gcStats.majorCount != majorCount;
+}
+
+// Collects the nursery, then finishes the major cycle in progress or runs
+// a whole one.
+void gc(VM *vm) {
+  double start = gcNow();
+  int majorCount = vm->gcStats.majorCount;
+  minorGc(vm);
+  do {
+	majorSlice(vm, 0, true);
+  } while (vm->gcPhase != GC_IDLE);
+  if (vm->telemetry != NULL) recordCollection(vm, start, majorCount);
+}
+
+// Over the limit, the cycle in progress is finished and a whole new one
+// run, since whatever the first one marked late is still counted.
+static bool collectToLimit(VM *vm) {
+  size_t limit = vm->gcConfig.heapLimit;
+  for (int cycle = 0; cycle < 2 && vm->bytesAllocated > limit; cycle++) {
+	vm->gcStats.emergencyCount++;
+	do {
+	  majorSlice(vm, 0, true);
+	} while (vm->gcPhase != GC_IDLE);
+  }
+  if (vm->bytesAllocated <= limit) return true;
+  fprintf(stderr, "Heap limit of %zu bytes exceeded, %zu bytes live.\n",
+		  limit, vm->bytesAllocated);
+  return false;
+}
+
+bool collectGarbage(VM *vm) {
+  if (!vm->gcRequested) return true;
+  vm->gcRequested = false;
+  double start = gcNow();
+  int majorCount = vm->gcStats.majorCount;
+  int promoted = vm->gcStats.promotedCount;
+  minorGc(vm);
+  // Promoted objects start gray, so a slice has to do more than that much
+  // work for marking to ever catch up.
+  int budget = vm->gcBudget;
+  if (budget > 0) budget += 2 * (vm->gcStats.promotedCount - promoted);
+#if DEBUG_STRESS_GC
+  majorSlice(vm, budget, false);
+#else
+  if (vm->gcPhase != GC_IDLE || vm->bytesAllocated > vm->nextGC) {
+	majorSlice(vm, budget, false);
+  }
+#endif
+  bool underLimit = true;
+  if (vm->gcConfig.heapLimit > 0 &&
+	  vm->bytesAllocated > vm->gcConfig.heapLimit) {
+	underLimit = collectToLimit(vm);
+  }
+  double seconds = gcNow() - start;
+  if (seconds > vm->gcStats.maxPauseSeconds) {
+	vm->gcStats.maxPauseSeconds = seconds;
+  }
+  if (vm->telemetry != NULL) recordCollection(vm, start, majorCount);
+  return underLimit;
+}
+
+void freezeHeap(VM *vm) {
+  gc(vm);
+  Obj *last = NULL;
+  for (Obj *obj = vm->first; obj != NULL; obj = obj->next) {
+	obj->isFrozen = true;
+	obj->isMarked = false;
+	last = obj;
+  }
+  if (last != NULL) {
+	last->next = vm->frozen;
+	vm->frozen = vm->first;
+	vm->first = NULL;
+  }
+  slabSeal(&vm->slabs);
+}
+
+void printGcStats(VM *vm) {
+  GcStats *stats = &vm->gcStats;
+  fprintf(stderr, "gc: %d minor in %.3f ms (max %.3f ms), "
+				  "%d major in %d slices, %.3f ms (max %.3f ms)\n",
+		  stats->minorCount, stats->minorSeconds * 1000,
+		  stats->maxMinorSeconds * 1000, stats->majorCount,
+		  stats->sliceCount, stats->majorSeconds * 1000,
+		  stats->maxMajorSeconds * 1000);
+  fprintf(stderr, "gc: worst pause %.3f ms, %d background sweeps took "
+				  "%.3f ms off the pauses\n",
+		  stats->maxPauseSeconds * 1000, stats->backgroundSweeps,
+		  stats->backgroundSeconds * 1000);
+  fprintf(stderr, "gc: %zu bytes young, %zu promoted, %zu overflowed, "
+				  "%zu old live, %d slabs\n",
+		  stats->youngBytes, stats->promotedBytes, stats->overflowBytes,
+		  vm->bytesAllocated, vm->slabs.slabCount);
+  fprintf(stderr, "gc: next major at %zu bytes, %d emergency collections\n",
+		  vm->nextGC, stats->emergencyCount);
+}
+
+// Objects that already exist count as allocated now, so that freeing them
+// later keeps the per-type numbers balanced. A sweep in progress is
+// finished first, the background sweeper owns part of the list.
+void enableGcTelemetry(VM *vm) {
+  if (vm->telemetry != NULL) return;
+  while (vm->gcPhase == GC_SWEEP) majorSlice(vm, 0, true);
+  GcTelemetry *telemetry = calloc(1, sizeof(GcTelemetry));
+  uint8_t *young = vm->nursery.start;
+  while (young < vm->nursery.top) {
+	Obj *obj = (Obj *)young;
+	size_t size = objectSize(obj);
+	telemetry->allocatedBytes[obj->type] += size;
+	telemetry->nurseryBytes[obj->type] += size;
+	young += (size + 7) & ~(size_t)7;
+  }
+  Obj *lists[] = {vm->first, vm->frozen};
+  for (int i = 0; i < 2; i++) {
+	for (Obj *obj = lists[i]; obj != NULL; obj = obj->next) {
+	  telemetry->allocatedBytes[obj->type] += objectSize(obj);
+	}
+  }
+  vm->telemetry = telemetry;
+}
+
+GcSample *gcSample(GcTelemetry *telemetry, int n) {
+  int kept = telemetry->sampleCount < GC_SAMPLES ? telemetry->sampleCount
+												 : GC_SAMPLES;
+  if (n < 0 || n >= kept) return NULL;
+  return &telemetry->samples[(telemetry->sampleCount - 1 - n) % GC_SAMPLES];
+}
+
+void printGcTelemetry(VM *vm) {
+  GcTelemetry *telemetry = vm->telemetry;
+  if (telemetry == NULL) return;
+  fprintf(stderr, "gc: %d collections, pauses:", telemetry->collections);
+  for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+	if (telemetry->pauses[i] == 0) continue;
+	if (i == GC_PAUSE_BUCKETS - 1) {
+	  fprintf(stderr, " >=%dus %d", 1 << (i - 1), telemetry->pauses[i]);
+	} else {
+	  fprintf(stderr, " <%dus %d", 1 << i, telemetry->pauses[i]);
+	}
+  }
+  fprintf(stderr, "\n");
+  for (int type = 0; type < OBJ_TYPE_COUNT; type++) {
+	fprintf(stderr, "gc: %-8s %12zu bytes allocated, %12zu freed\n",
+			objTypeName(type), telemetry->allocatedBytes[type],
+			telemetry->freedBytes[type]);
+  }
+  // The trajectory, oldest kept sample first.
+  for (int n = GC_SAMPLES - 1; n >= 0; n--) {
+	GcSample *sample = gcSample(telemetry, n);
+	if (sample == NULL) continue;
+	fprintf(stderr, "gc: #%d live %zu next %zu%s\n",
+			telemetry->sampleCount - 1 - n, sample->liveBytes, sample->nextGC,
+			sample->major ? " major" : "");
+  }
 }
@@ -5,6 +5,7 @@
 #include "clox.h"
 #include "value.h"
 #include "object.h"
+#include "slab.h"
 
 #define GROW_CAPACITY(capacity) \
     ((capacity) == 0 ? 8 : (capacity * 2))    // 8 as default ???
@@ -39,4 +40,198 @@ void markValue(VM *vm, Value value);
 void freeObjects(VM *vm);
 void gc(VM *vm);
 
+// The heap is generational. New objects are bump-allocated in the nursery
+// and survivors of a minor collection are copied out and promoted to the
+// old space, the malloc'd objects threaded on vm->first. Functions always
+// start old. Objects move, so collections only run at safepoints of the
+// interpreter loops, where every live object is reachable from the VM.
+// Allocation just requests one.
+#define NURSERY_SIZE (256 * 1024)
+
+typedef struct {
+  uint8_t *start;
+  uint8_t *top;
+  uint8_t *end;
+} Nursery;
+
+static inline bool isYoung(Nursery *nursery, Obj *obj) {
+  return (uint8_t *)obj >= nursery->start && (uint8_t *)obj < nursery->end;
+}
+
+typedef struct {
+  int minorCount;
+  int majorCount;
+  size_t youngBytes;      // bump-allocated in the nursery
+  size_t promotedBytes;   // copied out by minor collections
+  size_t overflowBytes;   // allocated old because the nursery was full
+  int promotedCount;
+  int sliceCount;          // incremental steps of the major collections
+  double minorSeconds;
+  double majorSeconds;
+  double maxMinorSeconds;
+  double maxMajorSeconds;  // longest major slice
+  double maxPauseSeconds;  // longest safepoint, minor and slice together
+  int backgroundSweeps;
+  double backgroundSeconds;  // spent sweeping off the mutator's thread
+  size_t oldBytes;         // allocated in the old space, promotions included
+  int emergencyCount;      // full collections forced by the heap limit
+} GcStats;
+
+// Pacing. When a major cycle ends, the next one is set to start once the
+// mutator has allocated enough for the cycle's cost to be gcFraction of
+// the time: the headroom above the live bytes is the allocation rate times
+// the mutator time that buys, bounded by GC_MIN_GROWTH and maxGrowth times
+// the live bytes. A heap limit caps the trigger; crossing it forces a full
+// collection at the next safepoint, and the program fails if that doesn't
+// bring the heap back under it.
+#define GC_MIN_GROWTH 1.25
+
+typedef struct {
+  size_t initialHeap;  // the first trigger and the lowest one
+  size_t heapLimit;    // 0 for none
+  double gcFraction;   // of the mutator's thread spent in major cycles
+  double maxGrowth;
+} GcConfig;
+
+typedef struct {
+  double time;          // gcNow() when the last cycle ended
+  double majorSeconds;  // vm->gcStats.majorSeconds then
+  size_t oldBytes;      // vm->gcStats.oldBytes then
+} GcPacer;
+
+void initGcConfig(GcConfig *config);
+// Applies config to vm, moving nextGC when it is no longer in range.
+void configureGc(VM *vm, const GcConfig *config);
+
+// Telemetry for dashboards, off unless enableGcTelemetry was called, in
+// which case vm->telemetry points at it. Bytes are counted per object
+// type; young objects that die in the nursery count as freed by the minor
+// collection that finds them dead.
+#define GC_PAUSE_BUCKETS 20
+#define GC_SAMPLES 256
+
+typedef struct {
+  double time;      // gcNow() at the end of the collection
+  size_t liveBytes; // bytesAllocated after it
+  size_t nextGC;
+  bool major;       // a major cycle finished in it
+} GcSample;
+
+typedef struct {
+  int collections;
+  // Pauses by length, bucket i counts those under 1 << i microseconds
+  // and the last one everything longer.
+  int pauses[GC_PAUSE_BUCKETS];
+  size_t allocatedBytes[OBJ_TYPE_COUNT];
+  size_t freedBytes[OBJ_TYPE_COUNT];
+  // The last GC_SAMPLES collections, the newest at
+  // (sampleCount - 1) % GC_SAMPLES.
+  GcSample samples[GC_SAMPLES];
+  int sampleCount;
+  size_t nurseryBytes[OBJ_TYPE_COUNT];  // young and not promoted yet
+} GcTelemetry;
+
+// The major collection is incremental. Each safepoint that collects runs a
+// slice of at most vm->gcBudget objects marked or swept, 0 runs the whole
+// cycle at once. WRITE_BARRIER keeps marked objects from pointing at white
+// ones, and the roots are marked again when the gray stack runs empty.
+typedef enum {
+  GC_IDLE,
+  GC_MARK,
+  GC_SWEEP
+} GcPhase;
+
+#define GC_DEFAULT_BUDGET 1000
+
+// Mark bit of an old object. Frozen objects count as marked.
+static inline bool isMarkedObject(Obj *obj) {
+  if (obj->isFrozen) return true;
+  if (!obj->inSlab) return obj->isMarked;
+  uint8_t mask;
+  return (*slabMarkByte(obj, &mask) & mask) != 0;
+}
+
+static inline void setMarkedObject(Obj *obj) {
+  if (!obj->inSlab) {
+	obj->isMarked = true;
+	return;
+  }
+  uint8_t mask;
+  *slabMarkByte(obj, &mask) |= mask;
+}
+
+// Sets the mark bit of an unfrozen old object, returning whether it
+// already was set. Safe to race with other markers.
+static inline bool claimObject(Obj *obj) {
+  if (!obj->inSlab) {
+	return __atomic_exchange_n(&obj->isMarked, true, __ATOMIC_ACQ_REL);
+  }
+  uint8_t mask;
+  uint8_t *byte = slabMarkByte(obj, &mask);
+  if (__atomic_load_n(byte, __ATOMIC_RELAXED) & mask) return true;
+  return (__atomic_fetch_or(byte, mask, __ATOMIC_ACQ_REL) & mask) != 0;
+}
+
+// Functions, builders, lists and maps own memory besides their block. Young
+// objects die without being looked at, so these are always allocated old,
+// and they are freed on the VM's thread.
+static inline bool ownsMemory(ObjType type) {
+  return type == OBJ_FN || type == OBJ_BUILDER || type == OBJ_LIST ||
+	  type == OBJ_MAP;
+}
+
+Obj *allocateObject(VM *vm, size_t size, ObjType type);
+size_t objectSize(Obj *obj);
+void rememberObject(VM *vm, Obj *obj);
+void rememberFrozen(VM *vm, Obj *obj);
+// Pushes an already marked object on vm->grayStack.
+void grayObject(VM *vm, Obj *obj);
+
+// Collects the heap and freezes everything left: frozen objects are never
+// marked, swept or freed by later collections, and the slabs they live in
+// are sealed. Meant to run before fork() so that children share the heap
+// copy-on-write. Frozen objects written to later are kept as roots.
+void freezeHeap(VM *vm);
+
+// Runs the collection requested since the last safepoint, if any: always a
+// minor one, followed by a major one once the old space crossed nextGC.
+// Returns false if the heap stays over the limit.
+bool collectGarbage(VM *vm);
+double gcNow(void);
+void printGcStats(VM *vm);
+
+void enableGcTelemetry(VM *vm);
+// The nth newest sample, NULL if there aren't that many.
+GcSample *gcSample(GcTelemetry *telemetry, int n);
+void printGcTelemetry(VM *vm);
+
+// Barrier for storing value into the heap object owner. Old objects that
+// start pointing at young ones are remembered so the next minor collection
+// treats them as roots. While marking, an old white value stored into a
+// marked object is marked too. Frozen owners become roots for good.
+#define WRITE_BARRIER(vm, owner, value)                                  \
+	do {                                                                 \
+	  if (!IS_OBJ(value)) break;                                         \
+	  Obj *target_ = AS_OBJ(value);                                      \
+	  Obj *owner_ = (Obj *)(owner);                                      \
+	  if (owner_->isFrozen && !owner_->isMarked && !target_->isFrozen) { \
+		rememberFrozen(vm, owner_);                                      \
+	  }                                                                  \
+	  if (isYoung(&(vm)->nursery, target_)) {                            \
+		if (!isYoung(&(vm)->nursery, owner_) && !owner_->isRemembered) { \
+		  rememberObject(vm, owner_);                                    \
+		}                                                                \
+	  } else if ((vm)->gcPhase == GC_MARK && isMarkedObject(owner_) &&   \
+				 !isMarkedObject(target_)) {                             \
+		markObject(vm, target_);                                         \
+	  }                                                                  \
+	} while (false)
+
+// Stores to globals dirty the card of their slot instead, minor
+// collections only scan dirty cards of vm->globalValues.
+#define GLOBAL_CARD_SHIFT 5
+
+#define MARK_GLOBAL_CARD(vm, slot) \
+	((vm)->globalCards[(slot) >> GLOBAL_CARD_SHIFT] = 1)
+
 #endif
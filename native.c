@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "native.h"
+#include "vm.h"
+#include "memory.h"
+
+static bool validArity(const NativeDef *def) {
+  if (def->fn == NULL || def->minArity < 0 || def->minArity > UINT8_MAX) {
+	return false;
+  }
+  if (def->maxArity == NATIVE_VARIADIC) return true;
+  return def->maxArity >= def->minArity && def->maxArity <= UINT8_MAX;
+}
+
+// There must be a global slot left for def.
+static void defineNative(VM *vm, const NativeDef *def) {
+  *vm->sp++ = newStringLength(vm, def->name, strlen(def->name));
+  *vm->sp++ = OBJ_VAL(newNative(vm, def));
+  int slot = globalSlot(vm, vm->sp[-2]);
+  vm->globalValues.values[slot] = vm->sp[-1];
+  MARK_GLOBAL_CARD(vm, slot);
+  vm->sp -= 2;
+}
+
+// How many of module's natives are bound to names that have no global
+// slot yet.
+static int newGlobals(VM *vm, const NativeModule *module) {
+  int count = 0;
+  for (const NativeDef *def = module->natives; def->name != NULL; def++) {
+	Value name = newStringLength(vm, def->name, strlen(def->name));
+	Value slot;
+	if (!tableGet(&vm->globalNames, name, &slot)) count++;
+  }
+  return count;
+}
+
+bool defineNativeModule(VM *vm, const NativeModule *module) {
+  if (module->apiVersion != NATIVE_API_VERSION) return false;
+  for (const NativeDef *def = module->natives; def->name != NULL; def++) {
+	if (!validArity(def)) return false;
+  }
+  if (vm->globalValues.count + newGlobals(vm, module) > GLOBAL_MAX) {
+	return false;
+  }
+  for (const NativeDef *def = module->natives; def->name != NULL; def++) {
+	defineNative(vm, def);
+  }
+  return true;
+}
+
+bool nativeError(VM *vm, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  vsnprintf(vm->error, sizeof(vm->error), format, args);
+  va_end(args);
+  return false;
+}
+
+NativeHandle nativeHandle(VM *vm, Value value) {
+  writeValueArray(vm, &vm->handles, value);
+  return vm->handles.count - 1;
+}
+
+Value handleValue(VM *vm, NativeHandle handle) {
+  return vm->handles.values[handle];
+}
+
+void setHandle(VM *vm, NativeHandle handle, Value value) {
+  vm->handles.values[handle] = value;
+}
+
+int handleMark(VM *vm) {
+  return vm->handles.count;
+}
+
+void releaseHandles(VM *vm, int mark) {
+  vm->handles.count = mark;
+}
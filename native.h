@@ -0,0 +1,63 @@
+#ifndef CLOX_NATIVE_H
+#define CLOX_NATIVE_H
+
+#include <stdarg.h>
+
+#include "common.h"
+#include "clox.h"
+#include "value.h"
+
+// Extension API for functions written in C. A native gets the VM, its
+// arguments and where to store its result, and returns false after
+// nativeError to raise a runtime error. Natives are registered in
+// modules, tables of NativeDef that declare each one's arity, which the
+// VM checks before calling it.
+
+// Bumped whenever NativeFn, NativeDef or NativeModule change. Modules
+// built against another version are refused.
+#define NATIVE_API_VERSION 1
+
+// A maxArity taking any number of arguments from minArity on.
+#define NATIVE_VARIADIC (-1)
+
+// args points into the VM's stack, which moves when it grows. A native
+// that calls back into scripts reads its arguments first or keeps them in
+// handles.
+typedef bool (*NativeFn)(VM *vm, int argCount, Value *args, Value *result);
+
+typedef struct {
+  const char *name;  // the global it is bound to
+  NativeFn fn;
+  int minArity;
+  int maxArity;
+} NativeDef;
+
+typedef struct {
+  int apiVersion;          // NATIVE_API_VERSION
+  const char *name;
+  const NativeDef *natives;  // ends with an entry whose name is NULL
+} NativeModule;
+
+// Binds every native of module to a global. False, binding none, if the
+// module is for another API version, declares an invalid arity, or needs
+// more global slots than the VM has left.
+bool defineNativeModule(VM *vm, const NativeModule *module);
+
+// Records the message of the runtime error a native is about to raise,
+// returns false for the native to return.
+bool nativeError(VM *vm, const char *format, ...);
+
+// Objects may move or be freed whenever a collection runs, which a native
+// that re-enters the VM or an embedder holding values between calls can't
+// see coming. A handle is a root the collector keeps up to date. Handles
+// made during a native call are released when it returns, others by
+// releaseHandles back to a mark taken with handleMark.
+typedef int NativeHandle;
+
+NativeHandle nativeHandle(VM *vm, Value value);
+Value handleValue(VM *vm, NativeHandle handle);
+void setHandle(VM *vm, NativeHandle handle, Value value);
+int handleMark(VM *vm);
+void releaseHandles(VM *vm, int mark);
+
+#endif
@@ -1,33 +1,37 @@
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "object.h"
 #include "vm.h"
 #include "memory.h"
+#include "hash.h"
 
-static void initObj(VM *vm, Obj *obj, ObjType type, size_t size) {
-  obj->type = type;
-  obj->next = vm->first;
-  obj->isMarked = false;
-  vm->first = obj;
-  #ifdef DEBUG_LOG_GC
-  printf("%p allocate %ld for %d\n", (void*)obj, size, type);
-  #endif
-}
+#define ALLOCATE_OBJ(vm, type, objectType) \
+	((type*)allocateObject(vm, sizeof(type), objectType))
 
 ObjFn *newFn(VM *vm) {
-  ObjFn *fn = ALLOCATE(vm, ObjFn);
-  initObj(vm, &fn->obj, OBJ_FN, sizeof(*fn));
+  ObjFn *fn = ALLOCATE_OBJ(vm, ObjFn, OBJ_FN);
   fn->arity = 0;
   fn->upvalueCount = 0;
   fn->name = NULL;
+  fn->regCode = NULL;
+  fn->regCount = 0;
+  fn->regSlots = 0;
+  fn->callCount = 0;
+  fn->loopCount = 0;
+  fn->jit = NULL;
+  fn->jitFailed = false;
   initChunk(&fn->chunk);
   return fn;
 }
 
 ObjClosure *newClosure(VM *vm, ObjFn* fn) {
-  ObjClosure *closure = ALLOCATE_FLEX(vm, ObjClosure, ObjUpvalue*, fn->upvalueCount);
-  initObj(vm, &closure->obj, OBJ_CLOSURE, sizeof(*closure));
+  ObjClosure *closure = (ObjClosure *)allocateObject(vm,
+	  sizeof(ObjClosure) + sizeof(ObjUpvalue*) * fn->upvalueCount, OBJ_CLOSURE);
   for (int i = 0; i < fn->upvalueCount; i++) {
 	closure->upvalues[i] = NULL;
   }
@@ -37,48 +41,282 @@ ObjClosure *newClosure(VM *vm, ObjFn* fn) {
 }
 
 ObjUpvalue *newUpvalue(VM *vm, Value *slot) {
-  ObjUpvalue *upvalue = ALLOCATE(vm, ObjUpvalue);
-  initObj(vm, &upvalue->obj, OBJ_UPVALUE, sizeof(*upvalue));
+  ObjUpvalue *upvalue = ALLOCATE_OBJ(vm, ObjUpvalue, OBJ_UPVALUE);
   upvalue->location = slot;
   upvalue->closed = NIL_VAL;
   upvalue->next = NULL;
   return upvalue;
 }
 
-ObjNative *newNative(VM *vm, NativeFn fn) {
-  ObjNative *native = ALLOCATE(vm, ObjNative);
-  initObj(vm, &native->obj, OBJ_NATIVE, sizeof(*native));
-  native->fn = fn;
+ObjNative *newNative(VM *vm, const NativeDef *def) {
+  ObjNative *native = ALLOCATE_OBJ(vm, ObjNative, OBJ_NATIVE);
+  native->fn = def->fn;
+  native->name = def->name;
+  native->minArity = def->minArity;
+  native->maxArity = def->maxArity;
   return native;
 }
 
 static ObjString *allocateString(VM *vm, size_t length) {
-  ObjString *string = ALLOCATE_FLEX(vm, ObjString, char, length + 1);
-  initObj(vm, &string->obj, OBJ_STRING, sizeof(*string));
+  ObjString *string = (ObjString *)allocateObject(vm,
+	  sizeof(ObjString) + length + 1, OBJ_STRING);
   string->length = (int)length;
   string->value[length] = '\0';
   return string;
 }
 
 static uint32_t hashString(const char *key, size_t length) {
-  uint32_t hash = 2166136261u;
-  for (int i = 0; i < length; i++) {
-	hash ^= key[i];
-	hash *= 16777619;
-  }
-  return hash;
+  uint64_t hash = hashBytes(key, length, 0);
+  return (uint32_t)(hash ^ (hash >> 32));
 }
 
-Value newStringLength(VM *vm, const char *text, size_t length) {
+ObjString *copyString(VM *vm, const char *text, size_t length) {
   uint32_t hash = hashString(text, length);
   ObjString *interned = tableFindString(&vm->strings, text, length,
 										hash);
-  if (interned != NULL) return OBJ_VAL(interned);
+  if (interned != NULL) return interned;
   ObjString *string = allocateString(vm, length);
   if (length > 0 && text != NULL) memcpy(string->value, text, length);
   string->hash = hash;
-  tableSet(vm, &vm->strings, string, NIL_VAL);
-  return OBJ_VAL(string);
+  tableSet(vm, &vm->strings, OBJ_VAL(string), NIL_VAL);
+  return string;
+}
+
+Value newStringLength(VM *vm, const char *text, size_t length) {
+  if (length <= SMALL_STRING_MAX) return smallString(text, length);
+  return OBJ_VAL(copyString(vm, text, length));
+}
+
+uint32_t stringLength(Value value) {
+  if (IS_SMALL_STRING(value)) return SMALL_STRING_LENGTH(value);
+  Obj *obj = AS_OBJ(value);
+  if (obj->type == OBJ_STRING) return ((ObjString *)obj)->length;
+  return ((ObjRope *)obj)->length;
+}
+
+// A flattened rope stands for its string.
+static Value resolveRope(Value value) {
+  if (isObjType(value, OBJ_ROPE) && ((ObjRope *)AS_OBJ(value))->flat != NULL) {
+	return OBJ_VAL(((ObjRope *)AS_OBJ(value))->flat);
+  }
+  return value;
+}
+
+// Copies the characters of a string or rope to dest. Pieces are taken
+// from the right end, so the left-leaning ropes built by appending in a
+// loop are walked without growing the stack.
+static void copyRope(Value root, char *dest) {
+  Value inlineStack[32];
+  Value *stack = inlineStack;
+  int count = 0;
+  int capacity = 32;
+  char *end = dest + stringLength(root);
+  Value node = root;
+  for (;;) {
+	node = resolveRope(node);
+	if (!isObjType(node, OBJ_ROPE)) {
+	  char buffer[SMALL_STRING_MAX + 1];
+	  uint32_t length = stringLength(node);
+	  end -= length;
+	  memcpy(end, stringChars(node, buffer), length);
+	  if (count == 0) break;
+	  node = stack[--count];
+	  continue;
+	}
+	ObjRope *rope = (ObjRope *)AS_OBJ(node);
+	if (count == capacity) {
+	  capacity *= 2;
+	  if (stack == inlineStack) {
+		stack = malloc(sizeof(Value) * capacity);
+		memcpy(stack, inlineStack, sizeof(inlineStack));
+	  } else {
+		stack = realloc(stack, sizeof(Value) * capacity);
+	  }
+	}
+	stack[count++] = rope->left;
+	node = rope->right;
+  }
+  if (stack != inlineStack) free(stack);
+}
+
+Value concatenate(VM *vm, Value a, Value b) {
+  uint32_t leftLength = stringLength(a);
+  uint32_t length = leftLength + stringLength(b);
+  if (leftLength == 0) return b;
+  if (length == leftLength) return a;
+  if (length < ROPE_MIN_LENGTH) {
+	char chars[ROPE_MIN_LENGTH];
+	copyRope(a, chars);
+	copyRope(b, chars + leftLength);
+	return newStringLength(vm, chars, length);
+  }
+  ObjRope *rope = ALLOCATE_OBJ(vm, ObjRope, OBJ_ROPE);
+  rope->length = length;
+  rope->left = resolveRope(a);
+  rope->right = resolveRope(b);
+  rope->flat = NULL;
+  return OBJ_VAL(rope);
+}
+
+ObjString *flattenRope(VM *vm, ObjRope *rope) {
+  if (rope->flat != NULL) return rope->flat;
+  ObjString *string = allocateString(vm, rope->length);
+  copyRope(OBJ_VAL(rope), string->value);
+  string->hash = hashString(string->value, rope->length);
+  ObjString *interned = tableFindString(&vm->strings, string->value,
+										rope->length, string->hash);
+  if (interned == NULL) {
+	tableSet(vm, &vm->strings, OBJ_VAL(string), NIL_VAL);
+	interned = string;
+  }
+  rope->flat = interned;
+  rope->left = NIL_VAL;
+  rope->right = NIL_VAL;
+  WRITE_BARRIER(vm, rope, OBJ_VAL(interned));
+  return interned;
+}
+
+ObjBuilder *newBuilder(VM *vm) {
+  ObjBuilder *builder = ALLOCATE_OBJ(vm, ObjBuilder, OBJ_BUILDER);
+  builder->chars = NULL;
+  builder->length = 0;
+  builder->capacity = 0;
+  return builder;
+}
+
+static char *builderReserve(VM *vm, ObjBuilder *builder, uint32_t extra) {
+  if (builder->length + extra > builder->capacity) {
+	uint32_t capacity = builder->capacity < 64 ? 64 : builder->capacity;
+	while (capacity < builder->length + extra) capacity *= 2;
+	builder->chars = GROW_ARRAY(vm, builder->chars, char, builder->capacity,
+								capacity);
+	builder->capacity = capacity;
+  }
+  char *end = builder->chars + builder->length;
+  builder->length += extra;
+  return end;
+}
+
+// Strings are appended as they are, numbers, bools and nil the way print
+// shows them. Other values are ignored.
+void builderAppend(VM *vm, ObjBuilder *builder, Value value) {
+  if (isString(value)) {
+	uint32_t length = stringLength(value);
+	copyRope(value, builderReserve(vm, builder, length));
+	return;
+  }
+  char text[32];
+  int length;
+  if (IS_NUMBER(value)) {
+	length = snprintf(text, sizeof(text), "%g", AS_NUM(value));
+  } else if (IS_BOOL(value)) {
+	length = snprintf(text, sizeof(text), AS_BOOL(value) ? "true" : "false");
+  } else if (IS_NIL(value)) {
+	length = snprintf(text, sizeof(text), "nil");
+  } else {
+	return;
+  }
+  memcpy(builderReserve(vm, builder, length), text, length);
+}
+
+Value builderToString(VM *vm, ObjBuilder *builder) {
+  return newStringLength(vm, builder->chars, builder->length);
+}
+
+ObjList *newList(VM *vm) {
+  ObjList *list = ALLOCATE_OBJ(vm, ObjList, OBJ_LIST);
+  initValueArray(&list->items);
+  return list;
+}
+
+void listAppend(VM *vm, ObjList *list, Value value) {
+  writeValueArray(vm, &list->items, value);
+  WRITE_BARRIER(vm, list, value);
+}
+
+void listFill(VM *vm, ObjList *list, Value value, int count) {
+  ValueArray *items = &list->items;
+  if (count > items->capacity) {
+	items->values = GROW_ARRAY(vm, items->values, Value, items->capacity,
+							   count);
+	items->capacity = count;
+  }
+  items->count = count;
+  for (int i = 0; i < count; i++) items->values[i] = value;
+  WRITE_BARRIER(vm, list, value);
+}
+
+// A new list is remembered until the next minor collection, so copying
+// young items into it needs no barrier.
+ObjList *listSlice(VM *vm, ObjList *list, int start, int end) {
+  int count = list->items.count;
+  if (start < 0) start = 0;
+  if (end > count) end = count;
+  ObjList *slice = newList(vm);
+  if (start >= end) return slice;
+  ValueArray *items = &slice->items;
+  items->values = GROW_ARRAY(vm, NULL, Value, 0, end - start);
+  items->capacity = end - start;
+  items->count = end - start;
+  memcpy(items->values, list->items.values + start,
+		 sizeof(Value) * (end - start));
+  return slice;
+}
+
+static int compareNumbers(const void *a, const void *b) {
+  Value x = *(const Value *)a;
+  Value y = *(const Value *)b;
+  return numberLess(x, y) ? -1 : numberLess(y, x) ? 1 : 0;
+}
+
+// Ropes were flattened before sorting, so their flat strings are there.
+static const char *sortChars(Value value, char *buffer, uint32_t *length) {
+  if (isObjType(value, OBJ_ROPE)) {
+	value = OBJ_VAL(((ObjRope *)AS_OBJ(value))->flat);
+  }
+  *length = stringLength(value);
+  return stringChars(value, buffer);
+}
+
+static int compareStrings(const void *a, const void *b) {
+  char bufferA[SMALL_STRING_MAX + 1], bufferB[SMALL_STRING_MAX + 1];
+  uint32_t lengthA, lengthB;
+  const char *x = sortChars(*(const Value *)a, bufferA, &lengthA);
+  const char *y = sortChars(*(const Value *)b, bufferB, &lengthB);
+  int order = memcmp(x, y, lengthA < lengthB ? lengthA : lengthB);
+  if (order != 0) return order;
+  return lengthA < lengthB ? -1 : lengthA > lengthB ? 1 : 0;
+}
+
+bool listSort(VM *vm, ObjList *list) {
+  ValueArray *items = &list->items;
+  bool numbers = true, strings = true;
+  for (int i = 0; i < items->count; i++) {
+	numbers = numbers && IS_NUMBER(items->values[i]);
+	strings = strings && isString(items->values[i]);
+  }
+  if (!numbers && !strings) return false;
+  if (strings) {
+	for (int i = 0; i < items->count; i++) flatValue(vm, items->values[i]);
+  }
+  qsort(items->values, items->count, sizeof(Value),
+		numbers ? compareNumbers : compareStrings);
+  return true;
+}
+
+const char *objTypeName(ObjType type) {
+  switch (type) {
+	case OBJ_STRING: return "string";
+	case OBJ_NATIVE: return "native";
+	case OBJ_FN: return "fn";
+	case OBJ_CLOSURE: return "closure";
+	case OBJ_UPVALUE: return "upvalue";
+	case OBJ_ROPE: return "rope";
+	case OBJ_BUILDER: return "builder";
+	case OBJ_LIST: return "list";
+	case OBJ_MAP: return "map";
+  }
+  return "?";
 }
 
 void printObject(Value value) {
@@ -113,120 +351,258 @@ void printObject(Value value) {
 	  printf("upvalue");
 	  break;
 	}
+	case OBJ_ROPE: {
+	  ObjRope *rope = (ObjRope *)AS_OBJ(value);
+	  if (rope->flat != NULL) {
+		printf("%s", rope->flat->value);
+		break;
+	  }
+	  char *chars = malloc(rope->length);
+	  copyRope(value, chars);
+	  fwrite(chars, 1, rope->length, stdout);
+	  free(chars);
+	  break;
+	}
+	case OBJ_BUILDER: {
+	  printf("<builder>");
+	  break;
+	}
+	case OBJ_LIST: {
+	  ValueArray *items = &AS_LIST(value)->items;
+	  printf("[");
+	  for (int i = 0; i < items->count; i++) {
+		if (i > 0) printf(", ");
+		printValue(items->values[i]);
+	  }
+	  printf("]");
+	  break;
+	}
+	case OBJ_MAP: {
+	  ObjMap *map = AS_MAP(value);
+	  printf("{");
+	  bool first = true;
+	  for (int i = 0; i < map->keys.count; i++) {
+		if (IS_NIL(map->keys.values[i])) continue;
+		if (!first) printf(", ");
+		first = false;
+		printValue(map->keys.values[i]);
+		printf(": ");
+		printValue(map->values.values[i]);
+	  }
+	  printf("}");
+	  break;
+	}
   }
 }
 
 void initTable(Table *table) {
   table->count = 0;
   table->capacity = 0;
+  table->growthLeft = 0;
+  table->control = NULL;
   table->entries = NULL;
 }
 
 void freeTable(VM *vm, Table *table) {
+  DEALLOCATE(vm, table->control);
   DEALLOCATE(vm, table->entries);
   initTable(table);
 }
 
-static Entry *findEntry(Entry *entries, int capacity,
-						ObjString *key) {
-  uint32_t index = key->hash % capacity;
-  Entry *tombstone = NULL;
-  for (;;) {
-	Entry *entry = &entries[index];
-	if (entry->key == NULL) {
-	  if (IS_NIL(entry->value)) {
-		return tombstone != NULL ? tombstone : entry;
-	  } else {
-		if (tombstone == NULL) tombstone = entry;
-	  }
-	} else if (entry->key == key) {
-	  return entry;
+#define CONTROL_EMPTY 0x80
+#define CONTROL_DELETED 0xfe
+
+// Bit i is set when control byte i of the group is byte.
+static inline uint32_t matchByte(const uint8_t *group, uint8_t byte) {
+#ifdef __SSE2__
+  __m128i control = _mm_loadu_si128((const __m128i *)group);
+  return (uint32_t)_mm_movemask_epi8(
+	  _mm_cmpeq_epi8(control, _mm_set1_epi8((char)byte)));
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < TABLE_GROUP; i++) {
+	if (group[i] == byte) mask |= 1u << i;
+  }
+  return mask;
+#endif
+}
+
+// Bit i is set when slot i of the group is empty or deleted, the only
+// control bytes with the high bit set.
+static inline uint32_t matchFree(const uint8_t *group) {
+#ifdef __SSE2__
+  return (uint32_t)_mm_movemask_epi8(
+	  _mm_loadu_si128((const __m128i *)group));
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < TABLE_GROUP; i++) {
+	if (group[i] & 0x80) mask |= 1u << i;
+  }
+  return mask;
+#endif
+}
+
+// Heap keys carry the hash of their characters, other keys are hashed by
+// their bits.
+static inline uint32_t hashKey(Value key) {
+  if (IS_OBJ(key)) return AS_STRING(key)->hash;
+  uint64_t hash = key;
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdull;
+  hash ^= hash >> 33;
+  return (uint32_t)hash;
+}
+
+// The group a hash starts probing at, and the bits stored for it.
+#define HASH_GROUP(hash) ((hash) >> 7)
+#define HASH_TAG(hash) ((uint8_t)((hash) & 0x7f))
+
+// Groups are probed quadratically, which visits every one of them when
+// their count is a power of two.
+static int findIndex(Table *table, Value key, uint32_t hash) {
+  uint32_t mask = (uint32_t)table->capacity / TABLE_GROUP - 1;
+  uint32_t group = HASH_GROUP(hash) & mask;
+  uint8_t tag = HASH_TAG(hash);
+  for (uint32_t step = 1;; step++) {
+	const uint8_t *control = table->control + group * TABLE_GROUP;
+	for (uint32_t match = matchByte(control, tag); match != 0;
+		 match &= match - 1) {
+	  int index = group * TABLE_GROUP + __builtin_ctz(match);
+	  if (table->entries[index].key == key) return index;
 	}
-	index = (index + 1) % capacity;
+	if (matchByte(control, CONTROL_EMPTY) != 0) return -1;
+	group = (group + step) & mask;
   }
 }
 
+// The first empty or deleted slot on key's probe sequence.
+static int findFree(Table *table, uint32_t hash) {
+  uint32_t mask = (uint32_t)table->capacity / TABLE_GROUP - 1;
+  uint32_t group = HASH_GROUP(hash) & mask;
+  for (uint32_t step = 1;; step++) {
+	uint32_t match = matchFree(table->control + group * TABLE_GROUP);
+	if (match != 0) return group * TABLE_GROUP + __builtin_ctz(match);
+	group = (group + step) & mask;
+  }
+}
+
+static void fillSlot(Table *table, int index, Value key, uint32_t hash,
+					 Value value) {
+  if (table->control[index] == CONTROL_EMPTY) table->growthLeft--;
+  table->control[index] = HASH_TAG(hash);
+  table->entries[index].key = key;
+  table->entries[index].value = value;
+  table->count++;
+}
+
+// Rehashes into capacity slots, which leaves no deleted ones behind.
 static void adjustCapacity(VM *vm, Table *table, int capacity) {
-  Entry *entries = ALLOCATE_ARRAY(vm, Entry, capacity);
+  Table old = *table;
+  table->control = ALLOCATE_ARRAY(vm, uint8_t, capacity);
+  table->entries = ALLOCATE_ARRAY(vm, Entry, capacity);
+  memset(table->control, CONTROL_EMPTY, capacity);
   for (int i = 0; i < capacity; i++) {
-	entries[i].key = NULL;
-	entries[i].value = NIL_VAL;
+	table->entries[i].key = NIL_VAL;
+	table->entries[i].value = NIL_VAL;
   }
+  table->capacity = capacity;
   table->count = 0;
-  for (int i = 0; i < table->capacity; i++) {
-	Entry *entry = &table->entries[i];
-	if (entry->key == NULL) continue;
-
-	Entry *dest = findEntry(entries, capacity, entry->key);
-	dest->key = entry->key;
-	dest->value = entry->value;
-	table->count++;
+  table->growthLeft = (int)(capacity * TABLE_MAX_LOAD);
+  for (int i = 0; i < old.capacity; i++) {
+	Entry *entry = &old.entries[i];
+	if (IS_NIL(entry->key)) continue;
+	uint32_t hash = hashKey(entry->key);
+	fillSlot(table, findFree(table, hash), entry->key, hash, entry->value);
   }
-  DEALLOCATE(vm, table->entries);
-  table->entries = entries;
-  table->capacity = capacity;
+  DEALLOCATE(vm, old.control);
+  DEALLOCATE(vm, old.entries);
 }
 
-bool tableGet(Table *table, ObjString *key, Value *value) {
+bool tableGet(Table *table, Value key, Value *value) {
   if (table->count == 0) return false;
 
-  Entry *entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL) return false;
+  int index = findIndex(table, key, hashKey(key));
+  if (index < 0) return false;
 
-  *value = entry->value;
+  *value = table->entries[index].value;
   return true;
 }
 
-bool tableSet(VM *vm, Table *table, ObjString *key, Value value) {
-  if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-	int capacity = GROW_CAPACITY(table->capacity);
+bool tableSet(VM *vm, Table *table, Value key, Value value) {
+  uint32_t hash = hashKey(key);
+  if (table->capacity > 0) {
+	int index = findIndex(table, key, hash);
+	if (index >= 0) {
+	  table->entries[index].value = value;
+	  return false;
+	}
+  }
+  if (table->growthLeft == 0) {
+	// Mostly deleted slots are cleaned up in place, otherwise it grows.
+	int capacity = table->capacity < TABLE_GROUP ? TABLE_GROUP
+												 : table->capacity;
+	if (table->count >= capacity * TABLE_MAX_LOAD / 2) capacity *= 2;
 	adjustCapacity(vm, table, capacity);
   }
-  Entry *entry = findEntry(table->entries, table->capacity, key);
-  bool isNewKey = entry->key == NULL;
-  if (isNewKey && IS_NIL(entry->value)) table->count++;
-  entry->key = key;
-  entry->value = value;
-  return isNewKey;
+  fillSlot(table, findFree(table, hash), key, hash, value);
+  return true;
 }
 
-bool tableDelete(Table *table, ObjString *key) {
-  if (table->count == 0) return false;
-
-  // Find the entry.
-  Entry *entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL) return false;
+static void removeAt(Table *table, int index) {
+  // A group that has an empty slot was never full, so no probe went past
+  // it and the slot can be empty again. Otherwise it stays deleted until
+  // the next rehash.
+  const uint8_t *group = table->control + index / TABLE_GROUP * TABLE_GROUP;
+  if (matchByte(group, CONTROL_EMPTY) != 0) {
+	table->control[index] = CONTROL_EMPTY;
+	table->growthLeft++;
+  } else {
+	table->control[index] = CONTROL_DELETED;
+  }
+  table->entries[index].key = NIL_VAL;
+  table->entries[index].value = NIL_VAL;
+  table->count--;
+}
 
-  // Place a tombstone in the entry.
-  entry->key = NULL;
-  entry->value = BOOL_VAL(true);
+bool tableDelete(Table *table, Value key) {
+  if (table->count == 0) return false;
 
+  int index = findIndex(table, key, hashKey(key));
+  if (index < 0) return false;
+  removeAt(table, index);
   return true;
 }
 
+void tableRemoveEntry(Table *table, Entry *entry) {
+  removeAt(table, (int)(entry - table->entries));
+}
+
 ObjString *tableFindString(Table *table, const char *chars, int length,
 						   uint32_t hash) {
   if (table->count == 0) return NULL;
-  uint32_t index = hash % table->capacity;
-  for (;;) {
-	Entry *entry = &table->entries[index];
-	if (entry->key == NULL) {
-	  // Stop if we find an empty non-tombstone entry.
-	  if (IS_NIL(entry->value)) return NULL;
-	} else if (entry->key->length == length &&
-		entry->key->hash == hash &&
-		memcmp(entry->key->value, chars, length) == 0) {
-	  // We found it.
-	  return entry->key;
+  uint32_t mask = (uint32_t)table->capacity / TABLE_GROUP - 1;
+  uint32_t group = HASH_GROUP(hash) & mask;
+  uint8_t tag = HASH_TAG(hash);
+  for (uint32_t step = 1;; step++) {
+	const uint8_t *control = table->control + group * TABLE_GROUP;
+	for (uint32_t match = matchByte(control, tag); match != 0;
+		 match &= match - 1) {
+	  ObjString *key = AS_STRING(
+		  table->entries[group * TABLE_GROUP + __builtin_ctz(match)].key);
+	  if (key->length == (uint32_t)length && key->hash == hash &&
+		  memcmp(key->value, chars, length) == 0) {
+		return key;
+	  }
 	}
-	index = (index + 1) % table->capacity;
+	if (matchByte(control, CONTROL_EMPTY) != 0) return NULL;
+	group = (group + step) & mask;
   }
 }
 
 void markTable(VM *vm, Table* table) {
   for (int i = 0; i < table->capacity; i++) {
 	Entry* entry = &table->entries[i];
-	markObject(vm, (Obj*)entry->key);
+	markValue(vm, entry->key);
 	markValue(vm, entry->value);
   }
 }
@@ -234,8 +610,83 @@ void markTable(VM *vm, Table* table) {
 void tableRemoveWhite(Table* table){
   for (int i = 0; i < table->capacity; i++) {
 	Entry *entry = &table->entries[i];
-	if (entry->key != NULL && !entry->key->obj.isMarked) {
-	  tableDelete(table, entry->key);
+	if (IS_OBJ(entry->key) && !isMarkedObject(AS_OBJ(entry->key))) {
+	  tableRemoveEntry(table, entry);
+	}
+  }
+}
+
+ObjMap *newMap(VM *vm) {
+  ObjMap *map = ALLOCATE_OBJ(vm, ObjMap, OBJ_MAP);
+  initTable(&map->index);
+  initValueArray(&map->keys);
+  initValueArray(&map->values);
+  map->count = 0;
+  return map;
+}
+
+bool mapKey(VM *vm, Value value, Value *key) {
+  if (IS_DOUBLE(value)) {
+	double number = AS_NUM(value);
+	*key = number == 0 ? INT_VAL(0) : numberValue(number);
+	return true;
+  }
+  if (IS_INT(value) || IS_BOOL(value) || IS_SMALL_STRING(value) ||
+	  isObjType(value, OBJ_STRING)) {
+	*key = value;
+	return true;
+  }
+  if (!isObjType(value, OBJ_ROPE)) return false;
+  *key = flatValue(vm, value);
+  return true;
+}
+
+bool mapGet(ObjMap *map, Value key, Value *value) {
+  Value position;
+  if (!tableGet(&map->index, key, &position)) return false;
+  *value = map->values.values[AS_INT(position)];
+  return true;
+}
+
+void mapSet(VM *vm, ObjMap *map, Value key, Value value) {
+  Value position;
+  if (tableGet(&map->index, key, &position)) {
+	map->values.values[AS_INT(position)] = value;
+  } else {
+	tableSet(vm, &map->index, key, INT_VAL(map->keys.count));
+	writeValueArray(vm, &map->keys, key);
+	writeValueArray(vm, &map->values, value);
+	map->count++;
+	WRITE_BARRIER(vm, map, key);
+  }
+  WRITE_BARRIER(vm, map, value);
+}
+
+// Squeezes out deleted entries once they are the majority.
+static void compactMap(VM *vm, ObjMap *map) {
+  int live = 0;
+  for (int i = 0; i < map->keys.count; i++) {
+	Value key = map->keys.values[i];
+	if (IS_NIL(key)) continue;
+	if (live != i) {
+	  map->keys.values[live] = key;
+	  map->values.values[live] = map->values.values[i];
+	  tableSet(vm, &map->index, key, INT_VAL(live));
 	}
+	live++;
   }
-}
\ No newline at end of file
+  map->keys.count = live;
+  map->values.count = live;
+}
+
+bool mapDelete(VM *vm, ObjMap *map, Value key) {
+  Value position;
+  if (!tableGet(&map->index, key, &position)) return false;
+  tableDelete(&map->index, key);
+  map->keys.values[AS_INT(position)] = NIL_VAL;
+  map->values.values[AS_INT(position)] = NIL_VAL;
+  map->count--;
+  int deleted = map->keys.count - map->count;
+  if (deleted > 8 && deleted > map->count) compactMap(vm, map);
+  return true;
+}
@@ -4,6 +4,7 @@
 #include "common.h"
 #include "chunk.h"
 #include "clox.h"
+#include "native.h"
 
 
 // 4 Bytes.
@@ -13,15 +14,30 @@ typedef enum {
   OBJ_FN,
   OBJ_CLOSURE,
   OBJ_UPVALUE,
+  OBJ_ROPE,
+  OBJ_BUILDER,
+  OBJ_LIST,
+  OBJ_MAP,
 } ObjType;
 
+#define OBJ_TYPE_COUNT (OBJ_MAP + 1)
+
+const char *objTypeName(ObjType type);
+
 typedef struct sObj Obj;;
 typedef struct sObjString ObjString;
 
 // 16 Bytes.
+// A young object that survived a minor collection is marked and next
+// points at its promoted copy. Old objects in the slab heap keep their
+// mark bit in the slab's bitmap instead, see isMarkedObject. A frozen
+// object is never marked, there isMarked says it is in vm->frozenRoots.
 struct sObj {
   ObjType type;
   bool isMarked;
+  bool isRemembered;
+  bool isFrozen;
+  bool inSlab;
   struct sObj *next;
 };
 
@@ -31,18 +47,28 @@ typedef struct {
   int upvalueCount;
   Chunk chunk;
   ObjString *name;
+  // Register backend code, lowered from chunk on first call.
+  uint8_t *regCode;
+  int regCount;
+  int regSlots;
+  // Stack backend hotness counters and native code, see jit.h.
+  int callCount;
+  int loopCount;
+  struct JitCode *jit;
+  bool jitFailed;
 } ObjFn;
 
 ObjFn *newFn(VM *vm);
 
-typedef Value (*NativeFn)(int argCount, Value* args);
-
 typedef struct {
   Obj obj;
   NativeFn fn;
+  const char *name;
+  int minArity;
+  int maxArity;
 } ObjNative;
 
-ObjNative *newNative(VM *vm, NativeFn fn);
+ObjNative *newNative(VM *vm, const NativeDef *def);
 
 struct sObjString {
   Obj obj;
@@ -73,31 +99,156 @@ static inline bool isObjType(Value value, ObjType type) {
   return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+// Makes a string value, small or interned.
 Value newStringLength(VM *vm, const char *text, size_t length);
+// Interns text as a heap string whatever its length, for names that are
+// kept as ObjString rather than as values.
+ObjString *copyString(VM *vm, const char *text, size_t length);
+
+// A concatenation that hasn't been copied yet. Adding strings of at least
+// ROPE_MIN_LENGTH bytes together makes a rope, which is flattened into an
+// interned string the first time it is printed or compared, and after that
+// only forwards to it.
+#define ROPE_MIN_LENGTH 64
 
 typedef struct {
-  ObjString *key;
+  Obj obj;
+  uint32_t length;
+  Value left;        // strings or ropes, nil once flattened
+  Value right;
+  ObjString *flat;
+} ObjRope;
+
+static inline bool isString(Value value) {
+  return IS_SMALL_STRING(value) || isObjType(value, OBJ_STRING) ||
+		 isObjType(value, OBJ_ROPE);
+}
+
+// The characters of a small or heap string, terminated. Small strings are
+// copied to buffer, which holds SMALL_STRING_MAX + 1 bytes.
+static inline const char *stringChars(Value value, char *buffer) {
+  if (!IS_SMALL_STRING(value)) return AS_CSTRING(value);
+  smallStringChars(value, buffer);
+  return buffer;
+}
+
+uint32_t stringLength(Value value);
+// Concatenates two strings or ropes.
+Value concatenate(VM *vm, Value a, Value b);
+ObjString *flattenRope(VM *vm, ObjRope *rope);
+
+// The value itself, or the flat string of a rope.
+static inline Value flatValue(VM *vm, Value value) {
+  if (!isObjType(value, OBJ_ROPE)) return value;
+  return OBJ_VAL(flattenRope(vm, (ObjRope *)AS_OBJ(value)));
+}
+
+// Accumulates pieces in a buffer of its own, for building a string out
+// of many of them in linear time. Builders own memory outside the heap,
+// so like functions they are always allocated old.
+typedef struct {
+  Obj obj;
+  char *chars;
+  uint32_t length;
+  uint32_t capacity;
+} ObjBuilder;
+
+ObjBuilder *newBuilder(VM *vm);
+void builderAppend(VM *vm, ObjBuilder *builder, Value value);
+Value builderToString(VM *vm, ObjBuilder *builder);
+
+// A growable array of values. Its items live outside the heap like a
+// builder's characters, so lists are always allocated old too.
+typedef struct {
+  Obj obj;
+  ValueArray items;
+} ObjList;
+
+#define AS_LIST(v) ((ObjList *)AS_OBJ(v))
+
+ObjList *newList(VM *vm);
+void listAppend(VM *vm, ObjList *list, Value value);
+// Sets list to count copies of value.
+void listFill(VM *vm, ObjList *list, Value value, int count);
+// A new list of the items in [start, end), both clamped to the list.
+ObjList *listSlice(VM *vm, ObjList *list, int start, int end);
+// Sorts numbers ascending and strings bytewise. Returns false, leaving
+// the list alone, if it holds anything else or both.
+bool listSort(VM *vm, ObjList *list);
+
+// The position of index in list, or -1 unless it is an integer in range.
+// Integral doubles, say from a division, count too.
+static inline int listPosition(ObjList *list, Value index) {
+  if (IS_INT(index)) {
+	uint32_t position = (uint32_t)AS_INT(index);
+	return position < (uint32_t)list->items.count ? (int)position : -1;
+  }
+  if (!IS_DOUBLE(index)) return -1;
+  double position = AS_NUM(index);
+  if (!(position >= 0 && position < list->items.count)) return -1;
+  return position == (int)position ? (int)position : -1;
+}
+
+// Keys are strings, small or interned, numbers or bools, and compare by
+// their bits. Slots that aren't full have a nil key.
+typedef struct {
+  Value key;
   Value value;
 } Entry;
 
+// Swiss table: open addressing over groups of TABLE_GROUP slots, each
+// with a control byte that is empty, deleted, or the low 7 bits of the
+// key's hash. A probe compares those bits for a whole group at once and
+// stops at the first group with an empty slot. The capacity is a power
+// of two.
+#define TABLE_GROUP 16
+#define TABLE_MAX_LOAD 0.875
+
 typedef struct {
   int count;
   int capacity;
+  int growthLeft;  // empty slots that may still be filled before a rehash
+  uint8_t *control;
   Entry *entries;
 } Table;
 
-#define TABLE_MAX_LOAD 0.75
-
 void initTable(Table *table);
 void freeTable(VM *vm, Table *table);
-bool tableGet(Table *table, ObjString *key, Value *value);
-bool tableSet(VM *vm, Table *table, ObjString *key, Value value);
-bool tableDelete(Table *table, ObjString *key);
+bool tableGet(Table *table, Value key, Value *value);
+bool tableSet(VM *vm, Table *table, Value key, Value value);
+bool tableDelete(Table *table, Value key);
+// Deletes the entry at a slot found by walking table->entries.
+void tableRemoveEntry(Table *table, Entry *entry);
 ObjString *tableFindString(Table *table, const char *chars, int length,
 						   uint32_t hash);
 void markTable(VM *vm, Table* table);
 void tableRemoveWhite(Table* table);
 
+// A hash map from numbers, bools and strings to values that iterates in
+// insertion order. index maps each key to its position in keys and
+// values, where deleted entries leave a nil key until the arrays are
+// compacted. Maps own memory outside the heap like lists.
+typedef struct {
+  Obj obj;
+  Table index;
+  ValueArray keys;
+  ValueArray values;
+  int count;
+} ObjMap;
+
+#define AS_MAP(v) ((ObjMap *)AS_OBJ(v))
+
+ObjMap *newMap(VM *vm);
+// The key value stands for: ropes are flattened, and numbers that are
+// equal become the same int or double. False for values that can't be
+// keys, which are nil and objects other than strings. Objects move, so
+// they can't be hashed by address.
+bool mapKey(VM *vm, Value value, Value *key);
+// These take keys made by mapKey.
+bool mapGet(ObjMap *map, Value key, Value *value);
+void mapSet(VM *vm, ObjMap *map, Value key, Value value);
+bool mapDelete(VM *vm, ObjMap *map, Value key);
+
 void printObject(Value value);
 
 #endif
@@ -1,29 +1,40 @@
-OPCODE(CONSTANT, 1)
-OPCODE(CONSTANT_LONG, 1)
-OPCODE(ADD, -1)
-OPCODE(SUBTRACT, -1)
-OPCODE(NEGATE, -1)
-OPCODE(MULTIPLY, -1)
-OPCODE(DIVIDE, -1)
-OPCODE(LESS, -1)
-OPCODE(EQ, -1)
-OPCODE(NIL, 1)
-OPCODE(TRUE, 1)
-OPCODE(FALSE, 1)
-OPCODE(PRINT, 0)
-OPCODE(POP, -1)
-OPCODE(DEFINE_GLOBAL, 1)
-OPCODE(GET_GLOBAL, -1)
-OPCODE(SET_GLOBAL, -1)
-OPCODE(GET_LOCAL, -1)
-OPCODE(SET_LOCAL, -1)
-OPCODE(GET_UPVALUE, 0)
-OPCODE(SET_UPVALUE, 0)
-OPCODE(CLOSE_UPVALUE, 0)
-OPCODE(JUMP_IF, -1)
-OPCODE(JUMP, 0)
-OPCODE(LOOP, 0)
-OPCODE(CALL, 0)
-OPCODE(CLOSURE, 0)
-OPCODE(RETURN, -1)
-OPCODE(TAIL_CALL, 0)
\ No newline at end of file
+OPCODE(CONSTANT, 1)
+OPCODE(CONSTANT_LONG, 1)
+OPCODE(ADD, -1)
+OPCODE(SUBTRACT, -1)
+OPCODE(NEGATE, -1)
+OPCODE(MULTIPLY, -1)
+OPCODE(DIVIDE, -1)
+OPCODE(LESS, -1)
+OPCODE(EQ, -1)
+OPCODE(NIL, 1)
+OPCODE(TRUE, 1)
+OPCODE(FALSE, 1)
+OPCODE(PRINT, 0)
+OPCODE(POP, -1)
+OPCODE(DEFINE_GLOBAL, 1)
+OPCODE(GET_GLOBAL, -1)
+OPCODE(SET_GLOBAL, -1)
+OPCODE(GET_LOCAL, -1)
+OPCODE(SET_LOCAL, -1)
+OPCODE(GET_UPVALUE, 0)
+OPCODE(SET_UPVALUE, 0)
+OPCODE(CLOSE_UPVALUE, 0)
+OPCODE(JUMP_IF, -1)
+OPCODE(JUMP, 0)
+OPCODE(LOOP, 0)
+OPCODE(CALL, 0)
+OPCODE(CLOSURE, 0)
+OPCODE(RETURN, -1)
+OPCODE(TAIL_CALL, 0)
+OPCODE(ADD_LOCALS, 1)
+OPCODE(ADD_CONST, 0)
+OPCODE(INC_LOCAL, 0)
+OPCODE(STORE_LOCAL, -1)
+OPCODE(LESS_LOCAL_CONST_JUMP, 0)
+OPCODE(LESS_LOCALS_JUMP, 0)
+OPCODE(LIST, 1)
+OPCODE(GET_INDEX, -1)
+OPCODE(SET_INDEX, -2)
+OPCODE(MAP, 1)
+OPCODE(DELETE_INDEX, -2)
\ No newline at end of file
@@ -0,0 +1,182 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "optimizer.h"
+#include "memory.h"
+
+// Fused sequences, matched in this order:
+//
+//   GET_LOCAL a; CONSTANT 1; ADD; SET_LOCAL a; POP  ->  INC_LOCAL a
+//   GET_LOCAL a; CONSTANT k; LESS; JUMP_IF      ->  LESS_LOCAL_CONST_JUMP a k
+//   GET_LOCAL a; GET_LOCAL b; LESS; JUMP_IF     ->  LESS_LOCALS_JUMP a b
+//   GET_LOCAL a; GET_LOCAL b; ADD               ->  ADD_LOCALS a b
+//   CONSTANT k; ADD                             ->  ADD_CONST k
+//   SET_LOCAL a; POP                            ->  STORE_LOCAL a
+//
+// A sequence is only fused when no jump lands inside it.
+
+typedef struct {
+  int offset;
+  int length;
+} Insn;
+
+static uint8_t opAt(Chunk *chunk, Insn *insns, int count, int i) {
+  if (i >= count) return 0xff;
+  return chunk->code[insns[i].offset];
+}
+
+static uint8_t operandAt(Chunk *chunk, Insn *insns, int i) {
+  return chunk->code[insns[i].offset + 1];
+}
+
+static int jumpTarget(Chunk *chunk, int offset) {
+  uint16_t jump = (uint16_t)((chunk->code[offset + 1] << 8) |
+      chunk->code[offset + 2]);
+  if (chunk->code[offset] == OP_LOOP) return offset + 3 - jump;
+  return offset + 3 + jump;
+}
+
+static bool isJump(uint8_t op) {
+  return op == OP_JUMP || op == OP_JUMP_IF || op == OP_LOOP;
+}
+
+// True if none of the n instructions following insns[i] is a jump target.
+static bool straightLine(bool *isTarget, Insn *insns, int count, int i,
+                         int n) {
+  if (i + n >= count) return false;
+  for (int j = i + 1; j <= i + n; j++) {
+    if (isTarget[insns[j].offset]) return false;
+  }
+  return true;
+}
+
+static bool isConstantOne(Chunk *chunk, uint8_t constant) {
+  Value value = chunk->constants.values[constant];
+  return IS_NUMBER(value) && AS_NUM(value) == 1;
+}
+
+// Matches a fused sequence at insns[i]. Writes the superinstruction to out
+// and returns how many instructions it replaces, or 0 if none applies.
+static int match(Chunk *chunk, Insn *insns, int count, bool *isTarget,
+                 int i, uint8_t *out, int *outLength) {
+  uint8_t op = opAt(chunk, insns, count, i);
+  uint8_t next = opAt(chunk, insns, count, i + 1);
+  uint8_t third = opAt(chunk, insns, count, i + 2);
+  uint8_t fourth = opAt(chunk, insns, count, i + 3);
+
+  if (op == OP_GET_LOCAL && next == OP_CONSTANT && third == OP_ADD &&
+      fourth == OP_SET_LOCAL &&
+      opAt(chunk, insns, count, i + 4) == OP_POP &&
+      straightLine(isTarget, insns, count, i, 4) &&
+      isConstantOne(chunk, operandAt(chunk, insns, i + 1)) &&
+      operandAt(chunk, insns, i) == operandAt(chunk, insns, i + 3)) {
+    out[0] = OP_INC_LOCAL;
+    out[1] = operandAt(chunk, insns, i);
+    *outLength = 2;
+    return 5;
+  }
+  if (op == OP_GET_LOCAL && (next == OP_CONSTANT || next == OP_GET_LOCAL) &&
+      third == OP_LESS && fourth == OP_JUMP_IF &&
+      straightLine(isTarget, insns, count, i, 3)) {
+    out[0] = next == OP_CONSTANT ? OP_LESS_LOCAL_CONST_JUMP
+                                 : OP_LESS_LOCALS_JUMP;
+    out[1] = operandAt(chunk, insns, i);
+    out[2] = operandAt(chunk, insns, i + 1);
+    // The offset is filled in once the new layout is known.
+    out[3] = 0xff;
+    out[4] = 0xff;
+    *outLength = 5;
+    return 4;
+  }
+  if (op == OP_GET_LOCAL && next == OP_GET_LOCAL && third == OP_ADD &&
+      straightLine(isTarget, insns, count, i, 2)) {
+    out[0] = OP_ADD_LOCALS;
+    out[1] = operandAt(chunk, insns, i);
+    out[2] = operandAt(chunk, insns, i + 1);
+    *outLength = 3;
+    return 3;
+  }
+  if (op == OP_CONSTANT && next == OP_ADD &&
+      straightLine(isTarget, insns, count, i, 1)) {
+    out[0] = OP_ADD_CONST;
+    out[1] = operandAt(chunk, insns, i);
+    *outLength = 2;
+    return 2;
+  }
+  if (op == OP_SET_LOCAL && next == OP_POP &&
+      straightLine(isTarget, insns, count, i, 1)) {
+    out[0] = OP_STORE_LOCAL;
+    out[1] = operandAt(chunk, insns, i);
+    *outLength = 2;
+    return 2;
+  }
+  return 0;
+}
+
+void peephole(VM *vm, Chunk *chunk) {
+  int count = 0;
+  Insn *insns = malloc(sizeof(Insn) * (chunk->count + 1));
+  bool *isTarget = calloc(chunk->count + 1, sizeof(bool));
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    insns[count].offset = offset;
+    insns[count].length = instructionLength(chunk, offset);
+    count++;
+    if (isJump(chunk->code[offset])) {
+      isTarget[jumpTarget(chunk, offset)] = true;
+    }
+  }
+
+  // newOffset maps every old instruction start, and the end of the chunk,
+  // to its position in the rewritten code. A fused sequence remembers the
+  // old jump it absorbed in jumpFrom.
+  int *newOffset = malloc(sizeof(int) * (chunk->count + 1));
+  int *jumpFrom = malloc(sizeof(int) * (chunk->count + 1));
+  uint8_t *code = ALLOCATE_ARRAY(vm, uint8_t, chunk->count);
+  int length = 0;
+  for (int i = 0; i < count;) {
+    uint8_t fused[5];
+    int fusedLength;
+    int replaced = match(chunk, insns, count, isTarget, i, fused,
+                         &fusedLength);
+    newOffset[insns[i].offset] = length;
+    if (replaced > 0) {
+      jumpFrom[length] = insns[i + replaced - 1].offset;
+      memcpy(code + length, fused, fusedLength);
+      length += fusedLength;
+      i += replaced;
+    } else {
+      jumpFrom[length] = insns[i].offset;
+      memcpy(code + length, chunk->code + insns[i].offset, insns[i].length);
+      length += insns[i].length;
+      i++;
+    }
+  }
+  newOffset[chunk->count] = length;
+
+  // Patch every jump against the new layout.
+  for (int offset = 0; offset < length;) {
+    Chunk rewritten = *chunk;
+    rewritten.code = code;
+    int size = instructionLength(&rewritten, offset);
+    uint8_t op = code[offset];
+    if (isJump(op) || op == OP_LESS_LOCAL_CONST_JUMP ||
+        op == OP_LESS_LOCALS_JUMP) {
+      int target = newOffset[jumpTarget(chunk, jumpFrom[offset])];
+      int jump = op == OP_LOOP ? offset + size - target
+                               : target - (offset + size);
+      code[offset + size - 2] = (jump >> 8) & 0xff;
+      code[offset + size - 1] = jump & 0xff;
+    }
+    offset += size;
+  }
+
+  DEALLOCATE(vm, chunk->code);
+  chunk->code = code;
+  chunk->count = length;
+  chunk->capacity = length;
+  free(insns);
+  free(isTarget);
+  free(newOffset);
+  free(jumpFrom);
+}
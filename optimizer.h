@@ -0,0 +1,12 @@
+#ifndef CLOX_OPTIMIZER_H
+#define CLOX_OPTIMIZER_H
+
+#include "common.h"
+#include "clox.h"
+#include "chunk.h"
+
+// Rewrites common instruction sequences of a finished chunk into fused
+// superinstructions and fixes up the jump offsets around them.
+void peephole(VM *vm, Chunk *chunk);
+
+#endif
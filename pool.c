@@ -0,0 +1,595 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pool.h"
+#include "vm.h"
+#include "object.h"
+
+// Jobs waiting on one worker. The owner takes the oldest from the bottom,
+// so a worker runs its jobs in the order they came, and thieves take the
+// newest from the top.
+typedef struct {
+  pthread_mutex_t lock;
+  Job **items;     // jobs in [bottom, top)
+  int bottom;
+  int top;
+  int capacity;
+} JobDeque;
+
+// The VM a worker runs a prepared script's jobs in, with the values the
+// script's top level left in its globals held in handles from globals on.
+typedef struct {
+  VM *vm;
+  bool failed;     // the top level raised an error, kept in vm->error
+  NativeHandle script;   // the compiled top level
+  NativeHandle globals;
+  int globalCount;
+  // The top level left objects a job can change, like lists, maps or
+  // closures over variables, in its globals...
+  bool mutableState;
+  // ...and a job ran since, so the top level must run again.
+  bool stale;
+} Isolate;
+
+typedef struct {
+  Pool *pool;
+  int id;
+  pthread_t thread;
+  JobDeque deque;
+  Isolate *isolates;  // indexed by script id, vm NULL until first used
+  int isolateCount;
+} Worker;
+
+struct PoolScript {
+  char *source;
+  int id;
+  PoolScript *next;
+};
+
+struct Job {
+  char *source;
+  PoolScript *script;
+  char *function;
+  int argCount;
+  PoolValue *args;
+  JobCallback callback;
+  void *userData;
+
+  pthread_mutex_t lock;
+  pthread_cond_t finished;
+  JobStatus status;
+  bool done;       // set after the callback returned
+  PoolValue result;
+  char error[256];
+  int refs;        // the submitter's and the pool's, updated atomically
+};
+
+struct Pool {
+  PoolConfig config;
+  int workerCount;
+  Worker *workers;
+
+  pthread_mutex_t lock;
+  pthread_cond_t work;   // jobs were queued or the pool is stopping
+  pthread_cond_t room;   // the queue went below queueLimit
+  // Jobs submitted but not taken by a worker yet, updated atomically.
+  // Submitters bump it before pushing, so it never undercounts.
+  int queued;
+  int blocked;     // submitters waiting for room, updated atomically
+  int sleeping;    // workers waiting for work
+  unsigned next;   // worker the next job goes to
+  bool stopping;
+  bool cancel;
+
+  PoolScript *scripts;
+  int scriptCount;
+};
+
+static void pushJob(JobDeque *deque, Job *job) {
+  pthread_mutex_lock(&deque->lock);
+  if (deque->top == deque->capacity) {
+	if (deque->bottom > 0) {
+	  int count = deque->top - deque->bottom;
+	  memmove(deque->items, deque->items + deque->bottom,
+			  sizeof(Job *) * count);
+	  deque->bottom = 0;
+	  deque->top = count;
+	} else {
+	  deque->capacity = GROW_CAPACITY(deque->capacity);
+	  deque->items = realloc(deque->items, sizeof(Job *) * deque->capacity);
+	  if (deque->items == NULL) {
+		fprintf(stderr, "Out of memory while queueing a job.\n");
+		exit(1);
+	  }
+	}
+  }
+  deque->items[deque->top++] = job;
+  pthread_mutex_unlock(&deque->lock);
+}
+
+static Job *popJob(JobDeque *deque) {
+  Job *job = NULL;
+  pthread_mutex_lock(&deque->lock);
+  if (deque->top > deque->bottom) job = deque->items[deque->bottom++];
+  if (deque->top == deque->bottom) deque->top = deque->bottom = 0;
+  pthread_mutex_unlock(&deque->lock);
+  return job;
+}
+
+// Moves the newest half, up to 64, of some other worker's jobs to worker
+// and returns one of them, NULL if every deque is empty.
+static Job *stealJob(Worker *worker) {
+  Pool *pool = worker->pool;
+  for (int i = 1; i < pool->workerCount; i++) {
+	JobDeque *victim = &pool->workers[(worker->id + i) %
+									  pool->workerCount].deque;
+	Job *loot[64];
+	pthread_mutex_lock(&victim->lock);
+	int count = (victim->top - victim->bottom + 1) / 2;
+	if (count > 64) count = 64;
+	for (int j = 0; j < count; j++) loot[j] = victim->items[--victim->top];
+	pthread_mutex_unlock(&victim->lock);
+	if (count == 0) continue;
+	// loot is newest first, keep the rest in order.
+	for (int j = count - 1; j > 0; j--) pushJob(&worker->deque, loot[j]);
+	return loot[0];
+  }
+  return NULL;
+}
+
+static void copyValue(PoolValue *to, const PoolValue *from) {
+  *to = *from;
+  if (from->type == POOL_STRING) {
+	*to = poolString(from->as.string.chars, from->as.string.length);
+  }
+}
+
+static char *copyText(const char *text) {
+  if (text == NULL) return NULL;
+  size_t length = strlen(text);
+  char *copy = malloc(length + 1);
+  memcpy(copy, text, length + 1);
+  return copy;
+}
+
+static void freeJob(Job *job) {
+  free(job->source);
+  free(job->function);
+  for (int i = 0; i < job->argCount; i++) freePoolValue(&job->args[i]);
+  free(job->args);
+  freePoolValue(&job->result);
+  pthread_mutex_destroy(&job->lock);
+  pthread_cond_destroy(&job->finished);
+  free(job);
+}
+
+// A value the VM can use. Allocating doesn't collect, only safepoints do,
+// so the strings made here stay put until the call is made.
+static Value toValue(VM *vm, const PoolValue *value) {
+  switch (value->type) {
+	case POOL_BOOL: return BOOL_VAL(value->as.boolean);
+	case POOL_NUMBER: return numberValue(value->as.number);
+	case POOL_STRING:
+	  return newStringLength(vm, value->as.string.chars,
+							 value->as.string.length);
+	default: return NIL_VAL;
+  }
+}
+
+static bool fromValue(VM *vm, Value value, PoolValue *result,
+					  char *error, size_t errorSize) {
+  result->type = POOL_NIL;
+  if (IS_BOOL(value)) {
+	result->type = POOL_BOOL;
+	result->as.boolean = AS_BOOL(value);
+  } else if (IS_NUMBER(value)) {
+	*result = poolNumber(AS_NUM(value));
+  } else if (isString(value)) {
+	value = flatValue(vm, value);
+	char buffer[sizeof(Value)];
+	*result = poolString(stringChars(value, buffer), stringLength(value));
+  } else if (!IS_NIL(value)) {
+	snprintf(error, errorSize, "A job can't return a %s.",
+			 objTypeName(OBJ_TYPE(value)));
+	return false;
+  }
+  return true;
+}
+
+static VM *newPoolVM(Pool *pool) {
+  VM *vm = malloc(sizeof(VM));
+  initVM(vm);
+  // The workers already keep every core busy.
+  vm->sweepInBackground = false;
+  if (pool->config.setupVM != NULL) {
+	pool->config.setupVM(vm, pool->config.userData);
+  }
+  return vm;
+}
+
+static void freePoolVM(VM *vm) {
+  freeVM(vm);
+  free(vm);
+}
+
+// True if no job can change what value stands for: nil, bools, numbers,
+// strings, functions, natives and closures that capture nothing.
+static bool immutableValue(Value value) {
+  if (!IS_OBJ(value)) return true;
+  switch (OBJ_TYPE(value)) {
+	case OBJ_STRING:
+	case OBJ_ROPE:
+	case OBJ_NATIVE:
+	case OBJ_FN:
+	  return true;
+	case OBJ_CLOSURE:
+	  return AS_CLOSURE(value)->upvalueCount == 0;
+	default:
+	  return false;
+  }
+}
+
+// Runs the script's top level, which defines its globals anew, and
+// remembers what they hold.
+static bool runTopLevel(Isolate *isolate) {
+  VM *vm = isolate->vm;
+  Value result;
+  if (callFunction(vm, handleValue(vm, isolate->script), 0, NULL,
+				   &result) != INTERPRET_OK) {
+	return false;
+  }
+  isolate->mutableState = false;
+  for (int i = 0; i < isolate->globalCount; i++) {
+	Value value = vm->globalValues.values[i];
+	setHandle(vm, isolate->globals + i, value);
+	if (!immutableValue(value)) isolate->mutableState = true;
+  }
+  return true;
+}
+
+// The isolate of script on worker, running its top level the first time.
+static Isolate *isolateFor(Worker *worker, PoolScript *script) {
+  if (script->id >= worker->isolateCount) {
+	int count = worker->isolateCount;
+	worker->isolateCount = script->id + 1;
+	worker->isolates = realloc(worker->isolates,
+							   sizeof(Isolate) * worker->isolateCount);
+	memset(worker->isolates + count, 0,
+		   sizeof(Isolate) * (worker->isolateCount - count));
+  }
+  Isolate *isolate = &worker->isolates[script->id];
+  if (isolate->vm != NULL) return isolate;
+
+  VM *vm = newPoolVM(worker->pool);
+  isolate->vm = vm;
+  isolate->script = prepareScript(vm, script->source);
+  if (isolate->script < 0) {
+	isolate->failed = true;
+	return isolate;
+  }
+  // Slots are all resolved when the script compiles, so the count holds.
+  isolate->globals = handleMark(vm);
+  isolate->globalCount = vm->globalValues.count;
+  for (int i = 0; i < isolate->globalCount; i++) nativeHandle(vm, NIL_VAL);
+  isolate->failed = !runTopLevel(isolate);
+  return isolate;
+}
+
+// Puts back the globals a job rebound.
+static void resetGlobals(Isolate *isolate) {
+  VM *vm = isolate->vm;
+  for (int i = 0; i < isolate->globalCount; i++) {
+	Value value = handleValue(vm, isolate->globals + i);
+	if (vm->globalValues.values[i] != value) {
+	  vm->globalValues.values[i] = value;
+	  MARK_GLOBAL_CARD(vm, i);
+	}
+  }
+}
+
+// Every job starts from the state the top level leaves. Rebound globals
+// are put back after each job, and when the top level left objects a job
+// may have changed, it runs again before the next one.
+static JobStatus callJob(Worker *worker, Job *job) {
+  Isolate *isolate = isolateFor(worker, job->script);
+  VM *vm = isolate->vm;
+  if (isolate->stale) {
+	isolate->stale = false;
+	isolate->failed = !runTopLevel(isolate);
+  }
+  if (isolate->failed) {
+	snprintf(job->error, sizeof(job->error), "Script failed: %.200s",
+			 vm->error);
+	return JOB_ERROR;
+  }
+  Value callee;
+  if (!getGlobal(vm, job->function, &callee)) {
+	snprintf(job->error, sizeof(job->error), "Undefined function '%s'.",
+			 job->function);
+	return JOB_ERROR;
+  }
+  if (job->argCount > UINT8_MAX) {
+	snprintf(job->error, sizeof(job->error), "Too many arguments.");
+	return JOB_ERROR;
+  }
+  Value args[UINT8_MAX];
+  for (int i = 0; i < job->argCount; i++) {
+	args[i] = toValue(vm, &job->args[i]);
+  }
+  Value result;
+  JobStatus status = JOB_OK;
+  if (callFunction(vm, callee, job->argCount, args, &result) !=
+	  INTERPRET_OK) {
+	snprintf(job->error, sizeof(job->error), "%s", vm->error);
+	status = JOB_ERROR;
+  } else if (!fromValue(vm, result, &job->result, job->error,
+						sizeof(job->error))) {
+	status = JOB_ERROR;
+  }
+  resetGlobals(isolate);
+  isolate->stale = isolate->mutableState;
+  return status;
+}
+
+static JobStatus sourceJob(Worker *worker, Job *job) {
+  VM *vm = newPoolVM(worker->pool);
+  JobStatus status = JOB_OK;
+  if (interpret(vm, job->source) != INTERPRET_OK) {
+	snprintf(job->error, sizeof(job->error), "%s", vm->error);
+	status = JOB_ERROR;
+  }
+  freePoolVM(vm);
+  return status;
+}
+
+static void finishJob(Job *job, JobStatus status) {
+  pthread_mutex_lock(&job->lock);
+  job->status = status;
+  pthread_mutex_unlock(&job->lock);
+  if (job->callback != NULL) job->callback(job, job->userData);
+  pthread_mutex_lock(&job->lock);
+  job->done = true;
+  pthread_cond_broadcast(&job->finished);
+  pthread_mutex_unlock(&job->lock);
+  releaseJob(job);
+}
+
+// Counts a job as taken, waking a submitter waiting for room. blocked is
+// read after queued is written and submitters do the opposite, so one of
+// the two always sees the other.
+static void takeJob(Pool *pool) {
+  __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&pool->blocked, __ATOMIC_SEQ_CST) > 0) {
+	pthread_mutex_lock(&pool->lock);
+	pthread_cond_broadcast(&pool->room);
+	pthread_mutex_unlock(&pool->lock);
+  }
+}
+
+static void *workerThread(void *arg) {
+  Worker *worker = (Worker *)arg;
+  Pool *pool = worker->pool;
+  for (;;) {
+	Job *job = popJob(&worker->deque);
+	if (job == NULL) job = stealJob(worker);
+	if (job == NULL) {
+	  pthread_mutex_lock(&pool->lock);
+	  pool->sleeping++;
+	  while (__atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) == 0 &&
+			 !pool->stopping) {
+		pthread_cond_wait(&pool->work, &pool->lock);
+	  }
+	  pool->sleeping--;
+	  bool quit = pool->stopping &&
+				  __atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) == 0;
+	  pthread_mutex_unlock(&pool->lock);
+	  if (quit) break;
+	  continue;
+	}
+	takeJob(pool);
+	JobStatus status;
+	if (__atomic_load_n(&pool->cancel, __ATOMIC_ACQUIRE)) {
+	  status = JOB_CANCELLED;
+	} else if (job->source != NULL) {
+	  status = sourceJob(worker, job);
+	} else {
+	  status = callJob(worker, job);
+	}
+	finishJob(job, status);
+  }
+  for (int i = 0; i < worker->isolateCount; i++) {
+	if (worker->isolates[i].vm != NULL) freePoolVM(worker->isolates[i].vm);
+  }
+  free(worker->isolates);
+  return NULL;
+}
+
+void initPoolConfig(PoolConfig *config) {
+  config->workers = 0;
+  config->queueLimit = 1024;
+  config->setupVM = NULL;
+  config->userData = NULL;
+}
+
+Pool *newPool(const PoolConfig *config) {
+  Pool *pool = malloc(sizeof(Pool));
+  pool->config = *config;
+  pool->workerCount = config->workers;
+  if (pool->workerCount <= 0) {
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	pool->workerCount = cpus > 0 ? (int)cpus : 1;
+  }
+  if (pool->config.queueLimit <= 0) pool->config.queueLimit = 1;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work, NULL);
+  pthread_cond_init(&pool->room, NULL);
+  pool->queued = 0;
+  pool->blocked = 0;
+  pool->sleeping = 0;
+  pool->next = 0;
+  pool->stopping = false;
+  pool->cancel = false;
+  pool->scripts = NULL;
+  pool->scriptCount = 0;
+  pool->workers = calloc(pool->workerCount, sizeof(Worker));
+  for (int i = 0; i < pool->workerCount; i++) {
+	Worker *worker = &pool->workers[i];
+	worker->pool = pool;
+	worker->id = i;
+	pthread_mutex_init(&worker->deque.lock, NULL);
+  }
+  for (int i = 0; i < pool->workerCount; i++) {
+	pthread_create(&pool->workers[i].thread, NULL, workerThread,
+				   &pool->workers[i]);
+  }
+  return pool;
+}
+
+void freePool(Pool *pool, bool cancel) {
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = true;
+  __atomic_store_n(&pool->cancel, cancel, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&pool->work);
+  pthread_cond_broadcast(&pool->room);
+  pthread_mutex_unlock(&pool->lock);
+  for (int i = 0; i < pool->workerCount; i++) {
+	pthread_join(pool->workers[i].thread, NULL);
+  }
+  for (int i = 0; i < pool->workerCount; i++) {
+	pthread_mutex_destroy(&pool->workers[i].deque.lock);
+	free(pool->workers[i].deque.items);
+  }
+  PoolScript *script = pool->scripts;
+  while (script != NULL) {
+	PoolScript *next = script->next;
+	free(script->source);
+	free(script);
+	script = next;
+  }
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->work);
+  pthread_cond_destroy(&pool->room);
+  free(pool->workers);
+  free(pool);
+}
+
+int poolWorkers(Pool *pool) {
+  return pool->workerCount;
+}
+
+PoolScript *poolPrepare(Pool *pool, const char *source) {
+  PoolScript *script = malloc(sizeof(PoolScript));
+  script->source = copyText(source);
+  pthread_mutex_lock(&pool->lock);
+  script->id = pool->scriptCount++;
+  script->next = pool->scripts;
+  pool->scripts = script;
+  pthread_mutex_unlock(&pool->lock);
+  return script;
+}
+
+Job *submitJob(Pool *pool, const JobSpec *spec, bool wait) {
+  Job *job = malloc(sizeof(Job));
+  job->source = copyText(spec->source);
+  job->script = spec->script;
+  job->function = copyText(spec->function);
+  job->argCount = spec->argCount;
+  job->args = NULL;
+  if (spec->argCount > 0) {
+	job->args = malloc(sizeof(PoolValue) * spec->argCount);
+	for (int i = 0; i < spec->argCount; i++) {
+	  copyValue(&job->args[i], &spec->args[i]);
+	}
+  }
+  job->callback = spec->callback;
+  job->userData = spec->userData;
+  pthread_mutex_init(&job->lock, NULL);
+  pthread_cond_init(&job->finished, NULL);
+  job->status = JOB_PENDING;
+  job->done = false;
+  job->result.type = POOL_NIL;
+  job->error[0] = '\0';
+  job->refs = 2;
+
+  pthread_mutex_lock(&pool->lock);
+  while (wait && !pool->stopping &&
+		 __atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) >=
+			 pool->config.queueLimit) {
+	__atomic_add_fetch(&pool->blocked, 1, __ATOMIC_SEQ_CST);
+	// Look again now that takeJob will see this submitter.
+	if (__atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) >=
+		pool->config.queueLimit) {
+	  pthread_cond_wait(&pool->room, &pool->lock);
+	}
+	__atomic_sub_fetch(&pool->blocked, 1, __ATOMIC_SEQ_CST);
+  }
+  if (pool->stopping || __atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) >=
+							pool->config.queueLimit) {
+	pthread_mutex_unlock(&pool->lock);
+	freeJob(job);
+	return NULL;
+  }
+  __atomic_add_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+  pushJob(&pool->workers[pool->next++ % pool->workerCount].deque, job);
+  if (pool->sleeping > 0) pthread_cond_signal(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+  return job;
+}
+
+JobStatus awaitJob(Job *job) {
+  pthread_mutex_lock(&job->lock);
+  while (!job->done) pthread_cond_wait(&job->finished, &job->lock);
+  JobStatus status = job->status;
+  pthread_mutex_unlock(&job->lock);
+  return status;
+}
+
+JobStatus jobStatus(Job *job) {
+  pthread_mutex_lock(&job->lock);
+  JobStatus status = job->status;
+  pthread_mutex_unlock(&job->lock);
+  return status;
+}
+
+const PoolValue *jobResult(Job *job) {
+  return &job->result;
+}
+
+const char *jobError(Job *job) {
+  return job->error;
+}
+
+void *jobUserData(Job *job) {
+  return job->userData;
+}
+
+void releaseJob(Job *job) {
+  if (__atomic_sub_fetch(&job->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+	freeJob(job);
+  }
+}
+
+PoolValue poolNumber(double number) {
+  PoolValue value;
+  value.type = POOL_NUMBER;
+  value.as.number = number;
+  return value;
+}
+
+PoolValue poolString(const char *chars, int length) {
+  PoolValue value;
+  value.type = POOL_STRING;
+  value.as.string.chars = malloc(length + 1);
+  memcpy(value.as.string.chars, chars, length);
+  value.as.string.chars[length] = '\0';
+  value.as.string.length = length;
+  return value;
+}
+
+void freePoolValue(PoolValue *value) {
+  if (value->type == POOL_STRING) free(value->as.string.chars);
+  value->type = POOL_NIL;
+}
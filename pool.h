@@ -0,0 +1,111 @@
+#ifndef CLOX_POOL_H
+#define CLOX_POOL_H
+
+#include "common.h"
+#include "clox.h"
+
+// Runs independent script jobs on a fixed set of worker threads. Every
+// worker owns the VMs its jobs run in, so jobs never share a heap: their
+// arguments and results cross as PoolValues, which are copied in and out.
+// Submitting hands a job to the workers round robin. Workers run their
+// own jobs oldest first, and one whose deque runs dry steals the newest
+// half of another's.
+typedef struct Pool Pool;
+typedef struct PoolScript PoolScript;
+typedef struct Job Job;
+
+// A value outside any VM. Strings are owned by whatever holds the value.
+typedef enum {
+  POOL_NIL,
+  POOL_BOOL,
+  POOL_NUMBER,
+  POOL_STRING
+} PoolValueType;
+
+typedef struct {
+  PoolValueType type;
+  union {
+	bool boolean;
+	double number;
+	struct {
+	  char *chars;
+	  int length;
+	} string;
+  } as;
+} PoolValue;
+
+typedef enum {
+  JOB_PENDING,    // queued or running
+  JOB_OK,
+  JOB_ERROR,      // runtime error, see jobError
+  JOB_CANCELLED   // the pool shut down before running it
+} JobStatus;
+
+// Called on the worker once the job has finished, before awaitJob
+// returns. It must not wait for other jobs, and submits without blocking.
+typedef void (*JobCallback)(Job *job, void *userData);
+
+typedef struct {
+  // Threads, 0 for one per online CPU.
+  int workers;
+  // Jobs queued but not yet started before submitJob blocks or fails.
+  int queueLimit;
+  // Called on the worker with every VM the pool makes, before it runs
+  // anything, to pick a backend or define native modules.
+  void (*setupVM)(VM *vm, void *userData);
+  void *userData;
+} PoolConfig;
+
+void initPoolConfig(PoolConfig *config);
+Pool *newPool(const PoolConfig *config);
+// Stops taking jobs and waits for the workers. Jobs already queued run
+// first unless cancel is set, then they finish as JOB_CANCELLED. Jobs
+// not yet released stay valid.
+void freePool(Pool *pool, bool cancel);
+int poolWorkers(Pool *pool);
+
+// A script whose functions jobs call. Each worker compiles it once, in a
+// VM kept for the script's jobs, and every job starts from the state its
+// top level leaves: globals a job rebinds are set back after it, and when
+// the top level leaves lists, maps or other mutable objects in its
+// globals it runs again before the next job. The pool owns the script
+// and a copy of source.
+PoolScript *poolPrepare(Pool *pool, const char *source);
+
+typedef struct {
+  // Either a script to run in a VM of its own, which is freed after...
+  const char *source;
+  // ...or the global function of a prepared script to call with args,
+  // which are copied.
+  PoolScript *script;
+  const char *function;
+  int argCount;
+  const PoolValue *args;
+  JobCallback callback;  // may be NULL
+  void *userData;
+} JobSpec;
+
+// Queues a job, blocking while queueLimit jobs are waiting unless wait is
+// false, in which case it returns NULL instead. Also NULL once the pool
+// is shutting down. The job must be released with releaseJob.
+Job *submitJob(Pool *pool, const JobSpec *spec, bool wait);
+
+// Blocks until the job has finished.
+JobStatus awaitJob(Job *job);
+JobStatus jobStatus(Job *job);
+// What the job's function returned, or nil for source jobs. Valid until
+// the job is released.
+const PoolValue *jobResult(Job *job);
+// The runtime error message of a JOB_ERROR job, possibly empty.
+const char *jobError(Job *job);
+void *jobUserData(Job *job);
+// Drops the submitter's reference. A job released before it finishes
+// still runs and is freed after its callback.
+void releaseJob(Job *job);
+
+PoolValue poolNumber(double number);
+// Copies chars.
+PoolValue poolString(const char *chars, int length);
+void freePoolValue(PoolValue *value);
+
+#endif
@@ -0,0 +1,36 @@
+REGOP(MOVE, 3)
+REGOP(LOADK, 3)
+REGOP(LOADK_LONG, 5)
+REGOP(LOADNIL, 2)
+REGOP(LOADTRUE, 2)
+REGOP(LOADFALSE, 2)
+REGOP(ADD, 4)
+REGOP(ADDK, 4)
+REGOP(INC, 2)
+REGOP(SUBTRACT, 4)
+REGOP(MULTIPLY, 4)
+REGOP(DIVIDE, 4)
+REGOP(LESS, 4)
+REGOP(EQ, 4)
+REGOP(NEGATE, 3)
+REGOP(PRINT, 2)
+REGOP(DEFINE_GLOBAL, 4)
+REGOP(GET_GLOBAL, 4)
+REGOP(SET_GLOBAL, 4)
+REGOP(GET_UPVALUE, 3)
+REGOP(SET_UPVALUE, 3)
+REGOP(CLOSE_UPVALUE, 2)
+REGOP(JUMP, 3)
+REGOP(JUMP_IF_FALSE, 4)
+REGOP(LESS_JUMP, 5)
+REGOP(LESSK_JUMP, 5)
+REGOP(LOOP, 3)
+REGOP(CALL, 3)
+REGOP(TAIL_CALL, 3)
+REGOP(CLOSURE, 3)
+REGOP(RETURN, 2)
+REGOP(LIST, 4)
+REGOP(GET_INDEX, 4)
+REGOP(SET_INDEX, 4)
+REGOP(MAP, 4)
+REGOP(DELETE_INDEX, 3)
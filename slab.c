@@ -0,0 +1,111 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "slab.h"
+
+// Blocks start after the slab header, aligned like malloc's.
+#define SLAB_HEADER ((sizeof(Slab) + 15) & ~(size_t)15)
+
+static int sizeClass(size_t size) {
+  return (int)((size + SLAB_GRANULE - 1) / SLAB_GRANULE) - 1;
+}
+
+void initSlabHeap(SlabHeap *heap) {
+  for (int i = 0; i < SLAB_CLASSES; i++) {
+	heap->free[i] = NULL;
+	heap->returned[i] = NULL;
+  }
+  heap->slabs = NULL;
+  heap->sealed = NULL;
+  heap->slabCount = 0;
+}
+
+void freeSlabHeap(SlabHeap *heap) {
+  Slab *slab = heap->slabs;
+  while (slab != NULL) {
+	Slab *next = slab->next;
+	free(slab->marks);
+	free(slab);
+	slab = next;
+  }
+  initSlabHeap(heap);
+}
+
+// Threads a new slab onto the free list of sizeClass.
+static bool growClass(SlabHeap *heap, int sizeClass) {
+  Slab *slab = aligned_alloc(SLAB_SIZE, SLAB_SIZE);
+  if (slab == NULL) return false;
+  slab->marks = calloc(SLAB_MARK_BYTES, 1);
+  if (slab->marks == NULL) {
+	free(slab);
+	return false;
+  }
+  slab->next = heap->slabs;
+  heap->slabs = slab;
+  heap->slabCount++;
+
+  size_t blockSize = (size_t)(sizeClass + 1) * SLAB_GRANULE;
+  uint8_t *block = (uint8_t *)slab + SLAB_HEADER;
+  uint8_t *end = (uint8_t *)slab + SLAB_SIZE;
+  // Link the blocks in address order so consecutive allocations are
+  // adjacent.
+  SlabBlock **link = &heap->free[sizeClass];
+  for (; block + blockSize <= end; block += blockSize) {
+	*link = (SlabBlock *)block;
+	link = &((SlabBlock *)block)->next;
+  }
+  *link = NULL;
+  return true;
+}
+
+void *slabAllocate(SlabHeap *heap, size_t size) {
+  if (size > SLAB_MAX_BLOCK) return malloc(size);
+  int class = sizeClass(size);
+  if (heap->free[class] == NULL) {
+	heap->free[class] = __atomic_exchange_n(&heap->returned[class], NULL,
+											__ATOMIC_ACQUIRE);
+  }
+  if (heap->free[class] == NULL && !growClass(heap, class)) return NULL;
+  SlabBlock *block = heap->free[class];
+  heap->free[class] = block->next;
+  return block;
+}
+
+void slabFree(SlabHeap *heap, void *block, size_t size) {
+  if (size > SLAB_MAX_BLOCK) {
+	free(block);
+	return;
+  }
+  int class = sizeClass(size);
+  ((SlabBlock *)block)->next = heap->free[class];
+  heap->free[class] = block;
+}
+
+void slabFreeShared(SlabHeap *heap, void *block, size_t size) {
+  if (size > SLAB_MAX_BLOCK) {
+	free(block);
+	return;
+  }
+  // The owner only ever takes the whole list, so a plain push is safe.
+  SlabBlock **returned = &heap->returned[sizeClass(size)];
+  SlabBlock *head = __atomic_load_n(returned, __ATOMIC_RELAXED);
+  do {
+	((SlabBlock *)block)->next = head;
+  } while (!__atomic_compare_exchange_n(returned, &head, (SlabBlock *)block,
+										true, __ATOMIC_RELEASE,
+										__ATOMIC_RELAXED));
+}
+
+void slabClearMarks(SlabHeap *heap) {
+  for (Slab *slab = heap->slabs; slab != heap->sealed; slab = slab->next) {
+	memset(slab->marks, 0, SLAB_MARK_BYTES);
+  }
+}
+
+void slabSeal(SlabHeap *heap) {
+  for (int i = 0; i < SLAB_CLASSES; i++) {
+	heap->free[i] = NULL;
+	heap->returned[i] = NULL;
+  }
+  heap->sealed = heap->slabs;
+}
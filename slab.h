@@ -0,0 +1,63 @@
+#ifndef CLOX_SLAB_H
+#define CLOX_SLAB_H
+
+#include "common.h"
+
+// Size-class allocator for old-space objects. Sizes are rounded up to
+// SLAB_GRANULE and every class keeps a free list of blocks carved out of
+// SLAB_SIZE slabs that hold that class only. Anything larger than
+// SLAB_MAX_BLOCK goes to malloc.
+//
+// Slabs are aligned to their size, and the mark bits of their blocks live
+// in a bitmap allocated apart from the slab, one bit per granule. Marking
+// and sweeping never write to the blocks themselves, so pages shared with
+// a forked parent stay shared.
+#define SLAB_SIZE      4096
+#define SLAB_GRANULE   8
+#define SLAB_MAX_BLOCK 256
+#define SLAB_CLASSES   (SLAB_MAX_BLOCK / SLAB_GRANULE)
+
+typedef struct Slab {
+  struct Slab *next;
+  uint8_t *marks;
+} Slab;
+
+#define SLAB_MARK_BYTES (SLAB_SIZE / SLAB_GRANULE / 8)
+
+typedef struct SlabBlock {
+  struct SlabBlock *next;
+} SlabBlock;
+
+typedef struct {
+  SlabBlock *free[SLAB_CLASSES];
+  // Blocks freed by another thread, taken over by the owner once free of
+  // the same class runs out.
+  SlabBlock *returned[SLAB_CLASSES];
+  Slab *slabs;
+  // Slabs from here on were sealed by slabSeal.
+  Slab *sealed;
+  int slabCount;
+} SlabHeap;
+
+// Mark byte and bit of a block returned by slabAllocate.
+static inline uint8_t *slabMarkByte(void *block, uint8_t *mask) {
+  Slab *slab = (Slab *)((uintptr_t)block & ~(uintptr_t)(SLAB_SIZE - 1));
+  size_t granule = ((uintptr_t)block & (SLAB_SIZE - 1)) / SLAB_GRANULE;
+  *mask = (uint8_t)(1 << (granule & 7));
+  return &slab->marks[granule >> 3];
+}
+
+void initSlabHeap(SlabHeap *heap);
+void freeSlabHeap(SlabHeap *heap);
+void *slabAllocate(SlabHeap *heap, size_t size);
+// size must be the one the block was allocated with.
+void slabFree(SlabHeap *heap, void *block, size_t size);
+// slabFree for threads other than the one allocating from heap.
+void slabFreeShared(SlabHeap *heap, void *block, size_t size);
+// Clears the mark bits of every slab that isn't sealed.
+void slabClearMarks(SlabHeap *heap);
+// Stops allocating from the slabs there are so far. Their free blocks are
+// given up so that their pages are never written again.
+void slabSeal(SlabHeap *heap);
+
+#endif
@@ -0,0 +1,67 @@
+#include "sweeper.h"
+#include "memory.h"
+
+static void *sweepThread(void *arg) {
+  Sweeper *sweeper = arg;
+  double start = gcNow();
+  Obj *survivors = NULL;
+  Obj *tail = NULL;
+  Obj *deadOwners = NULL;
+  size_t freed = 0;
+  for (int type = 0; type < OBJ_TYPE_COUNT; type++) {
+	sweeper->freedByType[type] = 0;
+  }
+
+  Obj *obj = sweeper->list;
+  while (obj != NULL) {
+	Obj *next = obj->next;
+	if (isMarkedObject(obj)) {
+	  if (!obj->inSlab) obj->isMarked = false;
+	  obj->next = NULL;
+	  if (tail == NULL) {
+		survivors = obj;
+	  } else {
+		tail->next = obj;
+	  }
+	  tail = obj;
+	} else if (ownsMemory(obj->type)) {
+	  obj->next = deadOwners;
+	  deadOwners = obj;
+	} else {
+	  size_t size = objectSize(obj);
+	  freed += size;
+	  sweeper->freedByType[obj->type] += size;
+	  slabFreeShared(sweeper->heap, obj, size);
+	}
+	obj = next;
+  }
+
+  sweeper->survivors = survivors;
+  sweeper->survivorsTail = tail;
+  sweeper->deadOwners = deadOwners;
+  sweeper->freedBytes = freed;
+  sweeper->seconds = gcNow() - start;
+  __atomic_store_n(&sweeper->done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+void startSweeper(Sweeper *sweeper, SlabHeap *heap, Obj *list) {
+  sweeper->heap = heap;
+  sweeper->list = list;
+  sweeper->done = 0;
+  sweeper->running = true;
+  if (pthread_create(&sweeper->thread, NULL, sweepThread, sweeper) != 0) {
+	// No thread, sweep on this one.
+	sweepThread(sweeper);
+	sweeper->running = false;
+  }
+}
+
+bool sweeperDone(Sweeper *sweeper) {
+  return __atomic_load_n(&sweeper->done, __ATOMIC_ACQUIRE);
+}
+
+void joinSweeper(Sweeper *sweeper) {
+  if (sweeper->running) pthread_join(sweeper->thread, NULL);
+  sweeper->running = false;
+}
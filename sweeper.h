@@ -0,0 +1,38 @@
+#ifndef CLOX_SWEEPER_H
+#define CLOX_SWEEPER_H
+
+#include <pthread.h>
+
+#include "common.h"
+#include "clox.h"
+#include "object.h"
+#include "slab.h"
+
+// Background sweeping. When marking ends, the old-space list is detached
+// from vm->first and handed to a thread that frees its unmarked objects
+// while the mutator keeps running. Everything allocated or promoted in the
+// meantime goes on a fresh vm->first and is live by construction. The
+// sweeper only touches dead objects, which nothing can reach anymore, and
+// the mark bits of the survivors, which the mutator doesn't read outside
+// of marking. Objects that own memory besides their block are handed
+// back and freed by the VM.
+typedef struct {
+  pthread_t thread;
+  bool running;
+  int done;                // set by the thread, read atomically
+  SlabHeap *heap;
+  Obj *list;               // the detached list being swept
+  Obj *survivors;
+  Obj *survivorsTail;
+  Obj *deadOwners;
+  size_t freedBytes;
+  size_t freedByType[OBJ_TYPE_COUNT];
+  double seconds;
+} Sweeper;
+
+void startSweeper(Sweeper *sweeper, SlabHeap *heap, Obj *list);
+bool sweeperDone(Sweeper *sweeper);
+// Waits for the thread. The results are left in sweeper for the VM.
+void joinSweeper(Sweeper *sweeper);
+
+#endif
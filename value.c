@@ -32,12 +32,17 @@ void printValue(Value value) {
 	printf("nil");
   } else if (IS_NUMBER(value)) {
 	printf("%g", AS_NUM(value));
+  } else if (IS_SMALL_STRING(value)) {
+	char chars[SMALL_STRING_MAX + 1];
+	smallStringChars(value, chars);
+	printf("%s", chars);
   } else if (IS_OBJ(value)) {
 	printObject(value);
   }
 }
 
 bool valueEqual(Value a, Value b) {
+  if (IS_INT(a) && IS_INT(b)) return a == b;
   if (IS_NUMBER(a) && IS_NUMBER(b)) return AS_NUM(a) == AS_NUM(b);
   return a == b;
 }
\ No newline at end of file
@@ -9,6 +9,20 @@
 #define TAG_NIL    1
 #define TAG_FALSE  2
 #define TAG_TRUE   3
+#define TAG_UNDEFINED 4
+// Strings of up to SMALL_STRING_MAX bytes live in the value itself: the
+// length in bits 40-42 and the bytes in bits 0-39, first byte lowest.
+// Every string that short is made this way, so they compare by their bits
+// like interned ones and never reach the heap.
+#define TAG_SMALL_STRING ((uint64_t)1 << 48)
+#define SMALL_STRING_MAX 5
+// Numbers are doubles or 32-bit integers in the low bits under TAG_INT.
+// Integer literals, and integer results of ADD, SUBTRACT, MULTIPLY and
+// NEGATE on integers, are integers. Anything else, overflow and -0
+// included, is a double with the same value, so the two only differ in
+// speed.
+#define TAG_INT ((uint64_t)1 << 49)
+#define TAG_MASK (SIGN_BIT | QNAN | TAG_INT | TAG_SMALL_STRING)
 
 typedef uint64_t Value;
 
@@ -16,25 +30,39 @@ typedef uint64_t Value;
 #define BOOL_VAL(b)  ((b) ? TRUE_VAL : FALSE_VAL)
 #define FALSE_VAL    ((Value)(uint64_t)(QNAN | TAG_FALSE))
 #define TRUE_VAL     ((Value)(uint64_t)(QNAN | TAG_TRUE))
+// Marks a global slot that is referenced but not defined yet. Never
+// reaches the stack.
+#define UNDEFINED_VAL ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
 #define OBJ_VAL(obj) ((Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj)))
 
 #define IS_NIL(v)    ((v) == NIL_VAL)
-#define IS_BOOL(v)   (((v) & FALSE_VAL) == FALSE_VAL)
+#define IS_BOOL(v)   (((v) | 1) == TRUE_VAL)
 #define IS_FALSE(v)  ((v) == FALSE_VAL)
-#define IS_NUMBER(v) (((v) & QNAN) != QNAN)
+#define IS_UNDEFINED(v) ((v) == UNDEFINED_VAL)
+#define IS_DOUBLE(v) (((v) & QNAN) != QNAN)
+// Only ints have these upper 32 bits.
+#define IS_INT(v)    (((v) >> 32) == ((QNAN | TAG_INT) >> 32))
+#define IS_NUMBER(v) (IS_DOUBLE(v) || IS_INT(v))
+#define BOTH_INT(a, b) \
+	((((a) & (b)) >> 32) == ((QNAN | TAG_INT) >> 32) && \
+	 (((a) | (b)) >> 32) == ((QNAN | TAG_INT) >> 32))
 #define IS_OBJ(v)    (((v) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+#define IS_SMALL_STRING(v) (((v) & TAG_MASK) == (QNAN | TAG_SMALL_STRING))
 
 #define NUM_VAL(num)         numToValue(num)
+#define INT_VAL(i)           ((Value)(QNAN | TAG_INT | (uint32_t)(int32_t)(i)))
 #define AS_BOOL(v)           ((v) == TRUE_VAL)
 #define AS_NUM(v)            valueToNum(v)
+#define AS_INT(v)            ((int32_t)(uint32_t)(v))
 #define AS_OBJ(v)            ((Obj*)(uintptr_t)((v) & ~(SIGN_BIT | QNAN)))
 #define AS_FN(v)             ((ObjFn*)AS_OBJ(v))
 #define AS_STRING(v)         ((ObjString*)AS_OBJ(v))
 #define AS_CSTRING(v)        (((ObjString*)AS_OBJ(v))->value)
-#define AS_NATIVE(v)         (((ObjNative*)AS_OBJ(v)))->fn
+#define AS_NATIVE(v)         ((ObjNative*)AS_OBJ(v))
 #define AS_CLOSURE(v)        ((ObjClosure*)AS_OBJ(v))
 
 #define OBJ_TYPE(value)      (AS_OBJ(value)->type)
+#define SMALL_STRING_LENGTH(v) ((uint32_t)(((v) >> 40) & 7))
 
 typedef union {
   uint64_t bits;
@@ -48,11 +76,83 @@ static inline Value numToValue(double num) {
 }
 
 static inline double valueToNum(Value v) {
+  if (IS_INT(v)) return AS_INT(v);
   DoubleUnion data;
   data.bits = v;
   return data.num;
 }
 
+// An integer when num is one, for numbers parsed or read back.
+static inline Value numberValue(double num) {
+  if (num >= INT32_MIN && num <= INT32_MAX && num == (int32_t)num &&
+	  numToValue(num) != SIGN_BIT) {
+	return INT_VAL((int32_t)num);
+  }
+  return NUM_VAL(num);
+}
+
+// Arithmetic on numbers. Operands that aren't numbers are read as doubles,
+// like the interpreter always did.
+static inline Value addNumbers(Value a, Value b) {
+  int32_t result;
+  if (BOTH_INT(a, b) &&
+	  !__builtin_add_overflow(AS_INT(a), AS_INT(b), &result)) {
+	return INT_VAL(result);
+  }
+  return NUM_VAL(AS_NUM(a) + AS_NUM(b));
+}
+
+static inline Value subtractNumbers(Value a, Value b) {
+  int32_t result;
+  if (BOTH_INT(a, b) &&
+	  !__builtin_sub_overflow(AS_INT(a), AS_INT(b), &result)) {
+	return INT_VAL(result);
+  }
+  return NUM_VAL(AS_NUM(a) - AS_NUM(b));
+}
+
+// A zero product with a negative operand is -0.
+static inline Value multiplyNumbers(Value a, Value b) {
+  int32_t result;
+  if (BOTH_INT(a, b) &&
+	  !__builtin_mul_overflow(AS_INT(a), AS_INT(b), &result) &&
+	  (result != 0 || (AS_INT(a) | AS_INT(b)) >= 0)) {
+	return INT_VAL(result);
+  }
+  return NUM_VAL(AS_NUM(a) * AS_NUM(b));
+}
+
+static inline Value divideNumbers(Value a, Value b) {
+  return NUM_VAL(AS_NUM(a) / AS_NUM(b));
+}
+
+static inline Value negateNumber(Value a) {
+  if (IS_INT(a) && AS_INT(a) != 0 && AS_INT(a) != INT32_MIN) {
+	return INT_VAL(-AS_INT(a));
+  }
+  return NUM_VAL(-AS_NUM(a));
+}
+
+static inline bool numberLess(Value a, Value b) {
+  if (BOTH_INT(a, b)) return AS_INT(a) < AS_INT(b);
+  return AS_NUM(a) < AS_NUM(b);
+}
+
+static inline Value smallString(const char *chars, size_t length) {
+  uint64_t bits = 0;
+  for (size_t i = 0; i < length; i++) {
+	bits |= (uint64_t)(uint8_t)chars[i] << (i * 8);
+  }
+  return QNAN | TAG_SMALL_STRING | ((uint64_t)length << 40) | bits;
+}
+
+// Copies the bytes of a small string to dest and terminates them.
+static inline void smallStringChars(Value value, char *dest) {
+  uint32_t length = SMALL_STRING_LENGTH(value);
+  for (uint32_t i = 0; i < length; i++) dest[i] = (char)(value >> (i * 8));
+  dest[length] = '\0';
+}
+
 typedef struct {
   int capacity;
   int count;
@@ -66,4 +166,4 @@ void freeValueArray(VM *vm, ValueArray *array);
 void printValue(Value value);
 bool valueEqual(Value a, Value b);
 
-#endif
\ No newline at end of file
+#endif
\ No newline at end of file
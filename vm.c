@@ -1,22 +1,249 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
 #include "vm.h"
 #include "debug.h"
 #include "memory.h"
+#include "lower.h"
+#include "jit.h"
 
-static void defineNative(VM *vm, const char* name, NativeFn fn) {
-  *vm->sp++ = OBJ_VAL(newStringLength(vm, name, (int)strlen(name)));
-  *vm->sp++ = OBJ_VAL(newNative(vm, fn));
-  tableSet(vm, &vm->globals, AS_STRING(vm->stack[0]), vm->stack[1]);
-  vm->sp -= 2;
+// Returns the slot for the global name, reserving an undefined one the
+// first time the name is seen, or -1 once GLOBAL_MAX slots are taken.
+int globalSlot(VM *vm, Value name) {
+  Value slot;
+  if (tableGet(&vm->globalNames, name, &slot)) return (int)AS_NUM(slot);
+  if (vm->globalValues.count == GLOBAL_MAX) return -1;
+  *vm->sp++ = name;
+  int index = vm->globalValues.count;
+  writeValueArray(vm, &vm->globalValues, UNDEFINED_VAL);
+  int cards = (index >> GLOBAL_CARD_SHIFT) + 1;
+  if (cards > vm->globalCardCount) {
+	uint8_t *globalCards = realloc(vm->globalCards, cards);
+	if (globalCards == NULL) exit(1);
+	vm->globalCards = globalCards;
+	vm->globalCards[cards - 1] = 0;
+	vm->globalCardCount = cards;
+  }
+  tableSet(vm, &vm->globalNames, name, NUM_VAL(index));
+  vm->sp--;
+  return index;
+}
+
+static bool clockNative(VM *vm, int argCount, Value *args, Value *result) {
+  (void)vm;
+  (void)argCount;
+  (void)args;
+  *result = NUM_VAL((double)clock() / CLOCKS_PER_SEC);
+  return true;
+}
+
+// gcStat(name) and gcStat(name, arg) read vm->telemetry, nil when it is
+// off or the name is unknown. "pauses" takes a bucket, "allocated" and
+// "freed" an object type name or nothing for the total, "liveBytes",
+// "nextGC" and "time" how many samples back, 0 by default.
+static Value gcStat(VM *vm, int argCount, Value* args) {
+  GcTelemetry *telemetry = vm->telemetry;
+  if (telemetry == NULL || isObjType(args[0], OBJ_ROPE) ||
+	  !isString(args[0])) {
+	return NIL_VAL;
+  }
+  char nameBuffer[SMALL_STRING_MAX + 1];
+  const char *name = stringChars(args[0], nameBuffer);
+  Value arg = argCount > 1 ? args[1] : NIL_VAL;
+
+  if (strcmp(name, "collections") == 0) {
+	return NUM_VAL(telemetry->collections);
+  }
+  if (strcmp(name, "pauses") == 0) {
+	if (!IS_NUMBER(arg)) return NIL_VAL;
+	int bucket = (int)AS_NUM(arg);
+	if (bucket < 0 || bucket >= GC_PAUSE_BUCKETS) return NIL_VAL;
+	return NUM_VAL(telemetry->pauses[bucket]);
+  }
+  if (strcmp(name, "allocated") == 0 || strcmp(name, "freed") == 0) {
+	size_t *bytes = name[0] == 'a' ? telemetry->allocatedBytes
+								   : telemetry->freedBytes;
+	double total = 0;
+	for (int type = 0; type < OBJ_TYPE_COUNT; type++) {
+	  if (IS_NIL(arg)) {
+		total += bytes[type];
+	  } else if (isString(arg) && !isObjType(arg, OBJ_ROPE) &&
+				 strcmp(stringChars(arg, nameBuffer), objTypeName(type)) == 0) {
+		return NUM_VAL(bytes[type]);
+	  }
+	}
+	return IS_NIL(arg) ? NUM_VAL(total) : NIL_VAL;
+  }
+  GcSample *sample = gcSample(telemetry, IS_NUMBER(arg) ? (int)AS_NUM(arg) : 0);
+  if (sample == NULL) return NIL_VAL;
+  if (strcmp(name, "liveBytes") == 0) return NUM_VAL(sample->liveBytes);
+  if (strcmp(name, "nextGC") == 0) return NUM_VAL(sample->nextGC);
+  if (strcmp(name, "time") == 0) return NUM_VAL(sample->time);
+  return NIL_VAL;
+}
+
+static bool gcStatNative(VM *vm, int argCount, Value *args, Value *result) {
+  *result = gcStat(vm, argCount, args);
+  return true;
+}
+
+static bool stringBuilderNative(VM *vm, int argCount, Value *args,
+								Value *result) {
+  (void)argCount;
+  (void)args;
+  *result = OBJ_VAL(newBuilder(vm));
+  return true;
+}
+
+// append(builder, value) returns the builder.
+static bool appendNative(VM *vm, int argCount, Value *args, Value *result) {
+  (void)argCount;
+  if (!isObjType(args[0], OBJ_BUILDER)) {
+	return nativeError(vm, "append() expects a string builder.");
+  }
+  builderAppend(vm, (ObjBuilder *)AS_OBJ(args[0]), args[1]);
+  *result = args[0];
+  return true;
+}
+
+static bool buildNative(VM *vm, int argCount, Value *args, Value *result) {
+  (void)argCount;
+  if (!isObjType(args[0], OBJ_BUILDER)) {
+	return nativeError(vm, "build() expects a string builder.");
+  }
+  *result = builderToString(vm, (ObjBuilder *)AS_OBJ(args[0]));
+  return true;
+}
+
+// len(value) counts the items of a list, the entries of a map or the
+// bytes of a string.
+static bool lenNative(VM *vm, int argCount, Value *args, Value *result) {
+  (void)argCount;
+  if (isObjType(args[0], OBJ_LIST)) {
+	*result = INT_VAL(AS_LIST(args[0])->items.count);
+  } else if (isObjType(args[0], OBJ_MAP)) {
+	*result = INT_VAL(AS_MAP(args[0])->count);
+  } else if (isString(args[0])) {
+	*result = numberValue(stringLength(args[0]));
+  } else {
+	return nativeError(vm, "len() expects a list, map or string.");
+  }
+  return true;
+}
+
+// A count or position argument, clamped to [0, INT32_MAX].
+static int countArg(Value value) {
+  if (!IS_NUMBER(value)) return 0;
+  double count = AS_NUM(value);
+  if (!(count > 0)) return 0;
+  return count < INT32_MAX ? (int)count : INT32_MAX;
+}
+
+static bool listArg(VM *vm, Value value, const char *name) {
+  if (isObjType(value, OBJ_LIST)) return true;
+  return nativeError(vm, "%s() expects a list.", name);
+}
+
+// push(list, values...) appends the values and returns the list.
+static bool pushNative(VM *vm, int argCount, Value *args, Value *result) {
+  if (!listArg(vm, args[0], "push")) return false;
+  for (int i = 1; i < argCount; i++) {
+	listAppend(vm, AS_LIST(args[0]), args[i]);
+  }
+  *result = args[0];
+  return true;
+}
+
+// pop(list) removes the last item and returns it, nil if there is none.
+static bool popNative(VM *vm, int argCount, Value *args, Value *result) {
+  (void)argCount;
+  if (!listArg(vm, args[0], "pop")) return false;
+  ValueArray *items = &AS_LIST(args[0])->items;
+  *result = items->count == 0 ? NIL_VAL : items->values[--items->count];
+  return true;
+}
+
+// slice(list, start) and slice(list, start, end) copy the items in
+// [start, end) to a new list.
+static bool sliceNative(VM *vm, int argCount, Value *args, Value *result) {
+  if (!listArg(vm, args[0], "slice")) return false;
+  ObjList *list = AS_LIST(args[0]);
+  int end = argCount == 3 ? countArg(args[2]) : list->items.count;
+  *result = OBJ_VAL(listSlice(vm, list, countArg(args[1]), end));
+  return true;
+}
+
+// sort(list) sorts numbers or strings in place and returns the list, nil
+// for anything else.
+static bool sortNative(VM *vm, int argCount, Value *args, Value *result) {
+  (void)argCount;
+  if (!listArg(vm, args[0], "sort")) return false;
+  *result = listSort(vm, AS_LIST(args[0])) ? args[0] : NIL_VAL;
+  return true;
+}
+
+// fill(list, value) sets every item to value, fill(list, value, count)
+// also resizes the list to count items. Returns the list.
+static bool fillNative(VM *vm, int argCount, Value *args, Value *result) {
+  if (!listArg(vm, args[0], "fill")) return false;
+  ObjList *list = AS_LIST(args[0]);
+  int count = argCount == 3 ? countArg(args[2]) : list->items.count;
+  listFill(vm, list, args[1], count);
+  *result = args[0];
+  return true;
+}
+
+// keys(map) lists the keys of map in the order they were added.
+static bool keysNative(VM *vm, int argCount, Value *args, Value *result) {
+  (void)argCount;
+  if (!isObjType(args[0], OBJ_MAP)) {
+	return nativeError(vm, "keys() expects a map.");
+  }
+  ObjMap *map = AS_MAP(args[0]);
+  ObjList *list = newList(vm);
+  for (int i = 0; i < map->keys.count; i++) {
+	if (IS_NIL(map->keys.values[i])) continue;
+	listAppend(vm, list, map->keys.values[i]);
+  }
+  *result = OBJ_VAL(list);
+  return true;
 }
 
-static Value clockNative(int argCount, Value* args) {
-  return NUM_VAL((double)clock() / CLOCKS_PER_SEC);
+// has(map, key) tells whether key has an entry, nil for keys that can't
+// be in a map.
+static bool hasNative(VM *vm, int argCount, Value *args, Value *result) {
+  (void)argCount;
+  if (!isObjType(args[0], OBJ_MAP)) {
+	return nativeError(vm, "has() expects a map.");
+  }
+  Value key, value;
+  *result = mapKey(vm, args[1], &key)
+	  ? BOOL_VAL(mapGet(AS_MAP(args[0]), key, &value)) : NIL_VAL;
+  return true;
 }
 
+static const NativeDef coreNatives[] = {
+	{"clock", clockNative, 0, 0},
+	{"gcStat", gcStatNative, 1, 2},
+	{"stringBuilder", stringBuilderNative, 0, 0},
+	{"append", appendNative, 2, 2},
+	{"build", buildNative, 1, 1},
+	{"len", lenNative, 1, 1},
+	{"push", pushNative, 1, NATIVE_VARIADIC},
+	{"pop", popNative, 1, 1},
+	{"slice", sliceNative, 2, 3},
+	{"sort", sortNative, 1, 1},
+	{"fill", fillNative, 2, 3},
+	{"keys", keysNative, 1, 1},
+	{"has", hasNative, 2, 2},
+	{NULL, NULL, 0, 0}
+};
+
+static const NativeModule coreModule = {NATIVE_API_VERSION, "core",
+										coreNatives};
+
 static void resetStack(VM *vm) {
   vm->sp = vm->stack;
   vm->frameCount = 0;
@@ -24,23 +251,77 @@ static void resetStack(VM *vm) {
 }
 
 void initVM(VM *vm) {
+  vm->frameBlocks = NULL;
+  vm->frameBlockCount = 0;
+  vm->frameLimit = 0;
+  vm->maxFrames = FRAME_MAX_DEFAULT;
+  vm->stack = malloc(sizeof(Value) * STACK_INITIAL);
+  vm->stackEnd = vm->stack + STACK_INITIAL;
   resetStack(vm);
   vm->first = NULL;
+  vm->frozen = NULL;
+  vm->frozenRoots = NULL;
+  vm->frozenRootCount = 0;
+  vm->frozenRootCapacity = 0;
   vm->bytesAllocated = 0;
-  vm->nextGC = 1024 * 1024;
+  initGcConfig(&vm->gcConfig);
+  vm->nextGC = vm->gcConfig.initialHeap;
   vm->compiler = NULL;
+  vm->backend = BACKEND_STACK;
+  vm->optLevel = 2;
+  vm->jitEnabled = JIT_SUPPORTED;
+  vm->jitDepth = 0;
   vm->grayCount = 0;
   vm->grayCapacity = 0;
   vm->grayStack = NULL;
-  initTable(&vm->globals);
+  vm->nursery.start = malloc(NURSERY_SIZE);
+  vm->nursery.top = vm->nursery.start;
+  vm->nursery.end = vm->nursery.start + NURSERY_SIZE;
+  initSlabHeap(&vm->slabs);
+  vm->remembered = NULL;
+  vm->rememberedCount = 0;
+  vm->rememberedCapacity = 0;
+  vm->globalCards = NULL;
+  vm->globalCardCount = 0;
+  vm->gcRequested = false;
+  memset(&vm->gcStats, 0, sizeof(vm->gcStats));
+  vm->pacer.time = gcNow();
+  vm->pacer.majorSeconds = 0;
+  vm->pacer.oldBytes = 0;
+  vm->telemetry = NULL;
+  vm->gcPhase = GC_IDLE;
+  vm->gcBudget = GC_DEFAULT_BUDGET;
+  vm->sweepPrevious = NULL;
+  vm->sweepCursor = NULL;
+  vm->markThreads = 1;
+  vm->sweepInBackground = true;
+  vm->sweeper.running = false;
+  vm->marker = NULL;
+#if DEBUG_COUNT_DISPATCH
+  vm->dispatchCount = 0;
+#endif
+  initTable(&vm->globalNames);
+  initValueArray(&vm->globalValues);
   initTable(&vm->strings);
-  defineNative(vm, "clock", clockNative);
+  initValueArray(&vm->handles);
+  vm->error[0] = '\0';
+  defineNativeModule(vm, &coreModule);
 }
 
 void freeVM(VM *vm) {
-  freeTable(vm, &vm->globals);
+#if DEBUG_COUNT_DISPATCH
+  fprintf(stderr, "%llu instructions dispatched\n",
+		  (unsigned long long)vm->dispatchCount);
+#endif
+  freeTable(vm, &vm->globalNames);
+  freeValueArray(vm, &vm->globalValues);
   freeTable(vm, &vm->strings);
+  freeValueArray(vm, &vm->handles);
   freeObjects(vm);
+  free(vm->globalCards);
+  for (int i = 0; i < vm->frameBlockCount; i++) free(vm->frameBlocks[i]);
+  free(vm->frameBlocks);
+  free(vm->stack);
 }
 
 static void printStack(VM *vm) {
@@ -53,28 +334,117 @@ static void printStack(VM *vm) {
   printf("\n");
 }
 
-static bool call(VM *vm, ObjClosure * closure, int argCount) {
+// Moves the stack to an array of at least needed values, pointing the
+// frames, vm->sp and the open upvalues into it.
+static void growStack(VM *vm, size_t needed) {
+  size_t capacity = (size_t)(vm->stackEnd - vm->stack) * 2;
+  while (capacity < needed) capacity *= 2;
+  Value *old = vm->stack;
+  Value *stack = malloc(sizeof(Value) * capacity);
+  if (stack == NULL) exit(1);
+  memcpy(stack, old, sizeof(Value) * (vm->sp - old));
+  for (int i = 0; i < vm->frameCount; i++) {
+    CallFrame *frame = frameAt(vm, i);
+    frame->slots = stack + (frame->slots - old);
+  }
+  for (ObjUpvalue *upvalue = vm->openUpvalues; upvalue != NULL;
+       upvalue = upvalue->next) {
+    upvalue->location = stack + (upvalue->location - old);
+  }
+  vm->sp = stack + (vm->sp - old);
+  vm->stack = stack;
+  vm->stackEnd = stack + capacity;
+  free(old);
+}
+
+// Makes room for count values above vm->sp. Growing moves the stack, so
+// pointers into it that aren't fixed up by growStack must be taken again.
+static inline void reserveStack(VM *vm, int count) {
+  if (vm->stackEnd - vm->sp < count) {
+    growStack(vm, (size_t)(vm->sp - vm->stack) + count);
+  }
+}
+
+// Allocates the next block of frames, false once the frames would go
+// deeper than vm->maxFrames. frameLimit is where this is checked again.
+static bool growFrames(VM *vm) {
+  if (vm->frameCount >= vm->maxFrames) {
+    snprintf(vm->error, sizeof(vm->error), "Stack overflow.");
+    return false;
+  }
+  if (vm->frameCount == vm->frameBlockCount * FRAME_BLOCK) {
+    CallFrame **blocks = realloc(
+        vm->frameBlocks, sizeof(CallFrame *) * (vm->frameBlockCount + 1));
+    CallFrame *block = malloc(sizeof(CallFrame) * FRAME_BLOCK);
+    if (blocks == NULL || block == NULL) exit(1);
+    vm->frameBlocks = blocks;
+    vm->frameBlocks[vm->frameBlockCount++] = block;
+  }
+  vm->frameLimit = vm->frameBlockCount * FRAME_BLOCK;
+  if (vm->frameLimit > vm->maxFrames) vm->frameLimit = vm->maxFrames;
+  return true;
+}
+
+// Pushes a frame for closure whose callee and arguments start at slots.
+static bool callAt(VM *vm, ObjClosure *closure, int argCount, Value *slots) {
   if (argCount != closure->fn->arity) {
     return false;
   }
-  if (vm->frameCount == FRAME_MAX) {
+  if (vm->frameCount >= vm->frameLimit && !growFrames(vm)) {
     return false;
   }
-  CallFrame *frame = &vm->frames[vm->frameCount++];
+  if (vm->stackEnd - vm->sp < FRAME_SLOTS) {
+    ptrdiff_t base = slots - vm->stack;
+    reserveStack(vm, FRAME_SLOTS);
+    slots = vm->stack + base;
+  }
+  CallFrame *frame = frameAt(vm, vm->frameCount++);
   frame->closure = closure;
   frame->ip = closure->fn->chunk.code;
-  frame->slots = vm->sp - argCount - 1;
+  frame->slots = slots;
   return true;
 }
 
+static bool call(VM *vm, ObjClosure * closure, int argCount) {
+  return callAt(vm, closure, argCount, vm->sp - argCount - 1);
+}
+
+// Calls native on the argCount arguments at args once they match its
+// arity. The handles it makes are released when it returns.
+static bool callNative(VM *vm, ObjNative *native, int argCount, Value *args,
+                       Value *result) {
+  if (argCount < native->minArity ||
+      (native->maxArity != NATIVE_VARIADIC && argCount > native->maxArity)) {
+    if (native->maxArity == NATIVE_VARIADIC) {
+      return nativeError(vm, "%s() takes at least %d arguments but got %d.",
+                         native->name, native->minArity, argCount);
+    }
+    if (native->minArity == native->maxArity) {
+      return nativeError(vm, "%s() takes %d arguments but got %d.",
+                         native->name, native->minArity, argCount);
+    }
+    return nativeError(vm, "%s() takes %d to %d arguments but got %d.",
+                       native->name, native->minArity, native->maxArity,
+                       argCount);
+  }
+  int mark = handleMark(vm);
+  *result = NIL_VAL;
+  bool ok = native->fn(vm, argCount, args, result);
+  releaseHandles(vm, mark);
+  return ok;
+}
+
 static bool callValue(VM *vm, Value callee, int argCount) {
   if (IS_OBJ(callee)) {
 	switch (OBJ_TYPE(callee)) {
 	  case OBJ_CLOSURE:
 	    return call(vm, AS_CLOSURE(callee), argCount);
 	  case OBJ_NATIVE: {
-	    NativeFn native = AS_NATIVE(callee);
-	    Value result = native(argCount, vm->sp - argCount);
+	    Value result;
+	    if (!callNative(vm, AS_NATIVE(callee), argCount, vm->sp - argCount,
+	                    &result)) {
+	      return false;
+	    }
 	    vm->sp -= argCount + 1;
 	    *vm->sp++ = result;
 	    return true;
@@ -86,6 +456,79 @@ static bool callValue(VM *vm, Value callee, int argCount) {
   return false;
 }
 
+// The slow path of the adds, taken when the left operand isn't a number.
+// Two strings are concatenated, anything else is added as numbers.
+static Value addObjects(VM *vm, Value a, Value b) {
+  if (isString(a) && isString(b)) return concatenate(vm, a, b);
+  return addNumbers(a, b);
+}
+
+// Ropes compare by their flat strings.
+static bool valuesEqual(VM *vm, Value a, Value b) {
+  if (isObjType(a, OBJ_ROPE) || isObjType(b, OBJ_ROPE)) {
+	a = flatValue(vm, a);
+	b = flatValue(vm, b);
+  }
+  return valueEqual(a, b);
+}
+
+// container[index], false if container isn't a list or a map, index isn't
+// a position in the list or can't be a key. Missing keys give nil.
+static inline bool getIndex(VM *vm, Value container, Value index,
+                            Value *result) {
+  if (isObjType(container, OBJ_LIST)) {
+    ObjList *list = AS_LIST(container);
+    int position = listPosition(list, index);
+    if (position < 0) return false;
+    *result = list->items.values[position];
+    return true;
+  }
+  if (!isObjType(container, OBJ_MAP)) return false;
+  Value key;
+  if (!mapKey(vm, index, &key)) return false;
+  if (!mapGet(AS_MAP(container), key, result)) *result = NIL_VAL;
+  return true;
+}
+
+static bool setIndex(VM *vm, Value container, Value index, Value value) {
+  if (isObjType(container, OBJ_MAP)) {
+    Value key;
+    if (!mapKey(vm, index, &key)) return false;
+    mapSet(vm, AS_MAP(container), key, value);
+    return true;
+  }
+  if (!isObjType(container, OBJ_LIST)) return false;
+  ObjList *list = AS_LIST(container);
+  int position = listPosition(list, index);
+  if (position < 0) return false;
+  list->items.values[position] = value;
+  WRITE_BARRIER(vm, list, value);
+  return true;
+}
+
+// delete container[index], only maps have entries to delete.
+static bool deleteIndex(VM *vm, Value container, Value index) {
+  Value key;
+  if (!isObjType(container, OBJ_MAP) || !mapKey(vm, index, &key)) {
+    return false;
+  }
+  mapDelete(vm, AS_MAP(container), key);
+  return true;
+}
+
+// A map of the count keys and values alternating from entries, false if
+// a key is invalid. Later duplicates win.
+static bool buildMap(VM *vm, Value *entries, int count, Value *result) {
+  ObjMap *map = newMap(vm);
+  for (int i = 0; i < count; i++) {
+    Value key;
+    if (!mapKey(vm, entries[2 * i], &key)) return false;
+    mapSet(vm, map, key, entries[2 * i + 1]);
+  }
+  *result = OBJ_VAL(map);
+  return true;
+}
+
 static ObjUpvalue *captureUpvalue(VM *vm, Value *local) {
   ObjUpvalue *prevUpvalue = NULL;
   ObjUpvalue *upvalue = vm->openUpvalues;
@@ -111,13 +554,30 @@ static void closeUpvalues(VM *vm, const Value* last) {
 	  vm->openUpvalues->location >= last) {
 	ObjUpvalue* upvalue = vm->openUpvalues;
 	upvalue->closed = *upvalue->location;
+	WRITE_BARRIER(vm, upvalue, upvalue->closed);
 	upvalue->location = &upvalue->closed;
 	vm->openUpvalues = upvalue->next;
   }
 }
 
-static InterpretResult run(VM *vm) {
-  CallFrame* frame = &vm->frames[vm->frameCount - 1];
+static InterpretResult runFrame(VM *vm, CallFrame *frame, int offset);
+
+// True once fn has native code, compiling it when its counter crosses the
+// threshold, unless JIT_MAX_DEPTH compiled frames are running already.
+static bool jitHot(VM *vm, ObjFn *fn, int *counter, int threshold) {
+  if (fn->jit == NULL) {
+    if (!vm->jitEnabled || fn->jitFailed) return false;
+    if (++*counter < threshold) return false;
+    if (!jitCompile(vm, fn)) return false;
+  }
+  return vm->jitDepth < JIT_MAX_DEPTH;
+}
+
+// Interprets until the frame at index baseFrame returns. Frames above it
+// that turn hot run natively through runFrame, which re-enters here for
+// callees that are still interpreted.
+static InterpretResult run(VM *vm, int baseFrame) {
+  CallFrame* frame = frameAt(vm, vm->frameCount - 1);
   register uint8_t* ip = frame->ip;
 
   #define READ_BYTE()     (*ip++)
@@ -128,12 +588,11 @@ static InterpretResult run(VM *vm) {
   #define pop()           (*(--vm->sp))
   #define peek()          (*(vm->sp - 1))
   #define peekN(n)        (*(vm->sp - 1 - (n)))
-  #define BINARY_OP(type, op)             \
+  #define BINARY_OP(fn)                   \
   	do                              \
   	{                               \
-  		double b = AS_NUM(pop());   \
-  		double a = AS_NUM(pop());   \
-  		push(type(a op b));      \
+  		Value b = pop();            \
+  		peek() = fn(peek(), b);     \
     }                               \
     while (false)
 
@@ -156,10 +615,16 @@ static InterpretResult run(VM *vm) {
   };
   #define INTERPRET_LOOP DISPATCH();
   #define CASE(name)  op_##name
+  #if DEBUG_COUNT_DISPATCH
+    #define count_dispatch() (vm->dispatchCount++)
+  #else
+    #define count_dispatch() do { } while (false)
+  #endif
   #define DISPATCH()                                            \
       do                                                        \
       {                                                         \
       	debug_trace();                                          \
+      	count_dispatch();                                       \
         goto *dispatchTable[READ_BYTE()];                       \
       }                                                         \
       while (false)
@@ -172,37 +637,47 @@ static InterpretResult run(VM *vm) {
       DISPATCH();
     }
     CASE(CONSTANT_LONG): {
-      //TODO
+      uint32_t index = READ_BYTE();
+      index |= READ_BYTE() << 8;
+      index |= READ_BYTE() << 16;
+      push(frame->closure->fn->chunk.constants.values[index]);
       DISPATCH();
     }
     CASE(ADD): {
-      BINARY_OP(NUM_VAL, +);
+      if (!IS_NUMBER(peekN(1))) {
+        Value b = pop();
+        peek() = addObjects(vm, peek(), b);
+        DISPATCH();
+      }
+      BINARY_OP(addNumbers);
       DISPATCH();
     }
     CASE(SUBTRACT): {
-      BINARY_OP(NUM_VAL, -);
+      BINARY_OP(subtractNumbers);
       DISPATCH();
     }
     CASE(NEGATE): {
-      push(NUM_VAL(-(AS_NUM(pop()))));
+      peek() = negateNumber(peek());
       DISPATCH();
     }
     CASE(MULTIPLY): {
-      BINARY_OP(NUM_VAL, *);
+      BINARY_OP(multiplyNumbers);
       DISPATCH();
     }
     CASE(DIVIDE): {
-      BINARY_OP(NUM_VAL, /);
+      BINARY_OP(divideNumbers);
       DISPATCH();
     }
     CASE(LESS): {
-      BINARY_OP(BOOL_VAL, <);
+      Value b = pop();
+      peek() = BOOL_VAL(numberLess(peek(), b));
       DISPATCH();
     }
     CASE(EQ): {
       Value b = pop();
       Value a = pop();
-      push(BOOL_VAL(valueEqual(a, b)));
+      push(BOOL_VAL(IS_INT(a) && IS_INT(b) ? a == b
+                                           : valuesEqual(vm, a, b)));
       DISPATCH();
     }
     CASE(NIL): {
@@ -218,7 +693,7 @@ static InterpretResult run(VM *vm) {
       DISPATCH();
     }
     CASE(PRINT): {
-      printValue(pop());
+      printValue(flatValue(vm, pop()));
       printf("\n");
       DISPATCH();
     }
@@ -227,26 +702,27 @@ static InterpretResult run(VM *vm) {
       DISPATCH();
     }
     CASE(DEFINE_GLOBAL): {
-      ObjString *name = READ_STRING();
-      tableSet(vm, &vm->globals, name, peek());
+      uint16_t slot = READ_SHORT();
+      vm->globalValues.values[slot] = peek();
+      MARK_GLOBAL_CARD(vm, slot);
       pop();
       DISPATCH();
     }
     CASE(GET_GLOBAL): {
-      ObjString *name = READ_STRING();
-      Value value;
-      if (!tableGet(&vm->globals, name, &value))
+      uint16_t slot = READ_SHORT();
+      Value value = vm->globalValues.values[slot];
+      if (IS_UNDEFINED(value))
         return INTERPRET_RUNTIME_ERROR;
       push(value);
       DISPATCH();
     }
     CASE(SET_GLOBAL): {
-      ObjString *name = READ_STRING();
-      if (tableSet(vm, &vm->globals, name, peek())) {
-        // Is a new global.
-        tableDelete(&vm->globals, name);
+      uint16_t slot = READ_SHORT();
+      // Assigning doesn't define a global.
+      if (IS_UNDEFINED(vm->globalValues.values[slot]))
         return INTERPRET_RUNTIME_ERROR;
-      }
+      vm->globalValues.values[slot] = peek();
+      MARK_GLOBAL_CARD(vm, slot);
       DISPATCH();
     }
     CASE(GET_LOCAL): {
@@ -265,8 +741,9 @@ static InterpretResult run(VM *vm) {
       DISPATCH();
     }
     CASE(SET_UPVALUE): {
-      uint8_t slot = READ_BYTE();
-      *frame->closure->upvalues[slot]->location = peek();
+      ObjUpvalue *upvalue = frame->closure->upvalues[READ_BYTE()];
+      *upvalue->location = peek();
+      WRITE_BARRIER(vm, upvalue, peek());
       DISPATCH();
     }
     CASE(CLOSE_UPVALUE): {
@@ -289,15 +766,41 @@ static InterpretResult run(VM *vm) {
     CASE(LOOP): {
       uint16_t offset = READ_SHORT();
       ip -= offset;
+      if (vm->gcRequested && !collectGarbage(vm)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      ObjFn *fn = frame->closure->fn;
+      if (jitHot(vm, fn, &fn->loopCount, JIT_LOOP_THRESHOLD)) {
+        // Replace the running loop with native code, which finishes the
+        // frame.
+        if (runFrame(vm, frame, (int)(ip - fn->chunk.code)) != INTERPRET_OK) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        if (vm->frameCount == baseFrame) return INTERPRET_OK;
+        frame = frameAt(vm, vm->frameCount - 1);
+        ip = frame->ip;
+      }
       DISPATCH();
     }
     CASE(CALL): {
       int argCount = READ_BYTE();
       frame->ip = ip;
+      if (vm->gcRequested && !collectGarbage(vm)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      int frameCount = vm->frameCount;
       if (!callValue(vm, peekN(argCount), argCount)) {
         return INTERPRET_RUNTIME_ERROR;
       }
-      frame = &vm->frames[vm->frameCount - 1];
+      if (vm->frameCount > frameCount) {
+        CallFrame *callee = frameAt(vm, vm->frameCount - 1);
+        ObjFn *fn = callee->closure->fn;
+        if (jitHot(vm, fn, &fn->callCount, JIT_CALL_THRESHOLD) &&
+            runFrame(vm, callee, 0) != INTERPRET_OK) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+      }
+      frame = frameAt(vm, vm->frameCount - 1);
       ip = frame->ip;
       DISPATCH();
     }
@@ -320,28 +823,125 @@ static InterpretResult run(VM *vm) {
       Value result = pop();
       closeUpvalues(vm, frame->slots);
       vm->frameCount--;
-      if (vm->frameCount == 0) {
-        pop();
-        return INTERPRET_OK;
-      }
       vm->sp = frame->slots;
       push(result);
-      frame = &vm->frames[vm->frameCount - 1];
+      if (vm->frameCount == baseFrame) return INTERPRET_OK;
+      frame = frameAt(vm, vm->frameCount - 1);
       ip = frame->ip;
       DISPATCH();
     }
+    CASE(ADD_LOCALS): {
+      uint8_t a = READ_BYTE();
+      uint8_t b = READ_BYTE();
+      Value left = frame->slots[a];
+      if (!IS_NUMBER(left)) {
+        push(addObjects(vm, left, frame->slots[b]));
+      } else {
+        push(addNumbers(left, frame->slots[b]));
+      }
+      DISPATCH();
+    }
+    CASE(ADD_CONST): {
+      Value constant = READ_CONSTANT();
+      if (!IS_NUMBER(peek())) {
+        peek() = addObjects(vm, peek(), constant);
+      } else {
+        peek() = addNumbers(peek(), constant);
+      }
+      DISPATCH();
+    }
+    CASE(INC_LOCAL): {
+      uint8_t slot = READ_BYTE();
+      frame->slots[slot] = addNumbers(frame->slots[slot], INT_VAL(1));
+      DISPATCH();
+    }
+    CASE(STORE_LOCAL): {
+      uint8_t slot = READ_BYTE();
+      frame->slots[slot] = pop();
+      DISPATCH();
+    }
+    CASE(LESS_LOCAL_CONST_JUMP): {
+      uint8_t slot = READ_BYTE();
+      Value constant = READ_CONSTANT();
+      uint16_t offset = READ_SHORT();
+      if (!numberLess(frame->slots[slot], constant))
+        ip += offset;
+      DISPATCH();
+    }
+    CASE(LESS_LOCALS_JUMP): {
+      uint8_t a = READ_BYTE();
+      uint8_t b = READ_BYTE();
+      uint16_t offset = READ_SHORT();
+      if (!numberLess(frame->slots[a], frame->slots[b]))
+        ip += offset;
+      DISPATCH();
+    }
     CASE(TAIL_CALL): {
       int argCount = READ_BYTE();
+      if (!isObjType(peekN(argCount), OBJ_CLOSURE)) {
+        // Natives don't need a frame, call and return the result.
+        frame->ip = ip;
+        if (!callValue(vm, peekN(argCount), argCount)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        goto op_RETURN;
+      }
       ObjClosure *closure = AS_CLOSURE(peekN(argCount));
+      if (argCount != closure->fn->arity) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      closeUpvalues(vm, frame->slots);
       frame->closure = closure;
       frame->ip = closure->fn->chunk.code;
       for (int i = 0; i <= argCount; i++) {
         frame->slots[i] = peekN(argCount - i);
       }
       vm->sp = frame->slots + argCount + 1;
+      reserveStack(vm, FRAME_SLOTS);
       ip = frame->ip;
       DISPATCH();
     }
+    CASE(LIST): {
+      int count = READ_BYTE();
+      ObjList *list = newList(vm);
+      for (int i = count - 1; i >= 0; i--) {
+        writeValueArray(vm, &list->items, peekN(i));
+      }
+      vm->sp -= count;
+      push(OBJ_VAL(list));
+      DISPATCH();
+    }
+    CASE(GET_INDEX): {
+      Value index = pop();
+      if (!getIndex(vm, peek(), index, &peek())) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      DISPATCH();
+    }
+    CASE(SET_INDEX): {
+      Value value = pop();
+      Value index = pop();
+      if (!setIndex(vm, peek(), index, value)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      peek() = value;
+      DISPATCH();
+    }
+    CASE(MAP): {
+      int count = READ_BYTE();
+      Value map;
+      if (!buildMap(vm, vm->sp - 2 * count, count, &map)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      vm->sp -= 2 * count;
+      push(map);
+      DISPATCH();
+    }
+    CASE(DELETE_INDEX): {
+      Value index = pop();
+      if (!deleteIndex(vm, pop(), index)) return INTERPRET_RUNTIME_ERROR;
+      DISPATCH();
+    }
   }
 
   #undef READ_BYTE
@@ -350,12 +950,622 @@ static InterpretResult run(VM *vm) {
   #undef READ_SHORT
 }
 
-InterpretResult interpret(VM *vm, const char *source) {
-  ObjFn* fn = compile(vm, source);
+// Runs frame, the newest one, from the bytecode offset until it returns.
+// A tail call can swap the frame's function, so the tier is picked again
+// after each one.
+static InterpretResult runFrame(VM *vm, CallFrame *frame, int offset) {
+  int base = vm->frameCount - 1;
+  for (;;) {
+    ObjFn *fn = frame->closure->fn;
+    if (fn->jit == NULL || vm->jitDepth >= JIT_MAX_DEPTH) {
+      frame->ip = fn->chunk.code + offset;
+      return run(vm, base);
+    }
+    vm->jitDepth++;
+    JitStatus status = jitEnter(vm, frame, offset);
+    vm->jitDepth--;
+    switch (status) {
+      case JIT_OK: return INTERPRET_OK;
+      case JIT_ERROR: return INTERPRET_RUNTIME_ERROR;
+      case JIT_TAIL: break;
+    }
+    offset = 0;
+    jitHot(vm, frame->closure->fn, &frame->closure->fn->callCount,
+           JIT_CALL_THRESHOLD);
+  }
+}
+
+Value *jitCall(VM *vm, Value *sp, int argCount) {
+  vm->sp = sp;
+  if (vm->gcRequested && !collectGarbage(vm)) return NULL;
+  int frameCount = vm->frameCount;
+  if (!callValue(vm, sp[-1 - argCount], argCount)) return NULL;
+  if (vm->frameCount > frameCount) {
+    CallFrame *frame = frameAt(vm, vm->frameCount - 1);
+    ObjFn *fn = frame->closure->fn;
+    jitHot(vm, fn, &fn->callCount, JIT_CALL_THRESHOLD);
+    if (runFrame(vm, frame, 0) != INTERPRET_OK) return NULL;
+  }
+  return vm->sp;
+}
+
+JitStatus jitTailCall(VM *vm, Value *sp, int argCount, CallFrame *frame) {
+  vm->sp = sp;
+  Value callee = sp[-1 - argCount];
+  if (!isObjType(callee, OBJ_CLOSURE)) {
+    if (!callValue(vm, callee, argCount)) return JIT_ERROR;
+    jitReturn(vm, vm->sp, frame);
+    return JIT_OK;
+  }
+  ObjClosure *closure = AS_CLOSURE(callee);
+  if (argCount != closure->fn->arity) return JIT_ERROR;
+  closeUpvalues(vm, frame->slots);
+  frame->closure = closure;
+  for (int i = 0; i <= argCount; i++) {
+    frame->slots[i] = sp[i - 1 - argCount];
+  }
+  vm->sp = frame->slots + argCount + 1;
+  reserveStack(vm, FRAME_SLOTS);
+  return JIT_TAIL;
+}
+
+void jitReturn(VM *vm, Value *sp, CallFrame *frame) {
+  Value result = sp[-1];
+  closeUpvalues(vm, frame->slots);
+  vm->frameCount--;
+  vm->sp = frame->slots;
+  *vm->sp++ = result;
+}
+
+Value *jitClosure(VM *vm, Value *sp, CallFrame *frame, int offset) {
+  vm->sp = sp;
+  uint8_t *ip = frame->closure->fn->chunk.code + offset + 1;
+  ObjFn *inner = AS_FN(frame->closure->fn->chunk.constants.values[*ip++]);
+  ObjClosure *closure = newClosure(vm, inner);
+  *vm->sp++ = OBJ_VAL(closure);
+  for (int i = 0; i < closure->upvalueCount; i++) {
+    uint8_t isLocal = *ip++;
+    uint8_t index = *ip++;
+    if (isLocal) {
+      closure->upvalues[i] = captureUpvalue(vm, frame->slots + index);
+    } else {
+      closure->upvalues[i] = frame->closure->upvalues[index];
+    }
+  }
+  return vm->sp;
+}
+
+void jitSetUpvalue(VM *vm, ObjUpvalue *upvalue, Value value) {
+  *upvalue->location = value;
+  WRITE_BARRIER(vm, upvalue, value);
+}
+
+bool jitSafepoint(VM *vm, Value *sp) {
+  vm->sp = sp;
+  return collectGarbage(vm);
+}
+
+Value *jitCloseUpvalue(VM *vm, Value *sp) {
+  closeUpvalues(vm, sp - 1);
+  return sp - 1;
+}
+
+Value jitArithmetic(VM *vm, Value a, Value b, int op) {
+  switch (op) {
+	case OP_ADD: return addObjects(vm, a, b);
+	case OP_SUBTRACT: return subtractNumbers(a, b);
+	case OP_MULTIPLY: return multiplyNumbers(a, b);
+	case OP_DIVIDE: return divideNumbers(a, b);
+	case OP_NEGATE: return negateNumber(a);
+	case OP_LESS: return BOOL_VAL(numberLess(a, b));
+  }
+  return NIL_VAL;
+}
+
+bool jitEqual(VM *vm, Value a, Value b) {
+  return valuesEqual(vm, a, b);
+}
+
+Value *jitList(VM *vm, Value *sp, int count) {
+  vm->sp = sp;
+  ObjList *list = newList(vm);
+  for (int i = count; i > 0; i--) writeValueArray(vm, &list->items, sp[-i]);
+  vm->sp -= count;
+  *vm->sp++ = OBJ_VAL(list);
+  return vm->sp;
+}
+
+Value *jitGetIndex(VM *vm, Value *sp) {
+  vm->sp = sp;
+  if (!getIndex(vm, sp[-2], sp[-1], &sp[-2])) return NULL;
+  return --vm->sp;
+}
+
+Value *jitSetIndex(VM *vm, Value *sp) {
+  vm->sp = sp;
+  if (!setIndex(vm, sp[-3], sp[-2], sp[-1])) return NULL;
+  sp[-3] = sp[-1];
+  vm->sp -= 2;
+  return vm->sp;
+}
+
+Value *jitMap(VM *vm, Value *sp, int count) {
+  vm->sp = sp;
+  if (!buildMap(vm, sp - 2 * count, count, &sp[-2 * count])) return NULL;
+  vm->sp -= 2 * count - 1;
+  return vm->sp;
+}
+
+Value *jitDeleteIndex(VM *vm, Value *sp) {
+  vm->sp = sp;
+  if (!deleteIndex(vm, sp[-2], sp[-1])) return NULL;
+  vm->sp -= 2;
+  return vm->sp;
+}
+
+void jitPrint(VM *vm, Value value) {
+  printValue(flatValue(vm, value));
+  printf("\n");
+}
+
+// Prepares the newest frame for the register backend: lowers its function
+// on first use and clears the registers the callee hasn't written yet, so
+// the collector never sees stale values below vm->sp.
+static bool enterRegisterFrame(VM *vm, CallFrame *frame) {
+  ObjFn *fn = frame->closure->fn;
+  if (fn->regCode == NULL && !lowerFn(vm, fn)) {
+    snprintf(vm->error, sizeof(vm->error),
+             "Function needs more registers than the register backend has.");
+    return false;
+  }
+  if (frame->slots + fn->regSlots > vm->stackEnd) {
+    reserveStack(vm, (int)(frame->slots + fn->regSlots - vm->sp));
+  }
+  Value *top = frame->slots + fn->regSlots;
+  for (Value *slot = frame->slots + fn->arity + 1; slot < top; slot++) {
+    *slot = NIL_VAL;
+  }
+  frame->ip = fn->regCode;
+  if (top > vm->sp) vm->sp = top;
+  return true;
+}
+
+// The call window of a register call starts at base. vm->sp stays above
+// the caller's registers while the callee runs.
+static bool callRegister(VM *vm, Value *base, int argCount) {
+  Value callee = *base;
+  if (!IS_OBJ(callee)) return false;
+  switch (OBJ_TYPE(callee)) {
+    case OBJ_CLOSURE:
+      if (!callAt(vm, AS_CLOSURE(callee), argCount, base)) return false;
+      return enterRegisterFrame(vm, frameAt(vm, vm->frameCount - 1));
+    case OBJ_NATIVE: {
+      // The native may grow the stack by calling back into a script.
+      ptrdiff_t at = base - vm->stack;
+      Value result;
+      if (!callNative(vm, AS_NATIVE(callee), argCount, base + 1, &result)) {
+        return false;
+      }
+      vm->stack[at] = result;
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+static void printRegisters(VM *vm, CallFrame *frame) {
+  printf("         ");
+  for (Value* slot = frame->slots; slot < vm->sp; slot++) {
+    printf("[ ");
+    printValue(*slot);
+    printf(" ]");
+  }
+  printf("\n");
+}
+
+// Runs register code until the frame at index baseFrame returns, leaving
+// its result in its slot 0.
+static InterpretResult runRegister(VM *vm, int baseFrame) {
+  CallFrame* frame = frameAt(vm, vm->frameCount - 1);
+  register uint8_t* ip = frame->ip;
+  Value result;
+
+  #define READ_BYTE()     (*ip++)
+  #define READ_SHORT()    (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+  #define R(n)            (frame->slots[n])
+  #define K(n)            (frame->closure->fn->chunk.constants.values[n])
+  #define BINARY_OP(fn)                                       \
+      do                                                      \
+      {                                                       \
+        uint8_t a = READ_BYTE();                              \
+        Value b = R(READ_BYTE());                             \
+        R(a) = fn(b, R(READ_BYTE()));                         \
+      }                                                       \
+      while (false)
+
+  #undef debug_trace
+  #if DEBUG_TRACE
+  	#define debug_trace()                                               \
+  	    do                                                              \
+  		{                                                               \
+  		  printRegisters(vm, frame);                                    \
+  		  disassembleRegInstruction(frame->closure->fn,                 \
+                                    (int)(ip - frame->closure->fn->regCode)); \
+        }                                                               \
+        while (false)
+  #else
+    #define debug_trace() do { } while (false)
+  #endif
+  static void *dispatchTable[] = {
+	  #define REGOP(name, _) &&rop_##name,
+	  #include "regopcode.h"
+	  #undef REGOP
+  };
+  #undef CASE
+  #define CASE(name)  rop_##name
+
+  INTERPRET_LOOP
+  {
+    CASE(MOVE): {
+      uint8_t a = READ_BYTE();
+      R(a) = R(READ_BYTE());
+      DISPATCH();
+    }
+    CASE(LOADK): {
+      uint8_t a = READ_BYTE();
+      R(a) = K(READ_BYTE());
+      DISPATCH();
+    }
+    CASE(LOADK_LONG): {
+      uint8_t a = READ_BYTE();
+      uint32_t index = READ_BYTE();
+      index |= READ_BYTE() << 8;
+      index |= READ_BYTE() << 16;
+      R(a) = K(index);
+      DISPATCH();
+    }
+    CASE(LOADNIL): {
+      R(READ_BYTE()) = NIL_VAL;
+      DISPATCH();
+    }
+    CASE(LOADTRUE): {
+      R(READ_BYTE()) = TRUE_VAL;
+      DISPATCH();
+    }
+    CASE(LOADFALSE): {
+      R(READ_BYTE()) = FALSE_VAL;
+      DISPATCH();
+    }
+    CASE(ADD): {
+      uint8_t a = READ_BYTE();
+      Value b = R(READ_BYTE());
+      Value c = R(READ_BYTE());
+      R(a) = !IS_NUMBER(b) ? addObjects(vm, b, c) : addNumbers(b, c);
+      DISPATCH();
+    }
+    CASE(ADDK): {
+      uint8_t a = READ_BYTE();
+      Value b = R(READ_BYTE());
+      Value c = K(READ_BYTE());
+      R(a) = !IS_NUMBER(b) ? addObjects(vm, b, c) : addNumbers(b, c);
+      DISPATCH();
+    }
+    CASE(INC): {
+      uint8_t a = READ_BYTE();
+      R(a) = addNumbers(R(a), INT_VAL(1));
+      DISPATCH();
+    }
+    CASE(SUBTRACT): {
+      BINARY_OP(subtractNumbers);
+      DISPATCH();
+    }
+    CASE(MULTIPLY): {
+      BINARY_OP(multiplyNumbers);
+      DISPATCH();
+    }
+    CASE(DIVIDE): {
+      BINARY_OP(divideNumbers);
+      DISPATCH();
+    }
+    CASE(LESS): {
+      uint8_t a = READ_BYTE();
+      Value b = R(READ_BYTE());
+      R(a) = BOOL_VAL(numberLess(b, R(READ_BYTE())));
+      DISPATCH();
+    }
+    CASE(EQ): {
+      uint8_t a = READ_BYTE();
+      Value b = R(READ_BYTE());
+      Value c = R(READ_BYTE());
+      R(a) = BOOL_VAL(IS_INT(b) && IS_INT(c) ? b == c
+                                             : valuesEqual(vm, b, c));
+      DISPATCH();
+    }
+    CASE(NEGATE): {
+      uint8_t a = READ_BYTE();
+      R(a) = negateNumber(R(READ_BYTE()));
+      DISPATCH();
+    }
+    CASE(PRINT): {
+      printValue(flatValue(vm, R(READ_BYTE())));
+      printf("\n");
+      DISPATCH();
+    }
+    CASE(DEFINE_GLOBAL): {
+      uint8_t a = READ_BYTE();
+      uint16_t slot = READ_SHORT();
+      vm->globalValues.values[slot] = R(a);
+      MARK_GLOBAL_CARD(vm, slot);
+      DISPATCH();
+    }
+    CASE(GET_GLOBAL): {
+      uint8_t a = READ_BYTE();
+      Value value = vm->globalValues.values[READ_SHORT()];
+      if (IS_UNDEFINED(value))
+        return INTERPRET_RUNTIME_ERROR;
+      R(a) = value;
+      DISPATCH();
+    }
+    CASE(SET_GLOBAL): {
+      uint8_t a = READ_BYTE();
+      uint16_t slot = READ_SHORT();
+      if (IS_UNDEFINED(vm->globalValues.values[slot]))
+        return INTERPRET_RUNTIME_ERROR;
+      vm->globalValues.values[slot] = R(a);
+      MARK_GLOBAL_CARD(vm, slot);
+      DISPATCH();
+    }
+    CASE(GET_UPVALUE): {
+      uint8_t a = READ_BYTE();
+      R(a) = *frame->closure->upvalues[READ_BYTE()]->location;
+      DISPATCH();
+    }
+    CASE(SET_UPVALUE): {
+      uint8_t a = READ_BYTE();
+      ObjUpvalue *upvalue = frame->closure->upvalues[READ_BYTE()];
+      *upvalue->location = R(a);
+      WRITE_BARRIER(vm, upvalue, R(a));
+      DISPATCH();
+    }
+    CASE(CLOSE_UPVALUE): {
+      closeUpvalues(vm, &R(READ_BYTE()));
+      DISPATCH();
+    }
+    CASE(JUMP): {
+      uint16_t offset = READ_SHORT();
+      ip += offset;
+      DISPATCH();
+    }
+    CASE(JUMP_IF_FALSE): {
+      Value condition = R(READ_BYTE());
+      uint16_t offset = READ_SHORT();
+      if (IS_FALSE(condition) || IS_NIL(condition))
+        ip += offset;
+      DISPATCH();
+    }
+    CASE(LESS_JUMP): {
+      Value a = R(READ_BYTE());
+      Value b = R(READ_BYTE());
+      uint16_t offset = READ_SHORT();
+      if (!numberLess(a, b))
+        ip += offset;
+      DISPATCH();
+    }
+    CASE(LESSK_JUMP): {
+      Value a = R(READ_BYTE());
+      Value b = K(READ_BYTE());
+      uint16_t offset = READ_SHORT();
+      if (!numberLess(a, b))
+        ip += offset;
+      DISPATCH();
+    }
+    CASE(LOOP): {
+      uint16_t offset = READ_SHORT();
+      ip -= offset;
+      if (vm->gcRequested && !collectGarbage(vm)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      DISPATCH();
+    }
+    CASE(CALL): {
+      uint8_t a = READ_BYTE();
+      int argCount = READ_BYTE();
+      frame->ip = ip;
+      if (vm->gcRequested && !collectGarbage(vm)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      if (!callRegister(vm, &R(a), argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      frame = frameAt(vm, vm->frameCount - 1);
+      ip = frame->ip;
+      DISPATCH();
+    }
+    CASE(TAIL_CALL): {
+      uint8_t a = READ_BYTE();
+      int argCount = READ_BYTE();
+      if (!isObjType(R(a), OBJ_CLOSURE)) {
+        // Natives don't need a frame, call and return the result.
+        if (!callRegister(vm, &R(a), argCount)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        result = R(a);
+        goto doReturn;
+      }
+      ObjClosure *closure = AS_CLOSURE(R(a));
+      if (argCount != closure->fn->arity) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      closeUpvalues(vm, frame->slots);
+      for (int i = 0; i <= argCount; i++) {
+        frame->slots[i] = R(a + i);
+      }
+      frame->closure = closure;
+      if (!enterRegisterFrame(vm, frame)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      ip = frame->ip;
+      DISPATCH();
+    }
+    CASE(CLOSURE): {
+      uint8_t a = READ_BYTE();
+      ObjFn* inner = AS_FN(K(READ_BYTE()));
+      ObjClosure *closure = newClosure(vm, inner);
+      R(a) = OBJ_VAL(closure);
+      for (int i = 0; i < closure->upvalueCount; i++) {
+        uint8_t isLocal = READ_BYTE();
+        uint8_t index = READ_BYTE();
+        if (isLocal) {
+          closure->upvalues[i] = captureUpvalue(vm, frame->slots + index);
+        } else {
+          closure->upvalues[i] = frame->closure->upvalues[index];
+        }
+      }
+      DISPATCH();
+    }
+    CASE(LIST): {
+      uint8_t a = READ_BYTE();
+      uint8_t b = READ_BYTE();
+      int count = READ_BYTE();
+      ObjList *list = newList(vm);
+      for (int i = 0; i < count; i++) {
+        writeValueArray(vm, &list->items, R(b + i));
+      }
+      R(a) = OBJ_VAL(list);
+      DISPATCH();
+    }
+    CASE(GET_INDEX): {
+      uint8_t a = READ_BYTE();
+      Value container = R(READ_BYTE());
+      if (!getIndex(vm, container, R(READ_BYTE()), &R(a))) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      DISPATCH();
+    }
+    CASE(SET_INDEX): {
+      Value container = R(READ_BYTE());
+      Value index = R(READ_BYTE());
+      if (!setIndex(vm, container, index, R(READ_BYTE()))) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      DISPATCH();
+    }
+    CASE(MAP): {
+      uint8_t a = READ_BYTE();
+      uint8_t b = READ_BYTE();
+      int count = READ_BYTE();
+      if (!buildMap(vm, &R(b), count, &R(a))) return INTERPRET_RUNTIME_ERROR;
+      DISPATCH();
+    }
+    CASE(DELETE_INDEX): {
+      Value container = R(READ_BYTE());
+      if (!deleteIndex(vm, container, R(READ_BYTE()))) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      DISPATCH();
+    }
+    CASE(RETURN): {
+      result = R(READ_BYTE());
+    doReturn:
+      closeUpvalues(vm, frame->slots);
+      vm->frameCount--;
+      frame->slots[0] = result;
+      if (vm->frameCount == baseFrame) {
+        vm->sp = frame->slots + 1;
+        return INTERPRET_OK;
+      }
+      frame = frameAt(vm, vm->frameCount - 1);
+      vm->sp = frame->slots + frame->closure->fn->regSlots;
+      ip = frame->ip;
+      DISPATCH();
+    }
+  }
+
+  #undef READ_BYTE
+  #undef READ_SHORT
+  #undef R
+  #undef K
+  #undef BINARY_OP
+}
+
+// Runs the frame callValue just pushed until it returns.
+static InterpretResult runNewest(VM *vm) {
+  CallFrame *frame = frameAt(vm, vm->frameCount - 1);
+  if (vm->backend == BACKEND_REGISTER) {
+    if (!enterRegisterFrame(vm, frame)) return INTERPRET_RUNTIME_ERROR;
+    return runRegister(vm, vm->frameCount - 1);
+  }
+  ObjFn *fn = frame->closure->fn;
+  jitHot(vm, fn, &fn->callCount, JIT_CALL_THRESHOLD);
+  return runFrame(vm, frame, 0);
+}
+
+InterpretResult callFunction(VM *vm, Value callee, int argCount,
+                             const Value *args, Value *result) {
+  vm->error[0] = '\0';
+  if (argCount > UINT8_MAX) return INTERPRET_RUNTIME_ERROR;
+  // A native may pass arguments from the stack, which can move.
+  ptrdiff_t argsAt = -1;
+  if (args >= vm->stack && args < vm->sp) argsAt = args - vm->stack;
+  reserveStack(vm, argCount + 1);
+  if (argsAt >= 0) args = vm->stack + argsAt;
+  int base = (int)(vm->sp - vm->stack);
+  int frameCount = vm->frameCount;
+  push(callee);
+  for (int i = 0; i < argCount; i++) push(args[i]);
+  InterpretResult status = INTERPRET_OK;
+  if (!callValue(vm, callee, argCount)) {
+    status = INTERPRET_RUNTIME_ERROR;
+  } else if (vm->frameCount > frameCount) {
+    status = runNewest(vm);
+  }
+  if (status == INTERPRET_OK) *result = vm->stack[base];
+  closeUpvalues(vm, vm->stack + base);
+  vm->frameCount = frameCount;
+  vm->sp = vm->stack + base;
+  return status;
+}
+
+NativeHandle prepareScript(VM *vm, const char *source) {
+  ObjFn *fn = compile(vm, source);
+  if (fn == NULL) return -1;
   push(OBJ_VAL(fn));
-  ObjClosure* closure = newClosure(vm, fn);
+  ObjClosure *closure = newClosure(vm, fn);
   pop();
-  push(OBJ_VAL(closure));
-  callValue(vm, OBJ_VAL(closure), 0);
-  return run(vm);
-}
\ No newline at end of file
+  return nativeHandle(vm, OBJ_VAL(closure));
+}
+
+bool getGlobal(VM *vm, const char *name, Value *value) {
+  Value slot;
+  if (!tableGet(&vm->globalNames, newStringLength(vm, name, strlen(name)),
+                &slot)) {
+    return false;
+  }
+  *value = vm->globalValues.values[(int)AS_NUM(slot)];
+  return *value != UNDEFINED_VAL;
+}
+
+static InterpretResult runScript(VM *vm, ObjFn *fn) {
+  push(OBJ_VAL(fn));
+  Value closure = OBJ_VAL(newClosure(vm, fn));
+  pop();
+  Value result;
+  InterpretResult status = callFunction(vm, closure, 0, NULL, &result);
+  // Keep the REPL usable after an error, e.g. a reference to an undefined
+  // global.
+  if (status == INTERPRET_RUNTIME_ERROR) resetStack(vm);
+  return status;
+}
+
+InterpretResult interpret(VM *vm, const char *source) {
+  ObjFn* fn = compile(vm, source);
+  if (fn == NULL) return INTERPRET_COMPILE_ERROR;
+  return runScript(vm, fn);
+}
+
+InterpretResult interpretImage(VM *vm, const Image *image) {
+  ObjFn *fn = loadImage(vm, image);
+  if (fn == NULL) return INTERPRET_COMPILE_ERROR;
+  return runScript(vm, fn);
+}
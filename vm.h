@@ -7,45 +7,149 @@
 #include "object.h"
 #include "chunk.h"
 #include "compiler.h"
+#include "cache.h"
+#include "memory.h"
+#include "slab.h"
+#include "sweeper.h"
+#include "native.h"
 
-typedef struct {
+typedef struct CallFrame {
   ObjClosure *closure;
   uint8_t *ip;
   Value *slots;
 } CallFrame;
 
-#define FRAME_MAX 64
-#define STACK_MAX (FRAME_MAX * UINT8_MAX)
+// Frames are allocated FRAME_BLOCK at a time in blocks that never move,
+// so pointers to them stay valid as calls nest deeper. The value stack is
+// one array that moves when it grows, see reserveStack.
+#define FRAME_BLOCK 16
+// How many calls deep scripts may go unless vm->maxFrames is changed.
+// Only the first JIT_MAX_DEPTH of them can run compiled, which nests C
+// calls, so raising it costs frame blocks and value stack, not C stack.
+#define FRAME_MAX_DEFAULT 10000
+// The values a call may push above the stack top before the next call
+// makes room again: a full frame of locals and as many temporaries.
+#define FRAME_SLOTS (2 * (UINT8_MAX + 1))
+#define STACK_INITIAL 64
+
+// How a VM executes functions. The register backend lowers each function
+// to register code the first time it is called.
+typedef enum {
+  BACKEND_STACK,
+  BACKEND_REGISTER
+} Backend;
 
 struct VM {
-  CallFrame frames[STACK_MAX];
+  CallFrame **frameBlocks;
+  int frameBlockCount;
   int frameCount;
+  int maxFrames;  // calls nested deeper are a runtime error
+  int frameLimit;  // frameCount at which callAt checks the two above
   //Chunk *chunk;
   //uint8_t *ip;
-  Value stack[STACK_MAX];
+  Value *stack;
+  Value *stackEnd;
   Value *sp;   // points to where the next value to be pushed will go
-  Table globals;
+  // Globals are resolved to slots at compile time. globalNames maps each
+  // name to its index in globalValues.
+  Table globalNames;
+  ValueArray globalValues;
   Table strings;
   Obj *first;
+  // Objects frozen by freezeHeap, and those of them that were written to
+  // since.
+  Obj *frozen;
+  Obj **frozenRoots;
+  int frozenRootCount;
+  int frozenRootCapacity;
   Compiler *compiler;
   ObjUpvalue *openUpvalues;
+  // Roots held by natives and embedders, see native.h.
+  ValueArray handles;
+  // What the last runtime error was about, empty if nothing said.
+  char error[256];
+  Backend backend;
+  // Compile hot functions of the stack backend to native code.
+  bool jitEnabled;
+  // Compiled frames running, each nested in C calls of the one below.
+  int jitDepth;
+  // 0 emits bytecode as parsed, 1 adds the peephole pass, 2 also runs the
+  // IR passes first.
+  int optLevel;
 
   size_t bytesAllocated;
   size_t nextGC;
+  GcConfig gcConfig;
+  GcPacer pacer;
 
   int grayCount;
   int grayCapacity;
   Obj **grayStack;
+
+  Nursery nursery;
+  SlabHeap slabs;
+  // Old objects that may point into the nursery.
+  Obj **remembered;
+  int rememberedCount;
+  int rememberedCapacity;
+  // One byte per 1 << GLOBAL_CARD_SHIFT slots of globalValues, set when a
+  // slot in it is stored to.
+  uint8_t *globalCards;
+  int globalCardCount;
+  // Set by allocation, served at the next safepoint.
+  bool gcRequested;
+  GcStats gcStats;
+  GcTelemetry *telemetry;
+  GcPhase gcPhase;
+  int gcBudget;
+  // Threads tracing in parallel, 1 traces on the VM's thread only.
+  int markThreads;
+  struct Marker *marker;
+  // Hand sweeping to a thread instead of doing it in slices.
+  bool sweepInBackground;
+  Sweeper sweeper;
+  Obj *sweepPrevious;
+  Obj *sweepCursor;
+  size_t gcBytesBefore;
+
+#if DEBUG_COUNT_DISPATCH
+  uint64_t dispatchCount;
+#endif
 };
 
+static inline CallFrame *frameAt(VM *vm, int index) {
+  return &vm->frameBlocks[(unsigned)index / FRAME_BLOCK]
+						 [(unsigned)index % FRAME_BLOCK];
+}
+
 typedef enum {
   INTERPRET_OK,
   INTERPRET_COMPILE_ERROR,
   INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
+// Global slots are 16-bit operands in the bytecode, the register code and
+// the image format, so no VM has more.
+#define GLOBAL_MAX (UINT16_MAX + 1)
+
 void initVM(VM *vm);
+int globalSlot(VM *vm, Value name);
 void freeVM(VM *vm);
 InterpretResult interpret(VM *vm, const char *source);
+InterpretResult interpretImage(VM *vm, const Image *image);
+
+// Embedding: compile a script once and call its functions many times.
+// prepareScript compiles source to a closure pinned by a handle, see
+// native.h, or returns -1 if it doesn't compile. Calling that closure
+// runs the script's top level, which defines its globals, and getGlobal
+// then finds its functions by name.
+NativeHandle prepareScript(VM *vm, const char *source);
+// The value of the global name, false if it isn't defined.
+bool getGlobal(VM *vm, const char *name, Value *value);
+// Calls callee with the argCount values of args and stores what it
+// returns in result, which the next collection may move unless the host
+// keeps it in a handle. Natives may call back into scripts this way.
+InterpretResult callFunction(VM *vm, Value callee, int argCount,
+                             const Value *args, Value *result);
 
 #endif